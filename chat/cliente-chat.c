@@ -1,33 +1,359 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/time.h>
 
 #define BUFFER_SIZE 1024
-#define FILE_CHUNK_SIZE 1024
+#define RECV_BUFFER_SIZE (64 * 1024)
+#define MAX_CABECERA 1024
+#define PAGINA_USUARIOS 20 // nombres por LIST/SEARCH; la respuesta entra en una cabecera
+#define SUMIDERO_SIZE (1024 * 1024)
+#define SUMIDERO_ALINEACION 4096
+#define MAX_TRANSFERENCIAS 16
+#define TROZO_SIZE (16 * 1024)      // payload de cada trama DATA (el servidor acepta hasta 64 KB)
+#define SALIDA_UMBRAL (64 * 1024)   // no se encolan más trozos mientras haya esto sin enviar
+#define ENTRADA_SIZE (64 * 1024)    // comandos leídos de stdin o del archivo de lote
+#define ESPERA_LOTE_MS 500          // silencio del servidor que da por terminado un lote
+#define MAX_SONDAS 1000
+#define ESPERA_PONG_MS 2000         // después de la última sonda, cuánto se esperan respuestas
+#define ESPERA_DESCARGA_MS 30000    // sin datos de una descarga por este tiempo, se da por cortada
 
-void enviar_archivo_client(int sock, const char *dest, const char *filepath);
+/*
+ * Destino de un archivo entrante. Los datos se acumulan en un buffer grande
+ * y alineado a página y se escriben a disco de a SUMIDERO_SIZE bytes, en lugar
+ * de hacer un fwrite() por cada recv().
+ */
+typedef struct
+{
+    int fd;              // -1 si el archivo no se pudo abrir (se descartan los datos)
+    char *buf;
+    size_t usado;
+    long total;          // tamaño anunciado en la cabecera
+    long recibido;
+    char nombre[256];
+    char remitente[64];
+} Sumidero;
+
+// Archivo que se está recibiendo; id -1 para el protocolo sin tramas
+typedef struct
+{
+    int activa;
+    long id;
+    Sumidero sumidero;
+    struct timespec inicio;
+    long long actividad_ns;     // cuándo llegaron datos por última vez
+} Descarga;
+
+// Archivo que se está enviando de a tramas DATA desde el bucle principal
+typedef struct
+{
+    int activa;
+    long id;
+    int fd;
+    char dest[64];
+    char nombre[256];
+    long total;
+    long enviado;
+    struct timespec inicio;
+} Subida;
+
+// Bytes pendientes de escribir en el socket (no bloqueante)
+typedef struct
+{
+    char *buf;
+    size_t ini, fin, cap;
+} Salida;
+
+/*
+ * Lector incremental de lo que llega del servidor. Cada mensaje es una línea
+ * terminada en '\n'; después de una cabecera FILE| (protocolo viejo) o de una
+ * trama DATA| vienen bytes crudos que van directo a la descarga sin ser
+ * inspeccionados.
+ */
+typedef enum
+{
+    LECTOR_LINEA,
+    LECTOR_DATOS
+} EstadoLector;
+
+typedef struct
+{
+    EstadoLector estado;
+    char linea[MAX_CABECERA];
+    size_t linea_len;
+    Descarga *destino;   // NULL: el payload se descarta
+    long restante;       // bytes de payload que faltan
+} Lector;
+
+/*
+ * Medición de latencia con /ping. Cada sonda sale como PING|dest|id|t0 y
+ * vuelve como PONG|dest|id|t0|rx1|tx1|residencia|rx2|tx2: rx/tx son sellos
+ * del reloj del servidor en la ida (1) y en la vuelta (2), y residencia es lo
+ * que tardó el otro cliente en contestar, medido con su propio reloj.
+ */
+typedef struct
+{
+    int activa;
+    char dest[64];
+    long id_base;
+    int total, enviadas, recibidas;
+    long intervalo_ms;
+    long long proxima_ns;       // cuándo sale la próxima sonda
+    long long ultima_ns;        // cuándo salió la última
+    double rtt_us[MAX_SONDAS];
+    double red_propia_us, servidor_us, red_dest_us, dest_us; // sumas para los promedios
+} Sonda;
+
+static int preasignar = 1;
+static int sock = -1;
+static Salida salida;
+static Subida subidas[MAX_TRANSFERENCIAS];
+static Descarga descargas[MAX_TRANSFERENCIAS];
+static long ultimo_id = 0;
+static Sonda sonda;
+
+// Contadores para el resumen del modo lote
+static struct
+{
+    long mensajes_enviados;
+    long mensajes_recibidos;
+    long archivos_enviados;
+    long archivos_recibidos;
+    long errores;
+    long pings_enviados;
+    long pongs_recibidos;
+    long long bytes_enviados;
+    long long bytes_recibidos;
+} stats;
+
+void enviar_archivo_client(const char *dest, const char *filepath);
+void iniciar_ping(const char *dest, int total, long intervalo_ms);
+void ping_tick(void);
+long ping_espera_ms(void);
+void descargas_vencer(Lector *lector);
+long descargas_espera_ms(void);
+void rellenar_salida(void);
+void mostrar_progreso(void);
+void lector_procesar(Lector *lector, const char *datos, size_t n);
+void lector_cortar(Lector *lector);
+int salida_encolar(Salida *s, const void *datos, size_t n);
+int salida_enviar(Salida *s, int fd);
+
+static void uso(const char *prog)
+{
+    fprintf(stderr, "Uso: %s [-P] [-b <archivo|->] [-w <ms>] <IP_o_DNS> <Puerto> <NombreUsuario>\n"
+                    "  -P  no preasignar espacio en disco para archivos recibidos\n"
+                    "  -b  modo lote: ejecuta los comandos del archivo (o de stdin con '-') sin esperar\n"
+                    "      entre ellos e imprime un resumen al terminar\n"
+                    "  -w  en modo lote, silencio del servidor que da por terminada la sesión (def. %d ms)\n",
+            prog, ESPERA_LOTE_MS);
+    exit(EXIT_FAILURE);
+}
+
+static double milisegundos_entre(const struct timespec *t0, const struct timespec *t1)
+{
+    return (t1->tv_sec - t0->tv_sec) * 1e3 + (t1->tv_nsec - t0->tv_nsec) / 1e6;
+}
+
+static long long ahora_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static double segundos_desde(const struct timespec *t0)
+{
+    struct timespec ahora;
+    clock_gettime(CLOCK_MONOTONIC, &ahora);
+    return (ahora.tv_sec - t0->tv_sec) + (ahora.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+static void procesar_comando(char *buffer)
+{
+    if (strncmp(buffer, "/file ", 6) == 0)
+    {
+        char *p = buffer + 6;
+        char *dest = strtok(p, " \n");
+        char *path = strtok(NULL, " \n");
+        if (dest && path)
+            enviar_archivo_client(dest, path);
+        else
+            printf("Uso: /file <destino> <ruta_del_archivo>\n");
+        return;
+    }
+    if (strncmp(buffer, "/progreso", 9) == 0)
+    {
+        mostrar_progreso();
+        return;
+    }
+    if (strncmp(buffer, "/usuarios", 9) == 0)
+    {
+        // Una página del índice del servidor, a partir del nombre dado
+        char *desde = strtok(buffer + 9, " \n");
+        char pedido[MAX_CABECERA];
+        int len = snprintf(pedido, sizeof(pedido), "LIST|%s|%d\n", desde ? desde : "", PAGINA_USUARIOS);
+        salida_encolar(&salida, pedido, len);
+        return;
+    }
+    if (strncmp(buffer, "/buscar ", 8) == 0)
+    {
+        char *prefijo = strtok(buffer + 8, " \n");
+        char *desde = strtok(NULL, " \n");
+        if (!prefijo)
+        {
+            printf("Uso: /buscar <prefijo> [desde]\n");
+            return;
+        }
+        char pedido[MAX_CABECERA];
+        int len = snprintf(pedido, sizeof(pedido), "SEARCH|%s|%d|%s\n", prefijo, PAGINA_USUARIOS, desde ? desde : "");
+        salida_encolar(&salida, pedido, len);
+        return;
+    }
+    if (strncmp(buffer, "/ping ", 6) == 0)
+    {
+        char *dest = strtok(buffer + 6, " \n");
+        char *n = strtok(NULL, " \n");
+        char *intervalo = strtok(NULL, " \n");
+        if (dest)
+            iniciar_ping(dest, n ? atoi(n) : 10, intervalo ? atol(intervalo) : 100);
+        else
+            printf("Uso: /ping <usuario> [cantidad] [intervalo_ms]\n");
+        return;
+    }
+
+    if (salida_encolar(&salida, buffer, strlen(buffer)) < 0)
+        fprintf(stderr, "Sin memoria para encolar el mensaje\n");
+    else
+        stats.mensajes_enviados++;
+}
+
+/*
+ * Lee lo que haya disponible en fd y ejecuta todas las líneas completas de
+ * una vez: con stdin redirigido o en modo lote se procesan cientos de
+ * comandos por despertar de select() y salen juntos en el mismo send().
+ * Devuelve 0 en fin de archivo.
+ */
+static int leer_comandos(int fd)
+{
+    static char entrada[ENTRADA_SIZE + 1];
+    static size_t entrada_len = 0;
+
+    ssize_t n = read(fd, entrada + entrada_len, ENTRADA_SIZE - entrada_len);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN))
+        return 1;
+
+    if (n > 0)
+        entrada_len += n;
+    else if (entrada_len > 0)
+        entrada[entrada_len++] = '\n'; // última línea sin '\n'
+
+    char *ini = entrada;
+    char *nl;
+    while ((nl = memchr(ini, '\n', entrada + entrada_len - ini)) != NULL)
+    {
+        char guardado = nl[1];
+        nl[1] = '\0';
+        if (nl > ini)
+            procesar_comando(ini);
+        nl[1] = guardado;
+        ini = nl + 1;
+    }
+    entrada_len -= ini - entrada;
+    memmove(entrada, ini, entrada_len);
+
+    if (entrada_len == ENTRADA_SIZE)
+    {
+        fprintf(stderr, "Línea demasiado larga, descartada\n");
+        entrada_len = 0;
+    }
+    return n > 0;
+}
+
+static int transferencias_activas(void)
+{
+    if (sonda.activa)
+        return 1;
+    for (int i = 0; i < MAX_TRANSFERENCIAS; i++)
+        if (subidas[i].activa || descargas[i].activa)
+            return 1;
+    return 0;
+}
+
+// Resumen del modo lote en una sola línea JSON
+static void imprimir_resumen(const struct timespec *inicio, const struct timespec *conectado,
+                             const struct timespec *enviado, int ok)
+{
+    struct timespec fin;
+    clock_gettime(CLOCK_MONOTONIC, &fin);
+    printf("{\"ok\":%s,\"mensajes_enviados\":%ld,\"archivos_enviados\":%ld,\"bytes_enviados\":%lld,"
+           "\"mensajes_recibidos\":%ld,\"archivos_recibidos\":%ld,\"bytes_recibidos\":%lld,\"errores\":%ld,"
+           "\"pings_enviados\":%ld,\"pongs_recibidos\":%ld,"
+           "\"conexion_ms\":%.3f,\"envio_ms\":%.3f,\"total_ms\":%.3f}\n",
+           ok ? "true" : "false", stats.mensajes_enviados, stats.archivos_enviados, stats.bytes_enviados,
+           stats.mensajes_recibidos, stats.archivos_recibidos, stats.bytes_recibidos, stats.errores,
+           stats.pings_enviados, stats.pongs_recibidos,
+           milisegundos_entre(inicio, conectado),
+           milisegundos_entre(inicio, enviado->tv_sec ? enviado : &fin),
+           milisegundos_entre(inicio, &fin));
+    fflush(stdout);
+}
 
 int main(int argc, char *argv[])
 {
-    if (argc != 4)
+    int opt;
+    const char *lote = NULL;
+    int espera_ms = ESPERA_LOTE_MS;
+    struct timespec t_inicio, t_conectado, t_enviado = {0, 0}, t_actividad;
+    clock_gettime(CLOCK_MONOTONIC, &t_inicio);
+
+    while ((opt = getopt(argc, argv, "Pb:w:")) != -1)
     {
-        fprintf(stderr, "Uso: %s <IP_o_DNS> <Puerto> <NombreUsuario>\n", argv[0]);
-        exit(EXIT_FAILURE);
+        switch (opt)
+        {
+        case 'P':
+            preasignar = 0;
+            break;
+        case 'b':
+            lote = optarg;
+            break;
+        case 'w':
+            espera_ms = atoi(optarg);
+            break;
+        default:
+            uso(argv[0]);
+        }
     }
+    if (argc - optind != 3)
+        uso(argv[0]);
+
+    const char *host = argv[optind];
+    int port = atoi(argv[optind + 1]);
+    const char *username = argv[optind + 2];
+    fd_set read_fds, write_fds;
+    static char rbuf[RECV_BUFFER_SIZE];
+    Lector lector = {.estado = LECTOR_LINEA};
+    int entrada_fd = STDIN_FILENO;
+    int entrada_abierta = 1;
 
-    const char *host = argv[1];
-    int port = atoi(argv[2]);
-    const char *username = argv[3];
-    int sock;
-    fd_set read_fds;
-    char buffer[BUFFER_SIZE];
+    if (lote && strcmp(lote, "-") != 0 && (entrada_fd = open(lote, O_RDONLY)) < 0)
+    {
+        perror(lote);
+        exit(EXIT_FAILURE);
+    }
 
     if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
     {
@@ -71,11 +397,23 @@ int main(int argc, char *argv[])
     }
     send(sock, "\n", 1, 0);
 
-    printf("Conectado como '%s'.\n"
+    // A partir de acá todo pasa por el bucle de eventos: el socket no debe bloquear
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    // Los mensajes ya se juntan en la cola de salida: Nagle solo agregaría demora
+    int uno = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &uno, sizeof(uno));
+    clock_gettime(CLOCK_MONOTONIC, &t_conectado);
+    t_actividad = t_conectado;
+
+    if (!lote)
+        printf("Conectado como '%s'.\n"
           "========================================================================================\n"
           " - Para escribir un mensaje use este comando 'PRIV|<usuario destino>|<mensaje>'\n"
           "\tPor ejemplo: PRIV|gabi|hola!\n"
           " - Para enviar archivos use el comando '/file <usuario destino> <direccion del archivo>'\n"
+          " - Para ver el avance de las transferencias use el comando '/progreso'\n"
+          " - Para medir la latencia hasta otro usuario use '/ping <usuario> [cantidad] [intervalo_ms]'\n"
+          " - Para ver los usuarios conectados use '/usuarios [desde]' o '/buscar <prefijo> [desde]'\n"
           "Precione Enter para actualizar los mensajes\n"
           "Para salir del chat precione Ctrl + C\n"
           "========================================================================================\n",
@@ -83,12 +421,55 @@ int main(int argc, char *argv[])
 
     while (1)
     {
+        ping_tick();
+        descargas_vencer(&lector);
+        rellenar_salida();
+
+        /*
+         * En modo lote la sesión termina cuando ya se leyó todo, no queda nada
+         * por enviar ni recibir y el servidor estuvo callado espera_ms.
+         */
+        struct timeval tv, *timeout = NULL;
+        long espera = ping_espera_ms();
+        long espera_descargas = descargas_espera_ms();
+        if (espera_descargas >= 0 && (espera < 0 || espera_descargas < espera))
+            espera = espera_descargas;
+        if (espera >= 0)
+        {
+            tv.tv_sec = espera / 1000;
+            tv.tv_usec = (espera % 1000) * 1000;
+            timeout = &tv;
+        }
+        if (lote && !entrada_abierta && salida.fin == salida.ini && !transferencias_activas())
+        {
+            struct timespec ahora;
+            clock_gettime(CLOCK_MONOTONIC, &ahora);
+            if (t_enviado.tv_sec == 0)
+                t_enviado = ahora;
+            double resta = espera_ms - milisegundos_entre(&t_actividad, &ahora);
+            if (resta <= 0)
+                break;
+            if (!timeout || resta < espera)
+            {
+                tv.tv_sec = (long)resta / 1000;
+                tv.tv_usec = ((long)resta % 1000) * 1000;
+                timeout = &tv;
+            }
+        }
+
         FD_ZERO(&read_fds);
-        FD_SET(STDIN_FILENO, &read_fds);
+        FD_ZERO(&write_fds);
+        if (entrada_abierta)
+            FD_SET(entrada_fd, &read_fds);
         FD_SET(sock, &read_fds);
+        if (salida.fin > salida.ini)
+            FD_SET(sock, &write_fds);
 
-        if (select(sock + 1, &read_fds, NULL, NULL, NULL) < 0)
+        int max_fd = sock > entrada_fd ? sock : entrada_fd;
+        if (select(max_fd + 1, &read_fds, &write_fds, NULL, timeout) < 0)
         {
+            if (errno == EINTR)
+                continue;
             perror("select");
             break;
         }
@@ -96,165 +477,816 @@ int main(int argc, char *argv[])
         // Mensajes del servidor
         if (FD_ISSET(sock, &read_fds))
         {
-            int bytes = recv(sock, buffer, BUFFER_SIZE, 0);
-            if (bytes <= 0)
+            ssize_t bytes = recv(sock, rbuf, sizeof(rbuf), 0);
+            if (bytes == 0 || (bytes < 0 && errno != EAGAIN && errno != EINTR))
             {
                 if (bytes == 0)
                     printf("Servidor desconectado.\n");
                 else
                     perror("recv");
 
+                lector_cortar(&lector);
                 close(sock);
+                if (lote)
+                    imprimir_resumen(&t_inicio, &t_conectado, &t_enviado, 0);
                 exit(EXIT_FAILURE);
             }
 
-            int offset = 0;
-            while (offset < bytes)
+            if (bytes > 0)
             {
-                char *fp = strstr(buffer + offset, "FILE|");
-                if (!fp)
-                {
-                    fwrite(buffer + offset, 1, bytes - offset, stdout);
-                    break;
-                }
-
-                int before = fp - (buffer + offset);
-                if (before > 0)
-                {
-                    fwrite(buffer + offset, 1, before, stdout);
-                }
-
-                char *nl = memchr(fp, '\n', bytes - offset - before);
-                if (!nl)
-                {
-                    fprintf(stderr, "Cabecera de FILE incompleta\n");
-                    break;
-                }
-
-                int header_len = nl - fp + 1;
-                char hdr[BUFFER_SIZE];
-                memcpy(hdr, fp, header_len);
-                hdr[header_len - 1] = '\0';
-
-                char *p = hdr + 5;
-                char *remit = strtok(p, "|");
-                char *fname = strtok(NULL, "|");
-                long filesize = atol(strtok(NULL, "\0"));
-
-                char localfile[256];
-                snprintf(localfile, sizeof(localfile), "recv_%s", fname);
-                FILE *f = fopen(localfile, "wb");
-                if (!f)
-                {
-                    perror("fopen");
-                    break;
-                }
-
-                int data_here = bytes - offset - before - header_len;
-                if (data_here > 0)
-                {
-                    fwrite(nl + 1, 1, data_here, f);
-                }
-                long received = data_here;
-                offset += before + header_len + data_here;
-
-                while (received < filesize)
-                {
-                    int want = (filesize - received > BUFFER_SIZE) ? BUFFER_SIZE : filesize - received;
-                    int r = recv(sock, buffer, want, 0);
-                    if (r <= 0)
-                    {
-                        perror("recv archivo");
-                        break;
-                    }
-                    fwrite(buffer, 1, r, f);
-                    received += r;
-                }
-                fclose(f);
-                printf("Archivo '%s' recibido de %s (%ld bytes)\n", fname, remit, received);
+                stats.bytes_recibidos += bytes;
+                clock_gettime(CLOCK_MONOTONIC, &t_actividad);
+                lector_procesar(&lector, rbuf, bytes);
+                fflush(stdout);
             }
         }
 
-        // Entrada del usuario
-        if (FD_ISSET(STDIN_FILENO, &read_fds))
+        // Lo encolado (mensajes y trozos de archivos) sale cuando el socket lo acepta
+        if (FD_ISSET(sock, &write_fds) && salida_enviar(&salida, sock) < 0)
         {
-            if (fgets(buffer, BUFFER_SIZE, stdin) != NULL)
-            {
-                if (strncmp(buffer, "/file ", 6) == 0)
-                {
-                    char *p = buffer + 6;
-                    char *dest = strtok(p, " \n");
-                    char *path = strtok(NULL, " \n");
-                    if (dest && path)
-                    {
-                        enviar_archivo_client(sock, dest, path);
-                    }
-                    else
-                    {
-                        printf("Uso: /file <destino> <ruta_del_archivo>\n");
-                    }
-                }
-                else
-                {
-                    if (send(sock, buffer, strlen(buffer), 0) < 0)
-                    {
-                        perror("Error al enviar");
-                        break;
-                    }
-                }
-            }
+            perror("Error al enviar");
+            break;
         }
+
+        // Entrada del usuario o del archivo de lote
+        if (entrada_abierta && FD_ISSET(entrada_fd, &read_fds) && !leer_comandos(entrada_fd))
+            entrada_abierta = 0;
     }
 
     close(sock);
+    if (lote)
+        imprimir_resumen(&t_inicio, &t_conectado, &t_enviado, 1);
     exit(EXIT_SUCCESS);
 }
 
-void enviar_archivo_client(int sock, const char *dest, const char *filepath)
+int salida_encolar(Salida *s, const void *datos, size_t n)
 {
-    FILE *f = fopen(filepath, "rb");
-    if (!f)
+    if (s->ini > 0 && s->fin + n > s->cap)
+    {
+        memmove(s->buf, s->buf + s->ini, s->fin - s->ini);
+        s->fin -= s->ini;
+        s->ini = 0;
+    }
+    if (s->fin + n > s->cap)
+    {
+        size_t cap = s->cap ? s->cap : SALIDA_UMBRAL;
+        while (cap < s->fin + n)
+            cap *= 2;
+        char *nuevo = realloc(s->buf, cap);
+        if (!nuevo)
+            return -1;
+        s->buf = nuevo;
+        s->cap = cap;
+    }
+    memcpy(s->buf + s->fin, datos, n);
+    s->fin += n;
+    return 0;
+}
+
+// Escribe lo que el socket acepte sin bloquear; -1 si la conexión falló
+int salida_enviar(Salida *s, int fd)
+{
+    while (s->ini < s->fin)
+    {
+        ssize_t n = send(fd, s->buf + s->ini, s->fin - s->ini, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        s->ini += n;
+        stats.bytes_enviados += n;
+    }
+    s->ini = s->fin = 0;
+    return 0;
+}
+
+// Registra el archivo como transferencia en segundo plano; los datos salen desde el bucle
+void enviar_archivo_client(const char *dest, const char *filepath)
+{
+    Subida *sub = NULL;
+    for (int i = 0; i < MAX_TRANSFERENCIAS; i++)
+    {
+        if (!subidas[i].activa)
+        {
+            sub = &subidas[i];
+            break;
+        }
+    }
+    if (!sub)
+    {
+        printf("Demasiadas transferencias en curso (máximo %d)\n", MAX_TRANSFERENCIAS);
+        return;
+    }
+
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0)
     {
         perror("Error al abrir el archivo");
         return;
     }
-    if (fseek(f, 0, SEEK_END) != 0)
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
     {
-        perror("fseek");
-        fclose(f);
+        fprintf(stderr, "'%s' no es un archivo regular\n", filepath);
+        close(fd);
         return;
     }
-    long filesize = ftell(f);
-    fseek(f, 0, SEEK_SET);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    const char *base = strrchr(filepath, '/');
+    base = base ? base + 1 : filepath;
 
+    memset(sub, 0, sizeof(*sub));
+    sub->id = ++ultimo_id;
+    sub->fd = fd;
+    sub->total = st.st_size;
+    snprintf(sub->dest, sizeof(sub->dest), "%s", dest);
+    snprintf(sub->nombre, sizeof(sub->nombre), "%s", base);
+    clock_gettime(CLOCK_MONOTONIC, &sub->inicio);
+
+    // Cabecera: FILE|destino|filename|filesize|id
     char header[BUFFER_SIZE];
-    snprintf(header, sizeof(header), "FILE|%s|%s|%ld", dest, filepath, filesize);
-    if (send(sock, header, strlen(header), 0) < 0)
+    int len = snprintf(header, sizeof(header), "FILE|%s|%s|%ld|%ld\n", sub->dest, sub->nombre, sub->total, sub->id);
+    if (salida_encolar(&salida, header, len) < 0)
     {
-        perror("Error al enviar cabecera de archivo");
-        fclose(f);
+        fprintf(stderr, "Sin memoria para encolar el archivo\n");
+        close(fd);
         return;
     }
-    send(sock, "\n", 1, 0);
+    sub->activa = 1;
+    printf("Enviando '%s' a %s en segundo plano (#%ld, %ld bytes)\n", sub->nombre, sub->dest, sub->id, sub->total);
+}
+
+static void terminar_subida(Subida *sub, const char *error)
+{
+    close(sub->fd);
+    sub->activa = 0;
+    if (error)
+    {
+        // Un DATA vacío le avisa al receptor que la transferencia no sigue
+        char header[BUFFER_SIZE];
+        int len = snprintf(header, sizeof(header), "DATA|%s|%ld|0\n", sub->dest, sub->id);
+        salida_encolar(&salida, header, len);
+        fprintf(stderr, "Envío de '%s' a %s cancelado: %s\n", sub->nombre, sub->dest, error);
+        return;
+    }
+    stats.archivos_enviados++;
+    double t = segundos_desde(&sub->inicio);
+    printf("Archivo enviado a %s: %s (%ld bytes, %.1f KB/s)\n", sub->dest, sub->nombre, sub->enviado,
+           t > 0 ? sub->enviado / t / 1024 : 0.0);
+}
 
-    char buf[FILE_CHUNK_SIZE];
-    long sent = 0;
-    while (sent < filesize)
+static void cancelar_subida(long id, const char *motivo)
+{
+    for (int i = 0; i < MAX_TRANSFERENCIAS; i++)
     {
-        size_t to_read = (filesize - sent > FILE_CHUNK_SIZE) ? FILE_CHUNK_SIZE : (filesize - sent);
-        size_t r = fread(buf, 1, to_read, f);
-        if (r <= 0)
+        if (subidas[i].activa && subidas[i].id == id)
         {
-            perror("Error de lectura de archivo");
-            break;
+            close(subidas[i].fd);
+            subidas[i].activa = 0;
+            fprintf(stderr, "Envío de '%s' a %s cancelado: %s\n", subidas[i].nombre, subidas[i].dest, motivo);
         }
-        if (send(sock, buf, r, 0) < 0)
+    }
+}
+
+/*
+ * Encola un trozo de cada subida activa por turno hasta llenar SALIDA_UMBRAL,
+ * así varias transferencias avanzan a la par y los mensajes de chat nunca
+ * esperan detrás de un archivo entero.
+ */
+void rellenar_salida(void)
+{
+    static char trozo[TROZO_SIZE];
+    static int turno = 0;
+
+    while (salida.fin - salida.ini < SALIDA_UMBRAL)
+    {
+        int encolado = 0;
+        for (int k = 0; k < MAX_TRANSFERENCIAS && salida.fin - salida.ini < SALIDA_UMBRAL; k++)
         {
-            perror("Error al enviar datos de archivo");
+            Subida *sub = &subidas[(turno + k) % MAX_TRANSFERENCIAS];
+            if (!sub->activa)
+                continue;
+            if (sub->enviado == sub->total)
+            {
+                terminar_subida(sub, NULL);
+                continue;
+            }
+
+            long want = sub->total - sub->enviado;
+            if (want > TROZO_SIZE)
+                want = TROZO_SIZE;
+            ssize_t r = pread(sub->fd, trozo, want, sub->enviado);
+            if (r <= 0)
+            {
+                terminar_subida(sub, r < 0 ? strerror(errno) : "el archivo se achicó");
+                continue;
+            }
+
+            char header[BUFFER_SIZE];
+            int len = snprintf(header, sizeof(header), "DATA|%s|%ld|%zd\n", sub->dest, sub->id, r);
+            if (salida_encolar(&salida, header, len) < 0 || salida_encolar(&salida, trozo, r) < 0)
+            {
+                terminar_subida(sub, "sin memoria");
+                continue;
+            }
+            sub->enviado += r;
+            encolado = 1;
+        }
+        turno = (turno + 1) % MAX_TRANSFERENCIAS;
+        if (!encolado)
             break;
+    }
+}
+
+void mostrar_progreso(void)
+{
+    int hay = 0;
+    for (int i = 0; i < MAX_TRANSFERENCIAS; i++)
+    {
+        Subida *sub = &subidas[i];
+        if (!sub->activa)
+            continue;
+        double t = segundos_desde(&sub->inicio);
+        printf("  envío     #%ld %s -> %s: %3.0f%% (%ld/%ld bytes, %.1f KB/s)\n", sub->id, sub->nombre, sub->dest,
+               sub->total ? 100.0 * sub->enviado / sub->total : 100.0, sub->enviado, sub->total,
+               t > 0 ? sub->enviado / t / 1024 : 0.0);
+        hay = 1;
+    }
+    for (int i = 0; i < MAX_TRANSFERENCIAS; i++)
+    {
+        Descarga *d = &descargas[i];
+        if (!d->activa)
+            continue;
+        Sumidero *s = &d->sumidero;
+        double t = segundos_desde(&d->inicio);
+        printf("  recepción #%ld %s <- %s: %3.0f%% (%ld/%ld bytes, %.1f KB/s)\n", d->id, s->nombre, s->remitente,
+               s->total ? 100.0 * s->recibido / s->total : 100.0, s->recibido, s->total,
+               t > 0 ? s->recibido / t / 1024 : 0.0);
+        hay = 1;
+    }
+    if (!hay)
+        printf("No hay transferencias en curso\n");
+}
+
+void iniciar_ping(const char *dest, int total, long intervalo_ms)
+{
+    if (sonda.activa)
+    {
+        printf("Ya hay una medición en curso hacia %s\n", sonda.dest);
+        return;
+    }
+    if (total < 1 || total > MAX_SONDAS)
+    {
+        printf("La cantidad de sondas debe estar entre 1 y %d\n", MAX_SONDAS);
+        return;
+    }
+
+    memset(&sonda, 0, sizeof(sonda));
+    snprintf(sonda.dest, sizeof(sonda.dest), "%s", dest);
+    sonda.total = total;
+    sonda.intervalo_ms = intervalo_ms > 0 ? intervalo_ms : 1;
+    sonda.id_base = ultimo_id + 1;
+    ultimo_id += total;
+    sonda.proxima_ns = ahora_ns();
+    sonda.activa = 1;
+}
+
+static int comparar_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void terminar_ping(void)
+{
+    sonda.activa = 0;
+    int n = sonda.recibidas < MAX_SONDAS ? sonda.recibidas : MAX_SONDAS;
+    printf("Latencia con %s: %d sondas enviadas, %d respondidas (%.0f%% perdidas)\n", sonda.dest,
+           sonda.enviadas, n, sonda.enviadas ? 100.0 * (sonda.enviadas - sonda.recibidas) / sonda.enviadas : 0.0);
+    if (n == 0)
+        return;
+
+    double ordenadas[MAX_SONDAS], suma = 0;
+    memcpy(ordenadas, sonda.rtt_us, n * sizeof(double));
+    qsort(ordenadas, n, sizeof(double), comparar_double);
+    for (int i = 0; i < n; i++)
+        suma += ordenadas[i];
+    printf("  ida y vuelta: min %.1f us, media %.1f, p50 %.1f, p99 %.1f, max %.1f\n", ordenadas[0], suma / n,
+           ordenadas[n / 2], ordenadas[(n * 99) / 100 < n ? (n * 99) / 100 : n - 1], ordenadas[n - 1]);
+    printf("  promedios: red propia %.1f us, servidor %.1f us, red de %s %.1f us, %s %.1f us\n",
+           sonda.red_propia_us / n, sonda.servidor_us / n, sonda.dest, sonda.red_dest_us / n, sonda.dest,
+           sonda.dest_us / n);
+
+    // Histograma en potencias de 2 de microsegundos
+    int cubetas[32] = {0}, max_cubeta = 0, tope = 0;
+    for (int i = 0; i < n; i++)
+    {
+        int b = 0;
+        while (b < 31 && ordenadas[i] >= (double)(1u << (b + 1)))
+            b++;
+        cubetas[b]++;
+        if (cubetas[b] > max_cubeta)
+            max_cubeta = cubetas[b];
+        if (b > tope)
+            tope = b;
+    }
+    for (int b = 0; b <= tope; b++)
+    {
+        if (cubetas[b] == 0 && (b == 0 || cubetas[b - 1] == 0))
+            continue;
+        int barra = cubetas[b] * 40 / max_cubeta;
+        printf("  %8u - %8u us |%-40.*s %d\n", 1u << b, 1u << (b + 1), barra,
+               "########################################", cubetas[b]);
+    }
+}
+
+// Emite la próxima sonda cuando corresponde y cierra la medición al terminar
+void ping_tick(void)
+{
+    if (!sonda.activa)
+        return;
+
+    long long ahora = ahora_ns();
+    if (sonda.enviadas < sonda.total && ahora >= sonda.proxima_ns)
+    {
+        char msg[BUFFER_SIZE];
+        int len = snprintf(msg, sizeof(msg), "PING|%s|%ld|%lld\n", sonda.dest, sonda.id_base + sonda.enviadas,
+                           ahora_ns());
+        salida_encolar(&salida, msg, len);
+        sonda.enviadas++;
+        sonda.ultima_ns = ahora;
+        sonda.proxima_ns += sonda.intervalo_ms * 1000000LL;
+        stats.pings_enviados++;
+    }
+
+    if (sonda.enviadas == sonda.total &&
+        (sonda.recibidas == sonda.total || ahora - sonda.ultima_ns > ESPERA_PONG_MS * 1000000LL))
+        terminar_ping();
+}
+
+// Milisegundos hasta el próximo evento de la medición, -1 si no hay ninguna
+long ping_espera_ms(void)
+{
+    if (!sonda.activa)
+        return -1;
+    long long objetivo = sonda.enviadas < sonda.total ? sonda.proxima_ns
+                                                       : sonda.ultima_ns + ESPERA_PONG_MS * 1000000LL;
+    long long resta = objetivo - ahora_ns();
+    return resta > 0 ? (resta + 999999) / 1000000 : 0;
+}
+
+// PING|remitente|id|t0|rx1|tx1: se contesta en el acto con el tiempo que estuvo acá
+static void responder_ping(char *campos, long long llegada_ns)
+{
+    char *remit = strtok(campos, "|");
+    char *resto = strtok(NULL, "");
+    if (!remit || !resto)
+        return;
+
+    char msg[BUFFER_SIZE];
+    int len = snprintf(msg, sizeof(msg), "PONG|%s|%s|%lld\n", remit, resto, ahora_ns() - llegada_ns);
+    salida_encolar(&salida, msg, len);
+}
+
+// PONG|remitente|id|t0|rx1|tx1|residencia|rx2|tx2
+static void recibir_pong(char *campos, long long llegada_ns)
+{
+    long long v[7];
+    char *remit = strtok(campos, "|");
+    for (int k = 0; k < 7; k++)
+    {
+        char *c = strtok(NULL, "|");
+        if (!c)
+            return;
+        v[k] = atoll(c);
+    }
+    long id = v[0];
+    if (!sonda.activa || !remit || strcmp(remit, sonda.dest) != 0 ||
+        id < sonda.id_base || id >= sonda.id_base + sonda.enviadas)
+        return;
+    stats.pongs_recibidos++;
+
+    long long t0 = v[1], rx1 = v[2], tx1 = v[3], residencia = v[4], rx2 = v[5], tx2 = v[6];
+    double rtt = (llegada_ns - t0) / 1e3;
+    double servidor = ((tx1 - rx1) + (tx2 - rx2)) / 1e3;
+    double dest = residencia / 1e3;
+    double red_dest = (rx2 - tx1) / 1e3 - dest;
+    double red_propia = rtt - (tx2 - rx1) / 1e3;
+
+    if (sonda.recibidas < MAX_SONDAS)
+        sonda.rtt_us[sonda.recibidas] = rtt;
+    sonda.recibidas++;
+    sonda.red_propia_us += red_propia;
+    sonda.servidor_us += servidor;
+    sonda.red_dest_us += red_dest;
+    sonda.dest_us += dest;
+
+    printf("PONG de %s #%ld: %.1f us = red propia %.1f + servidor %.1f + red de %s %.1f + %s %.1f\n", remit,
+           id - sonda.id_base + 1, rtt, red_propia, servidor, remit, red_dest, remit, dest);
+}
+
+// Escribe n bytes completos, reintentando escrituras parciales
+static int escribir_todo(int fd, const char *buf, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t w = write(fd, buf, n);
+        if (w < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += w;
+        n -= w;
+    }
+    return 0;
+}
+
+static void sumidero_abrir(Sumidero *s, const char *remitente, const char *fname, long total)
+{
+    if (posix_memalign((void **)&s->buf, SUMIDERO_ALINEACION, SUMIDERO_SIZE) != 0)
+        s->buf = NULL;
+
+    // Nunca usar la ruta que manda el remitente, solo el nombre final
+    const char *base = strrchr(fname, '/');
+    base = base ? base + 1 : fname;
+    snprintf(s->nombre, sizeof(s->nombre), "recv_%s", base);
+    snprintf(s->remitente, sizeof(s->remitente), "%s", remitente);
+    s->usado = 0;
+    s->total = total;
+    s->recibido = 0;
+
+    s->fd = open(s->nombre, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (s->fd < 0 || s->buf == NULL)
+    {
+        perror("open");
+        if (s->fd >= 0)
+            close(s->fd);
+        s->fd = -1;
+        return;
+    }
+
+#ifdef __linux__
+    // Reservar el espacio de una vez evita fragmentación y detecta disco lleno antes de recibir
+    if (preasignar && total > 0 && fallocate(s->fd, 0, 0, total) < 0 &&
+        errno != EOPNOTSUPP && errno != ENOSYS)
+    {
+        perror("fallocate");
+        close(s->fd);
+        unlink(s->nombre);
+        s->fd = -1;
+    }
+#endif
+}
+
+static void sumidero_vaciar(Sumidero *s)
+{
+    if (s->fd >= 0 && s->usado > 0 && escribir_todo(s->fd, s->buf, s->usado) < 0)
+    {
+        perror("write");
+        close(s->fd);
+        s->fd = -1;
+    }
+    s->usado = 0;
+}
+
+static void sumidero_escribir(Sumidero *s, const char *datos, size_t n)
+{
+    s->recibido += n;
+    if (s->fd < 0)
+        return; // se consumen igual para no perder el sincronismo del stream
+
+    // Cada llamada trae a lo sumo un recv() (RECV_BUFFER_SIZE): siempre se acumula
+    while (n > 0)
+    {
+        size_t cabe = SUMIDERO_SIZE - s->usado;
+        size_t copiar = n < cabe ? n : cabe;
+        memcpy(s->buf + s->usado, datos, copiar);
+        s->usado += copiar;
+        datos += copiar;
+        n -= copiar;
+        if (s->usado == SUMIDERO_SIZE)
+            sumidero_vaciar(s);
+    }
+}
+
+static void sumidero_cerrar(Sumidero *s)
+{
+    sumidero_vaciar(s);
+    free(s->buf);
+    s->buf = NULL;
+    if (s->fd < 0)
+    {
+        fprintf(stderr, "Archivo '%s' de %s descartado (%ld bytes)\n", s->nombre, s->remitente, s->recibido);
+        return;
+    }
+
+    // Si la transferencia se cortó, no dejar la cola preasignada en el archivo
+    if (s->recibido < s->total && ftruncate(s->fd, s->recibido) < 0)
+        perror("ftruncate");
+    close(s->fd);
+    s->fd = -1;
+
+    if (s->recibido < s->total)
+        fprintf(stderr, "Archivo '%s' de %s incompleto (%ld de %ld bytes)\n",
+                s->nombre, s->remitente, s->recibido, s->total);
+    else
+    {
+        stats.archivos_recibidos++;
+        printf("Archivo '%s' recibido de %s (%ld bytes)\n", s->nombre, s->remitente, s->recibido);
+    }
+}
+
+static Descarga *buscar_descarga(const char *remitente, long id)
+{
+    for (int i = 0; i < MAX_TRANSFERENCIAS; i++)
+        if (descargas[i].activa && descargas[i].id == id &&
+            strcmp(descargas[i].sumidero.remitente, remitente) == 0)
+            return &descargas[i];
+    return NULL;
+}
+
+static Descarga *abrir_descarga(const char *remitente, const char *fname, long total, long id)
+{
+    Descarga *d = NULL;
+    for (int i = 0; i < MAX_TRANSFERENCIAS && !d; i++)
+        if (!descargas[i].activa)
+            d = &descargas[i];
+    if (!d)
+    {
+        fprintf(stderr, "Demasiadas recepciones en curso, '%s' de %s descartado\n", fname, remitente);
+        return NULL;
+    }
+
+    d->id = id;
+    d->activa = 1;
+    clock_gettime(CLOCK_MONOTONIC, &d->inicio);
+    d->actividad_ns = ahora_ns();
+    sumidero_abrir(&d->sumidero, remitente, fname, total);
+    return d;
+}
+
+static void cerrar_descarga(Descarga *d)
+{
+    sumidero_cerrar(&d->sumidero);
+    d->activa = 0;
+}
+
+// La descarga no va a completarse: se cierra lo recibido y cuenta como error
+static void cortar_descarga(Descarga *d, const char *motivo)
+{
+    stats.errores++;
+    fprintf(stderr, "Recepción de '%s' de %s cortada: %s\n", d->sumidero.nombre, d->sumidero.remitente, motivo);
+    cerrar_descarga(d);
+}
+
+/*
+ * Si el remitente se cuelga sin que el servidor lo note, la descarga no
+ * recibe ni datos ni ABORT. Pasado ESPERA_DESCARGA_MS sin datos se corta,
+ * así no queda ocupando su lugar y el modo lote puede terminar.
+ */
+void descargas_vencer(Lector *lector)
+{
+    long long limite = ahora_ns() - ESPERA_DESCARGA_MS * 1000000LL;
+    for (int i = 0; i < MAX_TRANSFERENCIAS; i++)
+    {
+        Descarga *d = &descargas[i];
+        if (!d->activa || d->actividad_ns > limite)
+            continue;
+        // Lo que falte de la trama en curso se descarta
+        if (lector->destino == d)
+            lector->destino = NULL;
+        cortar_descarga(d, "sin datos");
+    }
+}
+
+// Milisegundos hasta que vence la descarga más vieja, -1 si no hay ninguna
+long descargas_espera_ms(void)
+{
+    long long primero = -1;
+    for (int i = 0; i < MAX_TRANSFERENCIAS; i++)
+        if (descargas[i].activa && (primero < 0 || descargas[i].actividad_ns < primero))
+            primero = descargas[i].actividad_ns;
+    if (primero < 0)
+        return -1;
+    long long resta = primero + ESPERA_DESCARGA_MS * 1000000LL - ahora_ns();
+    return resta > 0 ? (resta + 999999) / 1000000 : 0;
+}
+
+/*
+ * Respuesta paginada del índice de usuarios:
+ *   LIST|desde|total|n|nombres...   o   FOUND|prefijo|total|n|nombres...
+ * Si quedan más, se indica con qué comando pedir la página siguiente.
+ */
+static void mostrar_usuarios(char *linea)
+{
+    int es_lista = linea[0] == 'L';
+    char *campos = strchr(linea, '|') + 1;
+    char *sep = strchr(campos, '|');
+    if (!sep)
+        return;
+    *sep = '\0';
+    char *eco = campos;
+    char *total = strtok(sep + 1, "|");
+    char *n = strtok(NULL, "|");
+    if (!total || !n)
+        return;
+
+    if (es_lista)
+        printf("Usuarios conectados (%s en total):", total);
+    else
+        printf("Usuarios que empiezan con '%s' (%s en total):", eco, total);
+    char *nombre, *ultimo = NULL;
+    while ((nombre = strtok(NULL, "|")) != NULL)
+    {
+        printf(" %s", nombre);
+        ultimo = nombre;
+    }
+    printf("\n");
+    if (ultimo && atoi(n) == PAGINA_USUARIOS)
+    {
+        if (es_lista)
+            printf("  Hay más: /usuarios %s\n", ultimo);
+        else
+            printf("  Hay más: /buscar %s %s\n", eco, ultimo);
+    }
+}
+
+// Interpreta una línea completa (sin el '\n') recibida del servidor
+static void lector_linea(Lector *lector, char *linea, size_t len)
+{
+    long long llegada_ns = ahora_ns();
+    linea[len] = '\0';
+
+    if (strncmp(linea, "PING|", 5) == 0)
+    {
+        responder_ping(linea + 5, llegada_ns);
+        return;
+    }
+    if (strncmp(linea, "PONG|", 5) == 0)
+    {
+        recibir_pong(linea + 5, llegada_ns);
+        return;
+    }
+    if (strncmp(linea, "LIST|", 5) == 0 || strncmp(linea, "FOUND|", 6) == 0)
+    {
+        mostrar_usuarios(linea);
+        return;
+    }
+
+    // Cabecera: FILE|remitente|filename|filesize[|id]
+    if (strncmp(linea, "FILE|", 5) == 0)
+    {
+        char *remit = strtok(linea + 5, "|");
+        char *fname = strtok(NULL, "|");
+        char *tam = strtok(NULL, "|");
+        char *id = strtok(NULL, "|");
+        char *fin = NULL;
+        long filesize = tam ? strtol(tam, &fin, 10) : -1;
+        if (!remit || !fname || !tam || *fin != '\0' || filesize < 0)
+        {
+            fprintf(stderr, "Cabecera de FILE inválida\n");
+            return;
+        }
+
+        Descarga *d = abrir_descarga(remit, fname, filesize, id ? atol(id) : -1);
+        if (id)
+        {
+            // Los datos llegan después, en tramas DATA
+            if (d && filesize == 0)
+                cerrar_descarga(d);
+            return;
         }
-        sent += r;
+
+        // Protocolo viejo: el archivo entero viene a continuación
+        lector->destino = d;
+        lector->restante = filesize;
+        if (filesize > 0)
+            lector->estado = LECTOR_DATOS;
+        else if (d)
+            cerrar_descarga(d);
+        return;
+    }
+
+    // Trama: DATA|remitente|id|len + <len> bytes
+    if (strncmp(linea, "DATA|", 5) == 0)
+    {
+        char *remit = strtok(linea + 5, "|");
+        char *id = strtok(NULL, "|");
+        char *tam = strtok(NULL, "|");
+        long n = tam ? atol(tam) : -1;
+        if (!remit || !id || n < 0)
+        {
+            fprintf(stderr, "Trama DATA inválida\n");
+            return;
+        }
+
+        lector->destino = buscar_descarga(remit, atol(id));
+        lector->restante = n;
+        if (n > 0)
+            lector->estado = LECTOR_DATOS;
+        else if (lector->destino)
+            cerrar_descarga(lector->destino); // el remitente canceló
+        return;
     }
-    fclose(f);
-    printf("Archivo enviado a %s: %s (%ld bytes)\n", dest, filepath, sent);
+
+    // ABORT|remitente|id: el remitente se desconectó sin terminar el envío
+    if (strncmp(linea, "ABORT|", 6) == 0)
+    {
+        char *remit = strtok(linea + 6, "|");
+        char *id = strtok(NULL, "|");
+        Descarga *d = remit && id ? buscar_descarga(remit, atol(id)) : NULL;
+        if (d)
+            cortar_descarga(d, "el remitente se desconectó");
+        return;
+    }
+
+    // ERROR|mensaje|id: el servidor rechazó una transferencia nuestra
+    if (strncmp(linea, "ERROR|", 6) == 0)
+    {
+        stats.errores++;
+        char copia[MAX_CABECERA];
+        snprintf(copia, sizeof(copia), "%s", linea + 6);
+        char *motivo = strtok(copia, "|");
+        char *id = strtok(NULL, "|");
+        if (motivo && id)
+            cancelar_subida(atol(id), motivo);
+    }
+
+    stats.mensajes_recibidos++;
+    fwrite(linea, 1, len, stdout);
+    fputc('\n', stdout);
+}
+
+void lector_procesar(Lector *lector, const char *datos, size_t n)
+{
+    while (n > 0)
+    {
+        if (lector->estado == LECTOR_DATOS)
+        {
+            size_t tomar = n < (size_t)lector->restante ? n : (size_t)lector->restante;
+            Descarga *d = lector->destino;
+            if (d)
+            {
+                sumidero_escribir(&d->sumidero, datos, tomar);
+                d->actividad_ns = ahora_ns();
+            }
+            datos += tomar;
+            n -= tomar;
+            lector->restante -= tomar;
+            if (lector->restante == 0)
+            {
+                if (d && d->sumidero.recibido >= d->sumidero.total)
+                    cerrar_descarga(d);
+                lector->estado = LECTOR_LINEA;
+            }
+            continue;
+        }
+
+        const char *nl = memchr(datos, '\n', n);
+        size_t tomar = nl ? (size_t)(nl - datos) : n;
+        size_t cabe = sizeof(lector->linea) - 1 - lector->linea_len;
+        if (tomar > cabe)
+        {
+            // Línea demasiado larga para ser una cabecera: se muestra tal cual
+            fwrite(lector->linea, 1, lector->linea_len, stdout);
+            fwrite(datos, 1, tomar, stdout);
+            lector->linea_len = 0;
+        }
+        else
+        {
+            memcpy(lector->linea + lector->linea_len, datos, tomar);
+            lector->linea_len += tomar;
+        }
+        datos += tomar;
+        n -= tomar;
+
+        if (nl)
+        {
+            size_t len = lector->linea_len;
+            lector->linea_len = 0;
+            datos++;
+            n--;
+            lector_linea(lector, lector->linea, len);
+        }
+    }
+}
+
+// Cierra lo que haya quedado a medias cuando se corta la conexión
+void lector_cortar(Lector *lector)
+{
+    if (lector->estado == LECTOR_LINEA && lector->linea_len > 0)
+        fwrite(lector->linea, 1, lector->linea_len, stdout);
+    for (int i = 0; i < MAX_TRANSFERENCIAS; i++)
+        if (descargas[i].activa)
+            cerrar_descarga(&descargas[i]);
+    lector->estado = LECTOR_LINEA;
+    lector->linea_len = 0;
+    lector->destino = NULL;
 }
@@ -1,6 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include "registro.h"
 
 #ifdef _WIN32
 #include <winsock2.h>
@@ -8,82 +11,305 @@
 #pragma comment(lib, "ws2_32.lib")
 typedef int socklen_t;
 #define CERRAR_SOCKET(s) closesocket(s)
+#define poll WSAPoll
 #else
 #include <unistd.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #define CERRAR_SOCKET(s) close(s)
 #endif
 
-#define MAX_CLIENTS 10
+#ifndef MAX_CLIENTS
+#define MAX_CLIENTS 20000
+#endif
 #define BUFFER_SIZE 4096
 #define NAME_SIZE 32
 #define FILE_CHUNK_SIZE 4096
+#define MAX_TROZO 65536                          // payload máximo de una trama DATA
+#define ENTRADA_SIZE (MAX_TROZO + BUFFER_SIZE)
+#define DIFUSION_MAX 64      // hasta cuántos usuarios se difunde la lista completa (USERS|)
+#define MAX_PAGINA 200       // nombres por respuesta de LIST/SEARCH
+#define MAX_ENVIOS 64        // transferencias por tramas que se siguen por emisor
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// Transferencia por tramas en curso: cuántos bytes faltan para que termine
+typedef struct
+{
+    long id;
+    char destino[NAME_SIZE];
+    long restante;
+} Envio;
 
 typedef struct
 {
     int fd;
-    char nombre[NAME_SIZE];
+    int sondeo;                 // posición de su pollfd en fds[]
+    char nombre[NAME_SIZE];     // vacío hasta que llega la primera línea
+    char *entrada;              // bytes recibidos que todavía no forman una trama completa
+    size_t entrada_len;
+    size_t entrada_cap;         // crece hasta ENTRADA_SIZE solo si llegan tramas DATA grandes
+    Envio *envios;              // transferencias abiertas por este cliente, para avisar si se va
+    int n_envios;
 } Cliente;
 
 Cliente clientes[MAX_CLIENTS];
 
+/*
+ * Índice de usuarios: posiciones en clientes[] ordenadas por nombre. Las
+ * búsquedas por nombre, las páginas de LIST y los prefijos de SEARCH se
+ * resuelven con búsqueda binaria en O(log n + k) sin recorrer la tabla.
+ */
+int indice[MAX_CLIENTS];
+int usuarios = 0;
+
+/*
+ * Conjunto de poll(): fds[0] es el socket de escucha y cada cliente conectado
+ * (con nombre o esperándolo) tiene su pollfd. Se agrega al aceptar y se quita
+ * al desconectar moviendo el último a su lugar, así poll() no se rearma en
+ * cada vuelta. pos_cliente[k] dice a qué cliente corresponde fds[k].
+ */
+struct pollfd fds[MAX_CLIENTS + 1];
+int pos_cliente[MAX_CLIENTS + 1];
+int nfds = 0;
+
+// Momento en que volvió el último recv(): sello de recepción de las sondas PING/PONG
+long long t_recepcion_ns;
+
+long long monotonic_ns()
+{
+#ifdef _WIN32
+    LARGE_INTEGER frec, cuenta;
+    QueryPerformanceFrequency(&frec);
+    QueryPerformanceCounter(&cuenta);
+    return (long long)(cuenta.QuadPart * (1e9 / frec.QuadPart));
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#endif
+}
+
 void inicializar_clientes()
 {
     for (int i = 0; i < MAX_CLIENTS; i++)
     {
         clientes[i].fd = -1;
+        clientes[i].sondeo = -1;
         clientes[i].nombre[0] = '\0';
+        clientes[i].entrada = NULL;
+        clientes[i].entrada_len = 0;
+        clientes[i].entrada_cap = 0;
+        clientes[i].envios = NULL;
+        clientes[i].n_envios = 0;
     }
 }
 
-int nombre_duplicado(const char *nombre)
+// Primera posición del índice cuyo nombre no es menor que 'nombre'
+int indice_desde(const char *nombre)
 {
-    for (int i = 0; i < MAX_CLIENTS; i++)
-        if (clientes[i].fd != -1 && strcmp(clientes[i].nombre, nombre) == 0)
-            return 1;
+    int lo = 0, hi = usuarios;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (strcmp(clientes[indice[mid]].nombre, nombre) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Primera posición del índice cuyo nombre ya no empieza con 'prefijo' (ni es menor)
+int indice_fin_prefijo(const char *prefijo)
+{
+    size_t len = strlen(prefijo);
+    int lo = 0, hi = usuarios;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (strncmp(clientes[indice[mid]].nombre, prefijo, len) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+void indice_agregar(int idx)
+{
+    int pos = indice_desde(clientes[idx].nombre);
+    memmove(&indice[pos + 1], &indice[pos], (usuarios - pos) * sizeof(int));
+    indice[pos] = idx;
+    usuarios++;
+}
+
+void indice_quitar(int idx)
+{
+    int pos = indice_desde(clientes[idx].nombre);
+    if (pos < usuarios && indice[pos] == idx)
+    {
+        memmove(&indice[pos], &indice[pos + 1], (usuarios - pos - 1) * sizeof(int));
+        usuarios--;
+    }
+}
+
+void sondeo_agregar(int fd, int idx)
+{
+    fds[nfds].fd = fd;
+    fds[nfds].events = POLLIN;
+    fds[nfds].revents = 0;
+    pos_cliente[nfds] = idx;
+    if (idx >= 0)
+        clientes[idx].sondeo = nfds;
+    nfds++;
+}
+
+void sondeo_quitar(int idx)
+{
+    int k = clientes[idx].sondeo;
+    nfds--;
+    if (k != nfds)
+    {
+        fds[k] = fds[nfds];
+        pos_cliente[k] = pos_cliente[nfds];
+        clientes[pos_cliente[k]].sondeo = k;
+    }
+    clientes[idx].sondeo = -1;
+}
+
+// Envía todo el buffer aunque send() lo acepte de a partes
+int enviar_todo(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        int n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
     return 0;
 }
 
+int buscar_cliente(const char *nombre)
+{
+    int pos = indice_desde(nombre);
+    if (pos < usuarios && strcmp(clientes[indice[pos]].nombre, nombre) == 0)
+        return indice[pos];
+    return -1;
+}
+
+int nombre_duplicado(const char *nombre)
+{
+    return buscar_cliente(nombre) != -1;
+}
+
+/*
+ * La lista completa solo se difunde en salas chicas: con miles de usuarios
+ * cada alta o baja costaría un mensaje enorme por cliente. Por encima de
+ * DIFUSION_MAX los clientes piden con LIST/SEARCH la parte que muestran.
+ */
 void enviar_lista_usuarios()
 {
+    if (usuarios > DIFUSION_MAX)
+        return;
+
     char lista[BUFFER_SIZE] = "USERS|";
-    int primero = 1;
-    for (int i = 0; i < MAX_CLIENTS; i++)
+    for (int k = 0; k < usuarios; k++)
     {
-        if (clientes[i].fd != -1)
-        {
-            if (!primero)
-                strncat(lista, "|", sizeof(lista) - strlen(lista) - 1);
-            strncat(lista, clientes[i].nombre, sizeof(lista) - strlen(lista) - 1);
-            primero = 0;
-        }
+        if (k > 0)
+            strncat(lista, "|", sizeof(lista) - strlen(lista) - 1);
+        strncat(lista, clientes[indice[k]].nombre, sizeof(lista) - strlen(lista) - 1);
     }
+    strncat(lista, "\n", sizeof(lista) - strlen(lista) - 1);
 
-    for (int i = 0; i < MAX_CLIENTS; i++)
+    for (int k = 0; k < usuarios; k++)
+        enviar_todo(clientes[indice[k]].fd, lista, strlen(lista));
+}
+
+/*
+ * Respuesta a LIST y SEARCH: hasta 'cantidad' nombres que empiezan con
+ * 'prefijo', en orden, a partir del primero posterior a 'desde' (vacío para
+ * empezar desde el principio). Formato:
+ *   <verbo>|<prefijo o desde>|<total>|<n>|nombre|nombre...
+ * donde total es cuántos nombres coinciden en todo el índice.
+ */
+void enviar_pagina(int i, const char *verbo, const char *eco, const char *prefijo, const char *desde, int cantidad)
+{
+    if (cantidad <= 0 || cantidad > MAX_PAGINA)
+        cantidad = MAX_PAGINA;
+
+    int ini = indice_desde(prefijo);
+    int fin = prefijo[0] ? indice_fin_prefijo(prefijo) : usuarios;
+    int pos = ini;
+    if (desde[0])
     {
-        if (clientes[i].fd != -1)
-            send(clientes[i].fd, lista, strlen(lista), 0);
+        // Salta al primer nombre estrictamente mayor que el cursor
+        pos = indice_desde(desde);
+        if (pos < usuarios && strcmp(clientes[indice[pos]].nombre, desde) == 0)
+            pos++;
+        if (pos < ini)
+            pos = ini;
     }
+    int n = fin - pos < cantidad ? fin - pos : cantidad;
+    if (n < 0)
+        n = 0;
+
+    static char resp[MAX_PAGINA * (NAME_SIZE + 1) + BUFFER_SIZE];
+    int len = snprintf(resp, sizeof(resp), "%s|%s|%d|%d", verbo, eco, fin - ini, n);
+    for (int k = 0; k < n; k++)
+        len += snprintf(resp + len, sizeof(resp) - len, "|%s", clientes[indice[pos + k]].nombre);
+    len += snprintf(resp + len, sizeof(resp) - len, "\n");
+    enviar_todo(clientes[i].fd, resp, len);
 }
 
-void enviar_privado(const char *remitente, const char *destino, const char *mensaje)
+// Separa 'linea' en campos por '|', conservando los vacíos (a diferencia de strtok)
+int partir_campos(char *linea, char **campos, int max)
 {
-    char mensaje_formateado[BUFFER_SIZE];
-    snprintf(mensaje_formateado, sizeof(mensaje_formateado), "FROM|%s|%s", remitente, mensaje);
-    for (int i = 0; i < MAX_CLIENTS; i++)
+    int n = 0;
+    while (n < max)
     {
-        if (clientes[i].fd != -1 && strcmp(clientes[i].nombre, destino) == 0)
-        {
-            send(clientes[i].fd, mensaje_formateado, strlen(mensaje_formateado), 0);
-            return;
-        }
+        campos[n++] = linea;
+        char *sep = strchr(linea, '|');
+        if (!sep)
+            break;
+        *sep = '\0';
+        linea = sep + 1;
     }
+    return n;
+}
+
+void enviar_privado(const char *remitente, const char *destino, const char *mensaje)
+{
+    if (!destino || !mensaje)
+        return;
+
+    char mensaje_formateado[BUFFER_SIZE];
+    // Cada mensaje hacia el cliente termina en '\n' para que pueda separarlos
+    int len = strcspn(mensaje, "\r\n");
+    snprintf(mensaje_formateado, sizeof(mensaje_formateado), "FROM|%s|%.*s\n", remitente, len, mensaje);
+    int idx = buscar_cliente(destino);
+    if (idx >= 0)
+        enviar_todo(clientes[idx].fd, mensaje_formateado, strlen(mensaje_formateado));
 }
 
-void enviar_archivo(int idx_emisor, const char *destino, const char *filename, long filesize)
+/*
+ * Reenvío de archivos con el protocolo original: FILE|destino|filename|size\n
+ * seguido de <size> bytes crudos. Primero se usan los bytes que ya estaban
+ * en el buffer de entrada y el resto se lee del emisor hasta completar.
+ * Devuelve cuántos bytes del buffer se consumieron, o -1 si el emisor se
+ * desconectó a mitad de camino.
+ */
+long enviar_archivo(int idx_emisor, const char *destino, const char *filename, long filesize,
+                    const char *disponible, size_t disponible_len)
 {
     char header[BUFFER_SIZE];
 
@@ -92,46 +318,376 @@ void enviar_archivo(int idx_emisor, const char *destino, const char *filename, l
              clientes[idx_emisor].nombre, filename, filesize);
 
     // Buscar socket del destino
-    int fd_dest = -1;
-    for (int j = 0; j < MAX_CLIENTS; j++)
-    {
-        if (clientes[j].fd != -1 && strcmp(clientes[j].nombre, destino) == 0)
-        {
-            fd_dest = clientes[j].fd;
-            break;
-        }
-    }
+    int idx_dest = buscar_cliente(destino);
+    int fd_dest = idx_dest >= 0 ? clientes[idx_dest].fd : -1;
     if (fd_dest == -1)
     {
         char *err = "ERROR|Usuario receptor no encontrado\n";
-        send(clientes[idx_emisor].fd, err, strlen(err), 0);
-        return;
+        send(clientes[idx_emisor].fd, err, strlen(err), MSG_NOSIGNAL);
+        // Los datos se descartan igual para no interpretarlos como comandos
+    }
+    else
+    {
+        // Enviar cabecera al receptor
+        enviar_todo(fd_dest, header, strlen(header));
     }
 
-    // Enviar cabecera al receptor
-    send(fd_dest, header, strlen(header), 0);
+    long usados = disponible_len < (size_t)filesize ? (long)disponible_len : filesize;
+    if (fd_dest != -1 && usados > 0)
+        enviar_todo(fd_dest, disponible, usados);
 
-    // Transmitir el contenido en chunks
-    long remaining = filesize;
+    // Transmitir el contenido restante en chunks
+    long remaining = filesize - usados;
     char chunk[FILE_CHUNK_SIZE];
     while (remaining > 0)
     {
         int to_read = remaining > FILE_CHUNK_SIZE ? FILE_CHUNK_SIZE : remaining;
         int r = recv(clientes[idx_emisor].fd, chunk, to_read, 0);
         if (r <= 0)
-            break; // error o cliente desconectado
-        send(fd_dest, chunk, r, 0);
+            return -1; // error o cliente desconectado
+        if (fd_dest != -1)
+            enviar_todo(fd_dest, chunk, r);
         remaining -= r;
     }
+    return usados;
+}
+
+/*
+ * Registro de las transferencias por tramas de cada emisor. Si el emisor se
+ * desconecta a mitad de camino, cada receptor recibe ABORT|remitente|id\n y
+ * libera la descarga en lugar de esperar bytes que ya no van a llegar.
+ */
+void envio_abrir(int idx, const char *destino, long id, long filesize)
+{
+    Cliente *c = &clientes[idx];
+    if (filesize <= 0)
+        return;
+    if (!c->envios && !(c->envios = malloc(MAX_ENVIOS * sizeof(Envio))))
+        return;
+    if (c->n_envios == MAX_ENVIOS)
+    {
+        reg_aviso("%s tiene demasiadas transferencias abiertas, #%ld no se sigue", c->nombre, id);
+        return;
+    }
+    Envio *e = &c->envios[c->n_envios++];
+    e->id = id;
+    snprintf(e->destino, sizeof(e->destino), "%s", destino);
+    e->restante = filesize;
+}
+
+// Descuenta un trozo; la transferencia se olvida al completarse o con un DATA vacío
+void envio_avanzar(int idx, const char *destino, long id, long len)
+{
+    Cliente *c = &clientes[idx];
+    for (int k = 0; k < c->n_envios; k++)
+    {
+        Envio *e = &c->envios[k];
+        if (e->id != id || strcmp(e->destino, destino) != 0)
+            continue;
+        e->restante -= len;
+        if (len == 0 || e->restante <= 0)
+            *e = c->envios[--c->n_envios];
+        return;
+    }
+}
+
+void envios_abortar(int idx)
+{
+    Cliente *c = &clientes[idx];
+    for (int k = 0; k < c->n_envios; k++)
+    {
+        int idx_dest = buscar_cliente(c->envios[k].destino);
+        if (idx_dest < 0)
+            continue;
+        char msg[BUFFER_SIZE];
+        snprintf(msg, sizeof(msg), "ABORT|%s|%ld\n", c->nombre, c->envios[k].id);
+        enviar_todo(clientes[idx_dest].fd, msg, strlen(msg));
+    }
+    free(c->envios);
+    c->envios = NULL;
+    c->n_envios = 0;
+}
+
+/*
+ * Protocolo por tramas, que permite varias transferencias a la vez
+ * intercaladas con mensajes:
+ *   FILE|destino|filename|size|id\n   abre la transferencia <id>
+ *   DATA|destino|id|len\n + <len> bytes
+ * El receptor recibe lo mismo con el remitente en lugar del destino. Cada
+ * trama se reenvía completa, así nunca se mezcla con otros mensajes.
+ */
+void reenviar_cabecera_trozos(int idx_emisor, const char *destino, const char *filename,
+                              long filesize, long id)
+{
+    int idx_dest = buscar_cliente(destino);
+    if (idx_dest < 0)
+    {
+        char err[BUFFER_SIZE];
+        snprintf(err, sizeof(err), "ERROR|Usuario receptor no encontrado|%ld\n", id);
+        send(clientes[idx_emisor].fd, err, strlen(err), MSG_NOSIGNAL);
+        return;
+    }
+
+    char header[BUFFER_SIZE];
+    snprintf(header, sizeof(header), "FILE|%s|%s|%ld|%ld\n",
+             clientes[idx_emisor].nombre, filename, filesize, id);
+    if (enviar_todo(clientes[idx_dest].fd, header, strlen(header)) == 0)
+        envio_abrir(idx_emisor, destino, id, filesize);
+}
+
+void reenviar_trozo(int idx_emisor, const char *destino, long id, const char *datos, long len)
+{
+    envio_avanzar(idx_emisor, destino, id, len);
+    int idx_dest = buscar_cliente(destino);
+    if (idx_dest < 0)
+        return; // el receptor ya se fue: el emisor fue avisado al abrir la transferencia
+
+    reg_debug_cada(1000, "Trozo %ld de %s para %s (%ld bytes)", id, clientes[idx_emisor].nombre, destino, len);
+    char header[BUFFER_SIZE];
+    snprintf(header, sizeof(header), "DATA|%s|%ld|%ld\n", clientes[idx_emisor].nombre, id, len);
+    if (enviar_todo(clientes[idx_dest].fd, header, strlen(header)) == 0)
+        enviar_todo(clientes[idx_dest].fd, datos, len);
+}
+
+/*
+ * Sondas de latencia: PING|destino|<campos> y PONG|destino|<campos>.
+ * Se reenvían como CMD|remitente|<campos>|rx|tx, donde rx es cuándo volvió el
+ * recv() que trajo la sonda y tx el instante justo antes del send(), ambos
+ * con el reloj monotónico del servidor. Con los sellos de ida y de vuelta el
+ * cliente que originó la sonda separa el tiempo en cada red y en el servidor.
+ */
+void reenviar_sonda(int i, const char *cmd, char *resto)
+{
+    char *destino = strtok(resto, "|");
+    char *campos = strtok(NULL, "");
+    if (!destino || !campos)
+        return;
+
+    int idx_dest = buscar_cliente(destino);
+    if (idx_dest < 0)
+    {
+        char *err = "ERROR|Usuario receptor no encontrado\n";
+        send(clientes[i].fd, err, strlen(err), MSG_NOSIGNAL);
+        return;
+    }
+
+    char msg[BUFFER_SIZE];
+    snprintf(msg, sizeof(msg), "%s|%s|%s|%lld|%lld\n", cmd, clientes[i].nombre, campos,
+             t_recepcion_ns, monotonic_ns());
+    enviar_todo(clientes[idx_dest].fd, msg, strlen(msg));
+}
+
+// Comandos de una sola línea (sin el '\n')
+void procesar_linea(int i, char *linea)
+{
+    reg_debug_cada(1000, "Línea de %s: %.40s", clientes[i].nombre, linea);
+    if (strncmp(linea, "PING|", 5) == 0 || strncmp(linea, "PONG|", 5) == 0)
+    {
+        linea[4] = '\0';
+        reenviar_sonda(i, linea, linea + 5);
+        return;
+    }
+
+    // LIST|desde|cantidad  y  SEARCH|prefijo|cantidad[|desde]
+    if (strncmp(linea, "LIST|", 5) == 0 || strncmp(linea, "SEARCH|", 7) == 0)
+    {
+        char *campos[4] = {"", "", "", ""};
+        int n = partir_campos(linea, campos, 4);
+        int cantidad = n > 2 ? atoi(campos[2]) : MAX_PAGINA;
+        if (linea[0] == 'L')
+            enviar_pagina(i, "LIST", campos[1], "", campos[1], cantidad);
+        else
+            enviar_pagina(i, "FOUND", campos[1], campos[1], n > 3 ? campos[3] : "", cantidad);
+        return;
+    }
+
+    // Protocolo privado: PRIV|destino|texto
+    if (strncmp(linea, "PRIV|", 5) == 0)
+    {
+        char *p = linea + 5;
+        char *dst = strtok(p, "|");
+        char *msg = strtok(NULL, "");
+        // enviar_privado toma el nombre del emisor, el nombre del destino y el texto
+        enviar_privado(clientes[i].nombre, dst, msg);
+        return;
+    }
+
+    char *cmd = strtok(linea, "|");
+    if (cmd && strcmp(cmd, "TO") == 0)
+    {
+        char *destino = strtok(NULL, "|");
+        char *mensaje = strtok(NULL, "");
+        if (destino && mensaje)
+            enviar_privado(clientes[i].nombre, destino, mensaje);
+    }
+}
+
+int agrandar_entrada(Cliente *c, size_t minimo)
+{
+    size_t cap = c->entrada_cap ? c->entrada_cap : BUFFER_SIZE;
+    while (cap < minimo)
+        cap *= 2;
+    if (cap > ENTRADA_SIZE)
+        cap = ENTRADA_SIZE;
+    if (cap == c->entrada_cap)
+        return 0;
+    char *nueva = realloc(c->entrada, cap);
+    if (!nueva)
+        return -1;
+    c->entrada = nueva;
+    c->entrada_cap = cap;
+    return 0;
+}
+
+/*
+ * Da de alta al cliente i con el nombre de su primera línea. Devuelve -1 si
+ * el nombre es inválido o está en uso: hay que cerrar la conexión.
+ */
+int aceptar_nombre(int i, char *linea)
+{
+    char nombre[NAME_SIZE];
+    size_t nombre_len = strcspn(linea, "\r");
+    if (nombre_len > NAME_SIZE - 1)
+        nombre_len = NAME_SIZE - 1;
+    memcpy(nombre, linea, nombre_len);
+    nombre[nombre_len] = '\0';
+    if (nombre_len == 0 || strchr(nombre, '|') || nombre_duplicado(nombre))
+    {
+        char *msg = "Nombre inválido o duplicado\n";
+        send(clientes[i].fd, msg, strlen(msg), MSG_NOSIGNAL);
+        return -1;
+    }
+
+    memcpy(clientes[i].nombre, nombre, nombre_len + 1);
+    indice_agregar(i);
+    reg_info("Conectado: %s", clientes[i].nombre);
+    enviar_lista_usuarios();
+    return 0;
+}
+
+/*
+ * Procesa todas las tramas completas que haya en el buffer de entrada del
+ * cliente i. Lo incompleto queda esperando al próximo recv().
+ * Devuelve -1 si hay que desconectar al cliente.
+ */
+int procesar_entrada(int i)
+{
+    Cliente *c = &clientes[i];
+    size_t pos = 0;
+
+    while (pos < c->entrada_len)
+    {
+        char *ini = c->entrada + pos;
+        size_t disp = c->entrada_len - pos;
+        char *nl = memchr(ini, '\n', disp);
+        if (!nl)
+        {
+            if (disp >= BUFFER_SIZE)
+            {
+                if (!c->nombre[0])
+                    return -1; // ni siquiera mandó un nombre
+                reg_aviso("Línea demasiado larga de %s, descartada", c->nombre);
+                pos = c->entrada_len;
+            }
+            break;
+        }
+        size_t linea_len = nl - ini;
+
+        // La primera línea es el nombre; lo que llegue detrás ya es un comando
+        if (!c->nombre[0])
+        {
+            *nl = '\0';
+            pos += linea_len + 1;
+            if (aceptar_nombre(i, ini) < 0)
+                return -1;
+            continue;
+        }
+
+        // Protocolo: DATA|destino|id|len\n + datos
+        if (strncmp(ini, "DATA|", 5) == 0)
+        {
+            char hdr[BUFFER_SIZE];
+            snprintf(hdr, sizeof(hdr), "%.*s", (int)linea_len, ini);
+            char *dest = strtok(hdr + 5, "|");
+            char *id = strtok(NULL, "|");
+            char *len = strtok(NULL, "|");
+            long n = len ? atol(len) : -1;
+            if (!dest || !id || n < 0 || n > MAX_TROZO)
+            {
+                reg_aviso("Trama DATA inválida de %s", c->nombre);
+                return -1;
+            }
+            if (disp < linea_len + 1 + n)
+            {
+                // Trama incompleta: asegurar lugar para recibirla entera
+                if (pos + linea_len + 1 + n > c->entrada_cap && agrandar_entrada(c, linea_len + 1 + n) < 0)
+                    return -1;
+                break;
+            }
+            reenviar_trozo(i, dest, atol(id), nl + 1, n);
+            pos += linea_len + 1 + n;
+            continue;
+        }
+
+        *nl = '\0';
+        pos += linea_len + 1;
+
+        // Protocolo: FILE|destino|filename|size[|id]\n + datos
+        if (strncmp(ini, "FILE|", 5) == 0)
+        {
+            char *p = ini + 5;
+            char *dest = strtok(p, "|");
+            char *fname = strtok(NULL, "|");
+            char *size = strtok(NULL, "|");
+            char *id = strtok(NULL, "|");
+            long fsize = size ? atol(size) : -1;
+            if (!dest || !fname || fsize < 0)
+            {
+                reg_aviso("Cabecera de FILE inválida de %s", c->nombre);
+                continue;
+            }
+
+            if (id)
+            {
+                reenviar_cabecera_trozos(i, dest, fname, fsize, atol(id));
+                continue;
+            }
+
+            long usados = enviar_archivo(i, dest, fname, fsize, c->entrada + pos, c->entrada_len - pos);
+            if (usados < 0)
+                return -1;
+            pos += usados;
+            continue;
+        }
+
+        procesar_linea(i, ini);
+    }
+
+    c->entrada_len -= pos;
+    memmove(c->entrada, c->entrada + pos, c->entrada_len);
+    return 0;
 }
 
 void desconectar_cliente(int idx)
 {
-    printf("Desconectado: %s\n", clientes[idx].nombre);
+    // Quien no llegó a mandar su nombre nunca estuvo en el índice
+    int con_nombre = clientes[idx].nombre[0] != '\0';
+    if (con_nombre)
+    {
+        reg_info("Desconectado: %s", clientes[idx].nombre);
+        indice_quitar(idx);
+        envios_abortar(idx);
+    }
+    sondeo_quitar(idx);
     CERRAR_SOCKET(clientes[idx].fd);
     clientes[idx].fd = -1;
     clientes[idx].nombre[0] = '\0';
-    enviar_lista_usuarios();
+    free(clientes[idx].entrada);
+    clientes[idx].entrada = NULL;
+    clientes[idx].entrada_len = 0;
+    clientes[idx].entrada_cap = 0;
+    if (con_nombre)
+        enviar_lista_usuarios();
 }
 
 int main(int argc, char *argv[])
@@ -141,22 +697,33 @@ int main(int argc, char *argv[])
         printf("Uso: %s [PUERTO]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
+    registro_iniciar();
 
 #ifdef _WIN32
     WSADATA wsa;
     if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
     {
-        printf("Error al iniciar Winsock: %d\n", WSAGetLastError());
+        reg_error("Error al iniciar Winsock: %d", WSAGetLastError());
         return 1;
     }
 #endif
 
     int puerto = atoi(argv[1]);
 
+#ifndef _WIN32
+    // Un descriptor por usuario: subir el límite blando hasta donde se pueda
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max)
+    {
+        lim.rlim_cur = lim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
+#endif
+
     int server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd < 0)
     {
-        perror("socket");
+        reg_errno("socket");
         exit(EXIT_FAILURE);
     }
 
@@ -168,44 +735,30 @@ int main(int argc, char *argv[])
 
     if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
     {
-        perror("bind");
+        reg_errno("bind");
         exit(EXIT_FAILURE);
     }
 
     if (listen(server_fd, MAX_CLIENTS) < 0)
     {
-        perror("listen");
+        reg_errno("listen");
         exit(EXIT_FAILURE);
     }
 
     inicializar_clientes();
-    printf("Servidor escuchando en el puerto %d\n", puerto);
+    reg_info("Servidor escuchando en el puerto %d", puerto);
 
-    fd_set readfds;
+    sondeo_agregar(server_fd, -1);
 
     while (1)
     {
-        FD_ZERO(&readfds);
-        FD_SET(server_fd, &readfds);
-        int max_fd = server_fd;
-
-        for (int i = 0; i < MAX_CLIENTS; i++)
-        {
-            if (clientes[i].fd != -1)
-            {
-                FD_SET(clientes[i].fd, &readfds);
-                if (clientes[i].fd > max_fd)
-                    max_fd = clientes[i].fd;
-            }
-        }
-
-        if (select(max_fd + 1, &readfds, NULL, NULL, NULL) < 0)
+        if (poll(fds, nfds, -1) < 0)
         {
-            perror("select");
+            reg_errno("poll");
             continue;
         }
 
-        if (FD_ISSET(server_fd, &readfds))
+        if (fds[0].revents & POLLIN)
         {
             int nuevo_fd = accept(server_fd, (struct sockaddr *)&cli_addr, &cli_len);
             if (nuevo_fd < 0)
@@ -229,131 +782,47 @@ int main(int argc, char *argv[])
                 continue;
             }
 
-            char nombre[NAME_SIZE] = {0};
-            int bytes = recv(nuevo_fd, nombre, NAME_SIZE - 1, 0);
-            if (bytes <= 0 || nombre_duplicado(nombre))
+            // Cada send() ya lleva un mensaje o una trama completa
+            int uno = 1;
+            setsockopt(nuevo_fd, IPPROTO_TCP, TCP_NODELAY, (const char *)&uno, sizeof(uno));
+            if (agrandar_entrada(&clientes[idx_libre], BUFFER_SIZE) < 0)
             {
-                char *msg = "Nombre inválido o duplicado\n";
-                send(nuevo_fd, msg, strlen(msg), 0);
                 CERRAR_SOCKET(nuevo_fd);
                 continue;
             }
-            
-            nombre[bytes] = '\0';
-            strncpy(clientes[idx_libre].nombre, nombre, NAME_SIZE - 1);
+            // El nombre llega por el buffer de entrada como cualquier otra línea
             clientes[idx_libre].fd = nuevo_fd;
-
-            printf("Conectado: %s\n", clientes[idx_libre].nombre);
-            enviar_lista_usuarios();
+            clientes[idx_libre].entrada_len = 0;
+            sondeo_agregar(nuevo_fd, idx_libre);
         }
 
-        for (int i = 0; i < MAX_CLIENTS; i++)
+        /*
+         * De atrás para adelante: desconectar a un cliente mueve el último
+         * pollfd a su lugar, que así ya fue atendido. Los recién aceptados
+         * tienen revents en 0.
+         */
+        for (int k = nfds - 1; k >= 1; k--)
         {
-            if (clientes[i].fd != -1 && FD_ISSET(clientes[i].fd, &readfds))
+            if (!fds[k].revents)
+                continue;
+            int i = pos_cliente[k];
+            Cliente *c = &clientes[i];
+            if (c->entrada_len == c->entrada_cap && agrandar_entrada(c, c->entrada_cap + 1) < 0)
             {
-                char buffer[BUFFER_SIZE] = {0};
-                int bytes = recv(clientes[i].fd, buffer, BUFFER_SIZE - 1, 0);
-                if (bytes <= 0)
-                {
-                    desconectar_cliente(i);
-                    continue;
-                }
-
-                // Protocolo privado: PRIV|destino|texto
-                if (strncmp(buffer, "PRIV|", 5) == 0)
-                {
-                    buffer[bytes] = '\0';
-                    char *p = buffer + 5;
-                    char *dst = strtok(p, "|");
-                    char *msg = strtok(NULL, "\n");
-                    // enviar_privado toma el índice del emisor, el nombre del destino y el texto
-                    enviar_privado(clientes[i].nombre, dst, msg);
-                    continue;
-                }
-                // Protocolo: FILE|destino|filename|size\n + datos
-                if (strncmp(buffer, "FILE|", 5) == 0)
-                {
-                    // 1) Asegura el fin de cabecera
-                    if (bytes < 6)
-                        continue; // muy corto
-                    // Busca el '\n' que termina la cabecera
-                    char *nl = memchr(buffer, '\n', bytes);
-                    if (!nl)
-                    {
-                        fprintf(stderr, "Cabecera de FILE incompleta\n");
-                        continue;
-                    }
-                    int header_len = nl - buffer + 1;
-
-                    // 2) Extrae y parsea la cabecera
-                    char hdr[BUFFER_SIZE];
-                    memcpy(hdr, buffer, header_len);
-                    hdr[header_len - 1] = '\0'; // quitar '\n'
-                    char *p = hdr + 5;
-                    char *dest = strtok(p, "|");
-                    char *fname = strtok(NULL, "|");
-                    long fsize = atol(strtok(NULL, "\0"));
-
-                    // 3) Busca el socket destino
-                    int fd_dest = -1;
-                    for (int j = 0; j < MAX_CLIENTS; j++)
-                    {
-                        if (clientes[j].fd != -1 &&
-                            strcmp(clientes[j].nombre, dest) == 0)
-                        {
-                            fd_dest = clientes[j].fd;
-                            break;
-                        }
-                    }
-                    if (fd_dest < 0)
-                    {
-                        char *err = "ERROR|Usuario receptor no encontrado\n";
-                        send(clientes[i].fd, err, strlen(err), 0);
-                        continue;
-                    }
-
-                    // 4) Envía la cabecera ya formateada
-                    char out_hdr[BUFFER_SIZE];
-                    snprintf(out_hdr, sizeof(out_hdr),
-                             "FILE|%s|%s|%ld\n",
-                             clientes[i].nombre, fname, fsize);
-                    send(fd_dest, out_hdr, strlen(out_hdr), 0);
-
-                    // 5) Envía los datos “sobrantes” tras la cabecera
-                    int leftover = bytes - header_len;
-                    if (leftover > 0)
-                    {
-                        send(fd_dest, nl + 1, leftover, 0);
-                    }
-                    long remaining = fsize - leftover;
-
-                    // 6) Lee y reenvía el resto de los datos
-                    char chunk[FILE_CHUNK_SIZE];
-                    while (remaining > 0)
-                    {
-                        int to_read = remaining > FILE_CHUNK_SIZE
-                                          ? FILE_CHUNK_SIZE
-                                          : remaining;
-                        int r = recv(clientes[i].fd, chunk, to_read, 0);
-                        if (r <= 0)
-                            break;
-                        send(fd_dest, chunk, r, 0);
-                        remaining -= r;
-                    }
-
-                    continue;
-                }
-
-                buffer[bytes] = '\0';
-                char *cmd = strtok(buffer, "|");
-                if (cmd && strcmp(cmd, "TO") == 0)
-                {
-                    char *destino = strtok(NULL, "|");
-                    char *mensaje = strtok(NULL, "");
-                    if (destino && mensaje)
-                        enviar_privado(clientes[i].nombre, destino, mensaje);
-                }
+                desconectar_cliente(i);
+                continue;
             }
+            int bytes = recv(c->fd, c->entrada + c->entrada_len, c->entrada_cap - c->entrada_len, 0);
+            if (bytes <= 0)
+            {
+                desconectar_cliente(i);
+                continue;
+            }
+            t_recepcion_ns = monotonic_ns();
+            c->entrada_len += bytes;
+
+            if (procesar_entrada(i) < 0)
+                desconectar_cliente(i);
         }
     }
 
@@ -0,0 +1,239 @@
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "registro.h"
+
+typedef struct Linea {
+    int64_t ns;                     // hora de registro (CLOCK_REALTIME)
+    int nivel;
+    char texto[REG_LINEA];
+} Linea;
+
+/*
+ * Buffer circular de un hilo. Solo ese hilo avanza 'escrito' y solo el
+ * volcado avanza 'leido'; los índices crecen sin límite y se enmascaran.
+ * Cuando el hilo termina, el buffer queda libre para el próximo hilo nuevo.
+ */
+typedef struct Anillo {
+    _Atomic unsigned escrito;
+    _Atomic unsigned leido;
+    _Atomic unsigned descartadas;   // líneas perdidas con el buffer lleno
+    atomic_int en_uso;
+    struct Anillo *siguiente;       // lista de todos los buffers; nunca se achica
+    Linea lineas[REG_LINEAS];
+} Anillo;
+
+int registro_nivel = REG_INFO;
+
+static _Atomic(Anillo *) anillos;
+static _Thread_local Anillo *propio;
+
+static pthread_once_t una_vez = PTHREAD_ONCE_INIT;
+static pthread_key_t clave;                 // suelta el buffer del hilo al terminar
+
+static pthread_mutex_t volcando = PTHREAD_MUTEX_INITIALIZER;   // un solo consumidor por vez
+static pthread_mutex_t espera = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hay_lineas = PTHREAD_COND_INITIALIZER;
+static int volcador_activo;
+
+static char buffer_stdout[64 * 1024];
+static char buffer_stderr[16 * 1024];
+
+static const char *nombres[] = { "ERROR", "AVISO", "INFO", "DEBUG" };
+
+static int64_t reloj_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void escribir_linea(const Linea *l) {
+    // La fecha cambia una vez por segundo: se formatea solo entonces
+    static time_t segundo = -1;
+    static char fecha[32];
+    time_t t = l->ns / 1000000000LL;
+    if (t != segundo) {
+        struct tm tm;
+#ifdef _WIN32
+        localtime_s(&tm, &t);
+#else
+        localtime_r(&t, &tm);
+#endif
+        strftime(fecha, sizeof(fecha), "%Y-%m-%d %H:%M:%S", &tm);
+        segundo = t;
+    }
+    fprintf(l->nivel <= REG_AVISO ? stderr : stdout, "%s.%03d %-5s %s\n", fecha,
+            (int)(l->ns / 1000000 % 1000), nombres[l->nivel], l->texto);
+}
+
+static void soltar_anillo(void *a) {
+    atomic_store(&((Anillo *)a)->en_uso, 0);
+}
+
+static void crear_clave(void) {
+    pthread_key_create(&clave, soltar_anillo);
+}
+
+// Buffer del hilo que llama: uno libre de un hilo que ya terminó, o uno nuevo
+static Anillo *tomar_anillo(void) {
+    for (Anillo *a = atomic_load(&anillos); a; a = a->siguiente) {
+        int libre = 0;
+        if (atomic_compare_exchange_strong(&a->en_uso, &libre, 1)) {
+            propio = a;
+            break;
+        }
+    }
+    if (!propio) {
+        Anillo *a = calloc(1, sizeof(Anillo));
+        if (!a)
+            return NULL;
+        atomic_store(&a->en_uso, 1);
+        a->siguiente = atomic_load(&anillos);
+        while (!atomic_compare_exchange_weak(&anillos, &a->siguiente, a))
+            ;
+        propio = a;
+    }
+    pthread_once(&una_vez, crear_clave);
+    pthread_setspecific(clave, propio);
+    return propio;
+}
+
+void registro_escribir(int nivel, const char *formato, ...) {
+    va_list ap;
+    Anillo *a = propio ? propio : tomar_anillo();
+
+    if (!volcador_activo || !a) {
+        // Sin hilo de volcado (todavía): se escribe en el momento
+        Linea l = { .ns = reloj_ns(), .nivel = nivel };
+        va_start(ap, formato);
+        vsnprintf(l.texto, sizeof(l.texto), formato, ap);
+        va_end(ap);
+        pthread_mutex_lock(&volcando);
+        escribir_linea(&l);
+        fflush(nivel <= REG_AVISO ? stderr : stdout);
+        pthread_mutex_unlock(&volcando);
+        return;
+    }
+
+    unsigned w = atomic_load_explicit(&a->escrito, memory_order_relaxed);
+    unsigned r = atomic_load_explicit(&a->leido, memory_order_acquire);
+    if (w - r == REG_LINEAS) {
+        atomic_fetch_add_explicit(&a->descartadas, 1, memory_order_relaxed);
+        return;
+    }
+
+    Linea *l = &a->lineas[w & (REG_LINEAS - 1)];
+    l->ns = reloj_ns();
+    l->nivel = nivel;
+    va_start(ap, formato);
+    vsnprintf(l->texto, sizeof(l->texto), formato, ap);
+    va_end(ap);
+    atomic_store_explicit(&a->escrito, w + 1, memory_order_release);
+
+    // A mitad de buffer se despierta al volcado sin esperar su próxima vuelta
+    if (w + 1 - r == REG_LINEAS / 2)
+        pthread_cond_signal(&hay_lineas);
+}
+
+static void volcar_anillo(Anillo *a) {
+    unsigned r = atomic_load_explicit(&a->leido, memory_order_relaxed);
+    unsigned w = atomic_load_explicit(&a->escrito, memory_order_acquire);
+    for (; r != w; r++)
+        escribir_linea(&a->lineas[r & (REG_LINEAS - 1)]);
+    atomic_store_explicit(&a->leido, r, memory_order_release);
+
+    unsigned perdidas = atomic_exchange_explicit(&a->descartadas, 0, memory_order_relaxed);
+    if (perdidas) {
+        Linea l = { .ns = reloj_ns(), .nivel = REG_AVISO };
+        snprintf(l.texto, sizeof(l.texto), "registro: %u líneas descartadas (buffer lleno)", perdidas);
+        escribir_linea(&l);
+    }
+}
+
+void registro_volcar(void) {
+    pthread_mutex_lock(&volcando);
+    for (Anillo *a = atomic_load(&anillos); a; a = a->siguiente)
+        volcar_anillo(a);
+    fflush(stdout);
+    fflush(stderr);
+    pthread_mutex_unlock(&volcando);
+}
+
+static void *volcador(void *arg) {
+    pthread_mutex_lock(&espera);
+    while (1) {
+        struct timespec hasta;
+        clock_gettime(CLOCK_REALTIME, &hasta);
+        hasta.tv_nsec += REG_ESPERA_MS * 1000000L;
+        if (hasta.tv_nsec >= 1000000000L) {
+            hasta.tv_sec++;
+            hasta.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&hay_lineas, &espera, &hasta);
+        registro_volcar();
+    }
+    return NULL;
+}
+
+static void lanzar_volcador(void) {
+    pthread_t hilo;
+    if (pthread_create(&hilo, NULL, volcador, NULL) != 0)
+        return;                     // se sigue escribiendo en el momento
+    pthread_detach(hilo);
+    volcador_activo = 1;
+}
+
+#ifndef _WIN32
+/*
+ * fork() con el volcado a mitad de camino dejaría en el hijo una copia de
+ * lo que está en el buffer de stdio. Se hace con el volcado detenido; el hijo
+ * descarta lo heredado (lo vuelca el padre) y arranca su propio hilo.
+ */
+static void antes_de_fork(void) {
+    pthread_mutex_lock(&volcando);
+}
+
+static void despues_en_padre(void) {
+    pthread_mutex_unlock(&volcando);
+}
+
+static void despues_en_hijo(void) {
+    for (Anillo *a = atomic_load(&anillos); a; a = a->siguiente) {
+        atomic_store(&a->leido, atomic_load(&a->escrito));
+        atomic_store(&a->descartadas, 0);
+        atomic_store(&a->en_uso, a == propio);
+    }
+    pthread_mutex_unlock(&volcando);
+    pthread_mutex_init(&espera, NULL);
+    pthread_cond_init(&hay_lineas, NULL);
+    if (volcador_activo) {
+        volcador_activo = 0;
+        lanzar_volcador();
+    }
+}
+#endif
+
+void registro_iniciar(void) {
+    const char *nivel = getenv("REGISTRO");
+    if (nivel) {
+        for (int i = REG_ERROR; i <= REG_DEBUG; i++)
+            if (strcasecmp(nivel, nombres[i]) == 0)
+                registro_nivel = i;
+    }
+
+    // Las escrituras las hace el volcado, de a muchas líneas por llamada
+    setvbuf(stdout, buffer_stdout, _IOFBF, sizeof(buffer_stdout));
+    setvbuf(stderr, buffer_stderr, _IOFBF, sizeof(buffer_stderr));
+
+#ifndef _WIN32
+    pthread_atfork(antes_de_fork, despues_en_padre, despues_en_hijo);
+#endif
+    atexit(registro_volcar);
+    lanzar_volcador();
+}
@@ -0,0 +1,78 @@
+/*
+ * Registro asíncrono para los servidores.
+ *
+ * Escribir en la terminal o en journald puede bloquear, y un printf en el
+ * camino de los datos frena la transferencia con él. Acá cada hilo formatea
+ * su línea en un buffer circular propio (un productor, un consumidor, sin
+ * locks) y un hilo aparte lo vuelca a stdout (INFO y DEBUG) o stderr (ERROR
+ * y AVISO). Si el buffer de un hilo se llena, la línea se descarta y se
+ * cuenta: el registro nunca frena al que registra.
+ *
+ * El nivel se elige al arrancar con la variable de entorno REGISTRO
+ * (error, aviso, info o debug; info por defecto). Los registros de DEBUG
+ * solo se compilan con -DREGISTRO_DEBUG (make DEBUG=1); sin eso no cuestan
+ * nada, así que pueden ir por paquete. reg_debug_cada() además registra solo
+ * una de cada n veces que se pasa por ese lugar.
+ *
+ * Después de un fork() el hijo arranca su propio hilo de volcado y descarta
+ * lo heredado sin volcar, que ya lo vuelca el padre. Al salir con exit() se
+ * vuelca lo pendiente.
+ */
+#ifndef REGISTRO_H
+#define REGISTRO_H
+
+#include <errno.h>
+#include <string.h>
+
+#define REG_ERROR  0
+#define REG_AVISO  1
+#define REG_INFO   2
+#define REG_DEBUG  3
+
+#ifdef REGISTRO_DEBUG
+#define REG_NIVEL_COMPILADO REG_DEBUG
+#else
+#define REG_NIVEL_COMPILADO REG_INFO
+#endif
+
+#define REG_LINEA    240       // bytes de texto por línea; lo que sobra se corta
+#define REG_LINEAS   512       // líneas por hilo sin volcar (potencia de 2)
+#define REG_ESPERA_MS 20       // cada cuánto mira los buffers el hilo de volcado
+
+// Nivel máximo que se registra, leído de REGISTRO en registro_iniciar()
+extern int registro_nivel;
+
+// Lanza el hilo de volcado; antes de llamarla las líneas se escriben directo
+void registro_iniciar(void);
+
+// Vuelca todo lo pendiente de todos los hilos (se llama sola al salir)
+void registro_volcar(void);
+
+void registro_escribir(int nivel, const char *formato, ...)
+    __attribute__((format(printf, 2, 3)));
+
+#define registrar(nivel, ...)                                                   \
+    do {                                                                        \
+        if ((nivel) <= REG_NIVEL_COMPILADO && (nivel) <= registro_nivel)        \
+            registro_escribir((nivel), __VA_ARGS__);                            \
+    } while (0)
+
+#define reg_error(...)  registrar(REG_ERROR, __VA_ARGS__)
+#define reg_aviso(...)  registrar(REG_AVISO, __VA_ARGS__)
+#define reg_info(...)   registrar(REG_INFO, __VA_ARGS__)
+#define reg_debug(...)  registrar(REG_DEBUG, __VA_ARGS__)
+
+// Reemplazo de perror(): "texto: descripción de errno"
+#define reg_errno(texto) reg_error("%s: %s", (texto), strerror(errno))
+
+// DEBUG muestreado: una de cada n pasadas por este lugar, contadas por hilo
+#define reg_debug_cada(n, ...)                                                  \
+    do {                                                                        \
+        if (REG_DEBUG <= REG_NIVEL_COMPILADO) {                                 \
+            static _Thread_local unsigned reg_pasadas_;                         \
+            if (reg_pasadas_++ % (n) == 0)                                      \
+                reg_debug(__VA_ARGS__);                                         \
+        }                                                                       \
+    } while (0)
+
+#endif
@@ -3,6 +3,12 @@ import threading
 import tkinter.filedialog as fd
 from tkinter import messagebox
 import os
+import time
+from collections import deque
+
+PAGINA_USUARIOS = 20       # nombres por pedido LIST/SEARCH
+MAS_USUARIOS = "Más..."    # última fila de la lista cuando hay otra página
+REFRESCO_USUARIOS_MS = 10000
 
 
 class ChatCliente:
@@ -14,6 +20,10 @@ class ChatCliente:
         self.usuario_actual = None
         self.historial = {}
         self.no_leidos = set()
+        self.descargas = {}
+        self.consulta = ""     # prefijo buscado; vacío = todos los usuarios
+        self.usuarios = []     # nombres mostrados, en el orden del servidor
+        self.pedidos = deque() # (consulta, desde) de cada LIST/SEARCH sin respuesta
 
         self.master.title(f"OpenChat - {nombre}")
         self.master.geometry("600x400")
@@ -22,6 +32,7 @@ class ChatCliente:
         self.configurar_layout()
         self.crear_widgets()
         threading.Thread(target=self.recibir_mensajes, daemon=True).start()
+        self.refrescar_usuarios()
         self.mostrar_mensaje("Sistema", f"Bienvenido {nombre}!\nSeleccioná un usuario para comenzar a chatear.")
 
     def configurar_layout(self):
@@ -35,9 +46,13 @@ class ChatCliente:
         self.label_chat = tk.Label(self.master, text="Chat", font=("Helvetica", 12, "bold"))
         self.label_chat.grid(row=0, column=0, sticky="nw", padx=(10, 0), pady=(5, 0))
 
-        tk.Label(self.master, text="Usuarios", font=("Helvetica", 12, "bold")).grid(
-            row=0, column=1, sticky="nw", padx=10, pady=(5, 0)
-        )
+        # Título usuarios y búsqueda por prefijo
+        marco_usuarios = tk.Frame(self.master)
+        marco_usuarios.grid(row=0, column=1, sticky="new", padx=10, pady=(5, 0))
+        tk.Label(marco_usuarios, text="Usuarios", font=("Helvetica", 12, "bold")).pack(side="left")
+        self.entry_busqueda = tk.Entry(marco_usuarios, width=10)
+        self.entry_busqueda.pack(side="left", fill="x", expand=True, padx=(5, 0))
+        self.entry_busqueda.bind("<KeyRelease>", self.buscar_usuarios)
 
         # Área de mensajes
         self.text_area = tk.Text(self.master, state="disabled", wrap="word")
@@ -74,7 +89,9 @@ class ChatCliente:
             return
 
         destinatario = self.lista_usuarios.get(seleccion[0])
-        comando = f"TO|{destinatario}|{mensaje}"
+        if destinatario == MAS_USUARIOS:
+            return
+        comando = f"TO|{destinatario}|{mensaje}\n"
         try:
             self.socket.sendall(comando.encode())
             self.entry_mensaje.delete(0, tk.END)
@@ -84,49 +101,136 @@ class ChatCliente:
             self.mostrar_mensaje("Error", f"No se pudo enviar el mensaje: {e}")
 
     def recibir_mensajes(self):
+        # Cada mensaje del servidor es una línea; tras una cabecera FILE|
+        # vienen los bytes crudos del archivo.
+        pendiente = b""
         while self.running:
             try:
-                data = self.socket.recv(4096).decode()
-                if not data:
+                datos = self.socket.recv(4096)
+                if not datos:
                     self.desconectar()
                     break
 
-                if data.startswith("USERS|"):
-                    self.actualizar_lista_usuarios(data)
-                elif data.startswith("FROM|"):
-                    remitente, msg = data.split("|", 2)[1:]
-                    self.agregar_a_historial(remitente, f"{remitente}: {msg}")
-                    if remitente == self.usuario_actual:
-                        self.mostrar_historial(remitente)
+                pendiente += datos
+                while b"\n" in pendiente:
+                    linea, pendiente = pendiente.split(b"\n", 1)
+                    linea = linea.decode(errors="replace")
+                    if linea.startswith("FILE|"):
+                        pendiente = self.procesar_archivo_entrante(linea, pendiente)
+                    elif linea.startswith("DATA|"):
+                        pendiente = self.procesar_trozo(linea, pendiente)
                     else:
-                        self.no_leidos.add(remitente)
-                        self.marcar_usuario_no_leido(remitente)
-                elif data.startswith("FILE|"):
-                    self.procesar_archivo_entrante(data)
-                else:
-                    self.mostrar_mensaje("Sistema", data)
+                        self.procesar_linea(linea)
 
             except Exception as e:
                 self.mostrar_mensaje("Sistema", f"Error: {e}")
                 self.running = False
                 break
 
+    def procesar_linea(self, data):
+        if data.startswith("PING|"):
+            # Sonda de latencia de otro usuario: se contesta en el acto
+            llegada = time.monotonic_ns()
+            _, remitente, resto = data.split("|", 2)
+            residencia = time.monotonic_ns() - llegada
+            self.socket.sendall(f"PONG|{remitente}|{resto}|{residencia}\n".encode())
+        elif data.startswith("PONG|"):
+            pass
+        elif data.startswith("USERS|"):
+            # Cambió la sala (solo se avisa en salas chicas): repetir la consulta
+            self.pedir_usuarios(cantidad=max(PAGINA_USUARIOS, len(self.usuarios)))
+        elif data.startswith("LIST|") or data.startswith("FOUND|"):
+            self.actualizar_lista_usuarios(data)
+        elif data.startswith("ABORT|"):
+            # El remitente se desconectó sin terminar un envío
+            try:
+                _, remitente, id_transferencia = data.split("|")
+                clave = (remitente, int(id_transferencia))
+            except ValueError:
+                return
+            if clave in self.descargas:
+                self.terminar_descarga(*clave, completa=False)
+        elif data.startswith("FROM|"):
+            remitente, msg = data.split("|", 2)[1:]
+            self.agregar_a_historial(remitente, f"{remitente}: {msg}")
+            if remitente == self.usuario_actual:
+                self.mostrar_historial(remitente)
+            else:
+                self.no_leidos.add(remitente)
+                self.marcar_usuario_no_leido(remitente)
+        else:
+            self.mostrar_mensaje("Sistema", data)
+
     def desconectar(self):
         self.mostrar_mensaje("Sistema", "Desconectado del servidor.")
         self.running = False
 
+    def pedir_usuarios(self, desde="", cantidad=PAGINA_USUARIOS):
+        # El servidor devuelve una página de su índice ordenado por nombre
+        if self.consulta:
+            pedido = f"SEARCH|{self.consulta}|{cantidad}|{desde}\n"
+        else:
+            pedido = f"LIST|{desde}|{cantidad}\n"
+        self.pedidos.append((self.consulta, desde))
+        try:
+            self.socket.sendall(pedido.encode())
+        except OSError:
+            pass
+
+    def buscar_usuarios(self, event=None):
+        consulta = self.entry_busqueda.get().strip().replace("|", "")
+        if consulta != self.consulta:
+            self.consulta = consulta
+            self.pedir_usuarios()
+
+    def refrescar_usuarios(self):
+        # Con muchos usuarios el servidor no difunde la lista: se vuelve a pedir
+        if not self.running:
+            return
+        self.pedir_usuarios(cantidad=max(PAGINA_USUARIOS, len(self.usuarios)))
+        self.master.after(REFRESCO_USUARIOS_MS, self.refrescar_usuarios)
+
     def actualizar_lista_usuarios(self, mensaje):
-        nombres = [n for n in mensaje.split("|")[1:] if n != self.nombre]
+        # LIST|desde|total|n|nombres...  o  FOUND|prefijo|total|n|nombres...
+        campos = mensaje.split("|")
+        if len(campos) < 4:
+            return
+        cantidad = int(campos[3])
+        nombres = campos[4:]
+        # Las respuestas llegan en el orden de los pedidos
+        consulta, desde = self.pedidos.popleft() if self.pedidos else (self.consulta, "")
+        if consulta != self.consulta:
+            return  # respuesta a una búsqueda que ya cambió
+
+        if desde:
+            self.usuarios += nombres
+        else:
+            self.usuarios = nombres
+        hay_mas = cantidad > 0 and len(nombres) >= PAGINA_USUARIOS
+
         self.lista_usuarios.delete(0, tk.END)
-        for nombre in nombres:
+        for nombre in self.usuarios:
+            if nombre == self.nombre:
+                continue
             self.lista_usuarios.insert(tk.END, nombre)
             if nombre not in self.historial:
                 self.historial[nombre] = []
+            if nombre in self.no_leidos:
+                self.marcar_usuario_no_leido(nombre)
+            if nombre == self.usuario_actual:
+                self.lista_usuarios.selection_set(tk.END)
+        if hay_mas:
+            self.lista_usuarios.insert(tk.END, MAS_USUARIOS)
 
     def cambiar_conversacion(self, seleccion):
         seleccion = self.lista_usuarios.curselection()
         if seleccion:
             nuevo_usuario = self.lista_usuarios.get(seleccion[0])
+            if nuevo_usuario == MAS_USUARIOS:
+                self.lista_usuarios.selection_clear(0, tk.END)
+                if self.usuarios:
+                    self.pedir_usuarios(desde=self.usuarios[-1])
+                return
             self.usuario_actual = nuevo_usuario
             self.label_chat.config(text=nuevo_usuario)
             self.mostrar_historial(nuevo_usuario)
@@ -171,6 +275,8 @@ class ChatCliente:
             return
 
         destinatario = self.lista_usuarios.get(seleccion[0])
+        if destinatario == MAS_USUARIOS:
+            return
         filepath = fd.askopenfilename(title="Seleccionar archivo")
 
         if filepath:
@@ -191,37 +297,96 @@ class ChatCliente:
             except Exception as e:
                 self.mostrar_mensaje("Error", f"Error al enviar: {e}")
 
-    def procesar_archivo_entrante(self, header):
+    def leer_exacto(self, cantidad, pendiente, f):
+        # Consume 'cantidad' bytes (primero de 'pendiente', después del socket)
+        # escribiéndolos en f si no es None. Devuelve lo que sobró de 'pendiente'.
+        remaining = cantidad
+        while remaining > 0:
+            if pendiente:
+                chunk, pendiente = pendiente[:remaining], pendiente[remaining:]
+            else:
+                chunk = self.socket.recv(min(65536, remaining))
+                if not chunk:
+                    raise ConnectionError("Conexión interrumpida")
+            if f:
+                f.write(chunk)
+            remaining -= len(chunk)
+        return pendiente
+
+    def procesar_archivo_entrante(self, header, pendiente):
+        # Devuelve lo que quedó en 'pendiente' después de los datos del archivo
         try:
-            # Parsear cabecera: FILE|remitente|filename|filesize
+            # Parsear cabecera: FILE|remitente|filename|filesize[|id]
             parts = header.split("|")
             remitente = parts[1]
-            filename = parts[2]
+            filename = os.path.basename(parts[2])
             filesize = int(parts[3])
+            id_transferencia = int(parts[4]) if len(parts) > 4 else None
+        except (IndexError, ValueError):
+            self.mostrar_mensaje("Error", f"Cabecera de archivo inválida: {header}")
+            return pendiente
 
+        save_path = None
+        try:
             # Confirmar recepción
-            if not messagebox.askyesno("Archivo entrante", f"¿Recibir archivo {filename} ({filesize} bytes) de {remitente}?"):
-                return
+            if messagebox.askyesno("Archivo entrante", f"¿Recibir archivo {filename} ({filesize} bytes) de {remitente}?"):
+                save_path = fd.asksaveasfilename(
+                    title="Guardar archivo",
+                    initialfile=filename,
+                    defaultextension=os.path.splitext(filename)[1]
+                )
+        except Exception as e:
+            self.mostrar_mensaje("Error", f"Error con archivo: {e}")
 
-            # Recibir archivo
-            save_path = fd.asksaveasfilename(
-                title="Guardar archivo",
-                initialfile=filename,
-                defaultextension=os.path.splitext(filename)[1]
-            )
-
-            if save_path:
-                with open(save_path, 'wb') as f:
-                    remaining = filesize
-                    while remaining > 0:
-                        chunk = self.socket.recv(min(4096, remaining))
-                        if not chunk:
-                            raise ConnectionError("Conexión interrumpida")
-                        f.write(chunk)
-                        remaining -= len(chunk)
+        f = open(save_path, 'wb') if save_path else None
 
+        if id_transferencia is not None:
+            # Los datos llegan después en tramas DATA|remitente|id|len
+            self.descargas[(remitente, id_transferencia)] = [f, filesize, filename]
+            if filesize == 0:
+                self.terminar_descarga(remitente, id_transferencia)
+            return pendiente
+
+        # Los datos se consumen aunque el archivo se rechace, para no perder
+        # el sincronismo con los mensajes que vienen después.
+        try:
+            pendiente = self.leer_exacto(filesize, pendiente, f)
+            if f:
                 self.mostrar_mensaje("Sistema", f"Archivo {filename} guardado")
                 self.agregar_a_historial(remitente, f"{remitente}: [Archivo: {filename}]")
 
         except Exception as e:
             self.mostrar_mensaje("Error", f"Error con archivo: {e}")
+        finally:
+            if f:
+                f.close()
+        return pendiente
+
+    def procesar_trozo(self, header, pendiente):
+        try:
+            _, remitente, id_transferencia, cantidad = header.split("|")
+            clave = (remitente, int(id_transferencia))
+            cantidad = int(cantidad)
+        except ValueError:
+            self.mostrar_mensaje("Error", f"Trama de archivo inválida: {header}")
+            return pendiente
+
+        descarga = self.descargas.get(clave)
+        pendiente = self.leer_exacto(cantidad, pendiente, descarga[0] if descarga else None)
+        if descarga:
+            descarga[1] -= cantidad
+            # Un DATA vacío indica que el remitente canceló el envío
+            if descarga[1] <= 0 or cantidad == 0:
+                self.terminar_descarga(*clave, completa=cantidad > 0)
+        return pendiente
+
+    def terminar_descarga(self, remitente, id_transferencia, completa=True):
+        f, _, filename = self.descargas.pop((remitente, id_transferencia))
+        if not f:
+            return
+        f.close()
+        if completa:
+            self.mostrar_mensaje("Sistema", f"Archivo {filename} guardado")
+            self.agregar_a_historial(remitente, f"{remitente}: [Archivo: {filename}]")
+        else:
+            self.mostrar_mensaje("Sistema", f"Envío de {filename} cancelado por {remitente}")
@@ -3,28 +3,50 @@
  *
  * Uso:
  *   Para lectura (RRQ):
- *     ./cliente2 -r <IP-servidor> <puerto> <archivo_remoto>
+ *     ./cliente2 -r [-a] [-b blksize] [-W ventana] [-t segundos] [-R 0|1] [-m] <IP-servidor> <puerto> <archivo_remoto>
  *
  *   Para escritura (WRQ):
- *     ./cliente2 -w <IP-servidor> <puerto> <archivo_local>
+ *     ./cliente2 -w [-a] [-b blksize] [-W ventana] [-t segundos] [-R 0|1] <IP-servidor> <puerto> <archivo_local>
  *
  * Ejemplos:
  *   ./cliente2 -r 127.0.0.1 1069 ejemplo.txt
- *   ./cliente2 -w 127.0.0.1 1069 subir.bin
+ *   ./cliente2 -w -b 1428 127.0.0.1 1069 subir.bin
+ *   ./cliente2 -r -b 1428 -W 16 127.0.0.1 1069 grande.iso
  *
  * Este cliente:
- *   - Construye y envía RRQ/WRQ en modo \"octet\".(binario)
- *   - Intercambia DATA/ACK bloque a bloque.
+ *   - Construye y envía RRQ/WRQ en modo \"octet\".(binario), o \"netascii\"
+ *     con -a: al bajar, CR LF se guarda como LF y CR NUL como CR; al subir,
+ *     el archivo se traduce al revés antes de mandarlo.
+ *   - Con -b negocia el tamaño de bloque (RFC 2347/2348): si el servidor
+ *     responde OACK se usa el blksize que acepta; si responde directamente
+ *     con DATA o ACK 0 se sigue con 512.
+ *   - Con -W negocia windowsize (RFC 7440): se envían hasta W bloques
+ *     seguidos y el receptor confirma con un ACK acumulativo cada W bloques.
+ *     Ante un hueco o un timeout se retoma desde el último bloque confirmado.
+ *   - Sin -W intercambia DATA/ACK bloque a bloque.
+ *   - Los bloques se cuentan en 64 bits y en el cable dan la vuelta después
+ *     del 65535 a 0, o a 1 si el servidor acepta "rollover" 1 (pedido con -R).
+ *   - Pide tsize (RFC 2349): en RRQ con 0, para conocer el tamaño, reservar
+ *     el archivo local de entrada y mostrar el progreso; en WRQ con el
+ *     tamaño del archivo, para que el servidor rechace la subida si no entra.
+ *   - Con -t pide la opción timeout (RFC 2349): el servidor retransmite cada
+ *     tantos segundos en lugar de adaptar el RTO, y el cliente espera lo mismo.
+ *   - Con -m pide la opción multicast (RFC 2090): si el servidor la acepta,
+ *     los DATA llegan por el grupo que indica el OACK y solo el cliente
+ *     maestro confirma. Los bloques se guardan en cualquier orden; al pasar
+ *     a maestro se pide desde el primero que falta.
  *   - Detecta y muestra paquetes ERROR (opcode=5, códigos 1 y 6).
- *   - Usa timeout de 5 segundos para recvfrom().
+ *   - Espera 1 segundo (o -t) en recvfrom() y retransmite hasta MAX_REINTENTOS veces.
  *
  * Compilar:
  *   gcc -o cliente2 cliente2.c
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -32,27 +54,188 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <poll.h>
+#include <sys/mman.h>
+
+#include "../tftp-netascii.h"
+#include "../tftp-opciones.h"
 
 #define TFTP_PORT       1069
 #define BLOCK_SIZE      512
-#define MAX_PACKET_SIZE 516   /* 2 bytes opcode + 2 bytes block + 512 bytes datos */
+#define MAX_BLKSIZE     65464
+#define MAX_PACKET_SIZE (4 + MAX_BLKSIZE)  /* 2 bytes opcode + 2 bytes block + datos */
+#define MAX_VENTANA     65535
+#define MAX_REINTENTOS  5                   /* timeouts seguidos antes de abandonar */
+#define MAX_BLOQUES_MC  65535               /* multicast: los bloques no dan la vuelta */
 
 #define OPCODE_RRQ   1
 #define OPCODE_WRQ   2
 #define OPCODE_DATA  3
 #define OPCODE_ACK   4
 #define OPCODE_ERROR 5
+#define OPCODE_OACK  6
 
 /* Códigos de error específicos */
 #define TFTP_ERR_NOTFOUND     1
+#define TFTP_ERR_DISKFULL     3
 #define TFTP_ERR_EXISTS       6
 
+/* blksize pedido con -b (0 = no negociar) y el que quedó en uso */
+static int blksize_pedido = 0;
+static int blksize = BLOCK_SIZE;
+
+/* windowsize pedido con -W (0 = no negociar) y el que quedó en uso */
+static int ventana_pedida = 0;
+static int ventana = 1;
+
+/* -t: segundos de espera antes de retransmitir, pedidos también al servidor (0 = no negociar) */
+static int timeout_pedido = 0;
+
+/* rollover pedido con -R (-1 = no negociar) y el que quedó en uso */
+static int rollover_pedido = -1;
+static int rollover = 0;
+static int rollover_acordado = 0;   /* vino en el OACK; si no, al bajar se sigue al servidor */
+
+/* -a: modo netascii */
+static int netascii = 0;
+
+/* Tamaño total de la transferencia: el tsize del OACK al bajar, el del archivo al subir (-1 = no se sabe) */
+static long long tsize = -1;
+
+/* -m: pedir multicast; si el OACK lo acepta, grupo y si este cliente es el maestro */
+static int multicast_pedido = 0;
+static struct sockaddr_in grupo;
+static int maestro = 0;
+
 /* Prototipos */
 void usage(const char *progname);
 void receive_file(const char *ip, int port, const char *filename);
 void send_file(const char *ip, int port, const char *filename);
 
+/* RRQ/WRQ con el modo y las opciones pedidas; 'tamano' va como tsize. Devuelve la longitud. */
+static size_t armar_pedido(uint8_t *pkt, uint16_t opcode, const char *filename, long long tamano) {
+    Opciones op = {
+        .netascii = netascii, .blksize = blksize_pedido, .ventana = ventana_pedida,
+        .timeout = timeout_pedido, .rollover = rollover_pedido, .tsize = tamano,
+        .multicast = multicast_pedido,
+    };
+    return opciones_pedido(pkt, opcode, filename, &op);
+}
+
+/* "multicast" del OACK: "dirección,puerto,mc" */
+static void leer_multicast(const char *valor) {
+    char ip[INET_ADDRSTRLEN];
+    int puerto, mc;
+    if (sscanf(valor, "%15[0-9.],%d,%d", ip, &puerto, &mc) != 3)
+        return;
+    memset(&grupo, 0, sizeof(grupo));
+    if (inet_aton(ip, &grupo.sin_addr) == 0 || puerto <= 0 || puerto > 65535)
+        return;
+    grupo.sin_family = AF_INET;
+    grupo.sin_port = htons(puerto);
+    maestro = mc == 1;
+}
+
+/* Lee las opciones aceptadas en un OACK y ajusta blksize y ventana */
+static void procesar_oack(const uint8_t *buf, ssize_t n) {
+    Acuerdo a = { .blksize = blksize, .ventana = ventana, .tsize = tsize, .rollover = -1 };
+    opciones_oack(buf, n, &a);
+    blksize = a.blksize;
+    ventana = a.ventana;
+    tsize = a.tsize;
+    if (a.rollover >= 0) {
+        rollover = a.rollover;
+        rollover_acordado = 1;
+    }
+    if (a.multicast)
+        leer_multicast(a.multicast);
+    printf("OACK del servidor: blksize %d, windowsize %d", blksize, ventana);
+    if (tsize >= 0)
+        printf(", tsize %lld", tsize);
+    if (grupo.sin_family == AF_INET)
+        printf(", grupo %s:%d%s", inet_ntoa(grupo.sin_addr), ntohs(grupo.sin_port), maestro ? " (maestro)" : "");
+    printf("\n");
+}
+
+/* Construye y envía un ERROR: el servidor abandona la transferencia sin esperar */
+static void send_error(int sockfd, struct sockaddr_in *server_addr, socklen_t addr_len,
+                       uint16_t code, const char *msg) {
+    uint8_t buf[4 + 64];
+    uint16_t op_net = htons(OPCODE_ERROR);
+    uint16_t code_net = htons(code);
+    size_t msg_len = strlen(msg);
+    memcpy(buf + 0, &op_net, 2);
+    memcpy(buf + 2, &code_net, 2);
+    memcpy(buf + 4, msg, msg_len + 1);
+    sendto(sockfd, buf, 4 + msg_len + 1, 0, (struct sockaddr *)server_addr, addr_len);
+}
+
+/*
+ * Reserva en disco el tamaño anunciado con tsize, sin cambiar el tamaño del
+ * archivo: si no hay lugar, la descarga se corta antes de recibir datos.
+ */
+static void preasignar(int sockfd, struct sockaddr_in *server_addr, socklen_t addr_len, FILE *file) {
+    if (tsize <= 0)
+        return;
+    if (fallocate(fileno(file), FALLOC_FL_KEEP_SIZE, 0, tsize) < 0 && (errno == ENOSPC || errno == EFBIG)) {
+        fprintf(stderr, "Sin espacio para %lld bytes\n", tsize);
+        send_error(sockfd, server_addr, addr_len, TFTP_ERR_DISKFULL, "Disk full or allocation exceeded");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Progreso en la terminal (stderr), si se conoce el tamaño total */
+static void mostrar_progreso(const char *filename, long long hecho) {
+    static int terminal = -1;
+    static int ultimo = -1;
+    if (terminal < 0)
+        terminal = isatty(STDERR_FILENO);
+    if (!terminal || tsize <= 0)
+        return;
+    int porcentaje = hecho >= tsize ? 100 : (int)(hecho * 100 / tsize);
+    if (porcentaje == ultimo)
+        return;
+    ultimo = porcentaje;
+    fprintf(stderr, "\r%s: %3d%% (%lld de %lld bytes)%s", filename, porcentaje, hecho, tsize,
+            porcentaje == 100 ? "\n" : "");
+}
+
+/*
+ * Número de bloque en el cable: los bloques se cuentan en 64 bits y viajan
+ * en 16; pasado el 65535 siguen desde 'rollover'. El 0 solo aparece al
+ * principio, así que con rollover 1 las vueltas son de 65535 bloques.
+ */
+static uint16_t en_cable(uint64_t n) {
+    if (n <= UINT16_MAX || rollover == 0)
+        return (uint16_t)n;
+    return (uint16_t)(1 + (n - 1) % UINT16_MAX);
+}
+
+/* Bloques desde 'desde' hasta el primero, sin ir para atrás, que viaja como 'w' */
+static uint64_t adelante(uint64_t desde, uint16_t w) {
+    if (rollover == 0)
+        return (uint16_t)(w - (uint16_t)desde);
+    if (desde == 0)
+        return w;
+    if (w == 0)
+        return UINT64_MAX;
+    return (w - en_cable(desde) + UINT16_MAX) % UINT16_MAX;
+}
+
+/* Distancia con signo del bloque que viaja como 'w' al bloque 'n' */
+static int distancia(uint16_t w, uint64_t n) {
+    int d = (int)w - en_cable(n);
+    if (rollover == 0)
+        return (int16_t)d;
+    if (d > INT16_MAX)
+        d -= UINT16_MAX;
+    else if (d < -INT16_MAX)
+        d += UINT16_MAX;
+    return d;
+}
+
 /* Construye y envía un ACK con número de bloque 'block' */
 void send_ack(int sockfd, struct sockaddr_in *server_addr, socklen_t addr_len, uint16_t block) {
     uint8_t buf[4];
@@ -66,34 +249,285 @@ void send_ack(int sockfd, struct sockaddr_in *server_addr, socklen_t addr_len, u
     }
 }
 
+/* Dirección local por la que se llega al servidor: en esa interfaz se escucha el grupo */
+static struct in_addr interfaz_hacia(const struct sockaddr_in *destino) {
+    struct sockaddr_in local;
+    socklen_t len = sizeof(local);
+    struct in_addr cualquiera = { htonl(INADDR_ANY) };
+
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    if (s < 0)
+        return cualquiera;
+    if (connect(s, (const struct sockaddr *)destino, sizeof(*destino)) < 0 ||
+        getsockname(s, (struct sockaddr *)&local, &len) < 0) {
+        close(s);
+        return cualquiera;
+    }
+    close(s);
+    return local.sin_addr;
+}
+
+/* Socket unido al grupo del OACK; varios clientes de una misma máquina lo comparten */
+static int unirse_al_grupo(const struct sockaddr_in *servidor) {
+    int opt = 1;
+    int msock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (msock < 0) {
+        perror("socket grupo");
+        exit(EXIT_FAILURE);
+    }
+    setsockopt(msock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    /* Ligado a la dirección del grupo y no a INADDR_ANY: no recibe otros grupos del mismo puerto */
+    if (bind(msock, (struct sockaddr *)&grupo, sizeof(grupo)) < 0) {
+        perror("bind grupo");
+        exit(EXIT_FAILURE);
+    }
+    struct ip_mreq mreq;
+    mreq.imr_multiaddr = grupo.sin_addr;
+    mreq.imr_interface = interfaz_hacia(servidor);
+    if (setsockopt(msock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+        perror("IP_ADD_MEMBERSHIP");
+        exit(EXIT_FAILURE);
+    }
+    return msock;
+}
+
+/*
+ * recibir_multicast: descarga por el grupo (RFC 2090). Cada DATA se escribe
+ * en su posición al llegar, venga por el grupo o por unicast. Solo el
+ * maestro confirma, con el bloque anterior al primero que le falta, así
+ * que al pasar a maestro el servidor sigue desde el primer hueco. Los demás
+ * escuchan y, si el grupo calla, repiten el RRQ para saber si siguen en él.
+ */
+static void recibir_multicast(int sockfd, const struct sockaddr_in *principal, struct sockaddr_in *servidor,
+                              const uint8_t *rrq, size_t pkt_len, FILE *file, const char *filename) {
+    static uint8_t tengo[MAX_BLOQUES_MC + 2];   /* bloques ya escritos, por número */
+    socklen_t addr_len = sizeof(*servidor);
+    struct sockaddr_in unido = grupo;
+    int msock = unirse_al_grupo(servidor);
+    uint32_t primero = 1;       /* primer bloque que falta */
+    uint32_t total = 0;         /* número del último bloque, cuando llega el corto */
+    int en_ventana = 0;
+    int hueco = 0;
+    int fuera = 0;
+    int reintentos = 0;
+    long recibidos = 0, repetidos = 0;
+    uint8_t *buf = malloc(MAX_PACKET_SIZE);
+    if (!buf) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    if (maestro)
+        send_ack(sockfd, servidor, addr_len, 0);
+
+    while (!total || primero <= total) {
+        struct pollfd pfd[2] = {
+            { .fd = sockfd, .events = POLLIN },
+            { .fd = msock,  .events = POLLIN },
+        };
+        int r = poll(pfd, 2, (timeout_pedido > 0 ? timeout_pedido : 1) * 1000);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+        if (r == 0) {
+            if (++reintentos > MAX_REINTENTOS) {
+                fprintf(stderr, "Timeout esperando DATA del grupo\n");
+                exit(EXIT_FAILURE);
+            }
+            if (maestro) {
+                send_ack(sockfd, servidor, addr_len, primero - 1);
+                en_ventana = 0;
+            } else {
+                sendto(sockfd, rrq, pkt_len, 0, (const struct sockaddr *)principal, sizeof(*principal));
+            }
+            continue;
+        }
+
+        for (int i = 0; i < 2 && (!total || primero <= total); i++) {
+            if (!(pfd[i].revents & POLLIN))
+                continue;
+            struct sockaddr_in origen;
+            socklen_t origen_len = sizeof(origen);
+            ssize_t n = recvfrom(pfd[i].fd, buf, MAX_PACKET_SIZE, MSG_DONTWAIT,
+                                 (struct sockaddr *)&origen, &origen_len);
+            if (n < 4)
+                continue;
+            reintentos = 0;
+
+            uint16_t opcode = ntohs(*(uint16_t *)(buf + 0));
+            uint16_t block = ntohs(*(uint16_t *)(buf + 2));
+
+            if (opcode == OPCODE_ERROR) {
+                fprintf(stderr, "TFTP Error %d: %s\n", block, (char *)(buf + 4));
+                exit(EXIT_FAILURE);
+            }
+            if (opcode == OPCODE_OACK) {
+                /* Pasó a maestro (mc=1), o respuesta a un RRQ repetido */
+                *servidor = origen;
+                procesar_oack(buf, n);
+                if (grupo.sin_addr.s_addr != unido.sin_addr.s_addr || grupo.sin_port != unido.sin_port) {
+                    /* El grupo anterior terminó y el servidor abrió otro */
+                    close(msock);
+                    msock = unirse_al_grupo(servidor);
+                    unido = grupo;
+                }
+                if (maestro) {
+                    hueco = 0;
+                    en_ventana = 0;
+                    send_ack(sockfd, servidor, addr_len, primero - 1);
+                }
+                continue;
+            }
+            if (opcode != OPCODE_DATA || block == 0)
+                continue;
+
+            size_t data_len = n - 4;
+            uint32_t antes = primero;
+            if (!tengo[block]) {
+                if (pwrite(fileno(file), buf + 4, data_len, (off_t)(block - 1) * blksize) != (ssize_t)data_len) {
+                    perror("pwrite");
+                    exit(EXIT_FAILURE);
+                }
+                tengo[block] = 1;
+                recibidos += data_len;
+                mostrar_progreso(filename, recibidos);
+                if (data_len < (size_t)blksize)
+                    total = block;
+            } else {
+                repetidos++;
+            }
+            while (primero <= MAX_BLOQUES_MC && tengo[primero])
+                primero++;
+
+            if (!maestro)
+                continue;
+            if (total && primero > total) {
+                send_ack(sockfd, servidor, addr_len, total);
+            } else if (primero > antes) {
+                /* Avanzó: ACK acumulativo al completar la ventana */
+                hueco = 0;
+                if (++en_ventana >= ventana) {
+                    en_ventana = 0;
+                    send_ack(sockfd, servidor, addr_len, primero - 1);
+                }
+            } else {
+                /* Hueco o repetido: pedir desde el primero que falta, una vez por ráfaga */
+                int distancia = (int)block - (int)primero;
+                if (!hueco || distancia <= fuera) {
+                    hueco = 1;
+                    en_ventana = 0;
+                    send_ack(sockfd, servidor, addr_len, primero - 1);
+                }
+                fuera = distancia;
+            }
+        }
+    }
+
+    /* Quien no es maestro avisa que ya tiene todo para que no lo elijan */
+    if (!maestro)
+        send_ack(sockfd, servidor, addr_len, total);
+    printf("Descarga completa: %s (%ld bytes, multicast%s, %ld repetidos)\n",
+           filename, recibidos, maestro ? " como maestro" : "", repetidos);
+    free(buf);
+    close(msock);
+}
+
+/*
+ * netascii al subir: el archivo se traduce entero a memoria, así cada bloque
+ * se toma por su posición igual que en octet. Devuelve el texto traducido y
+ * su largo en '*largo'.
+ */
+static uint8_t *traducir_archivo(FILE *file, off_t tamano, long long *largo) {
+    uint8_t *mapa = NULL;
+    if (tamano > 0) {
+        mapa = mmap(NULL, tamano, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+        if (mapa == MAP_FAILED) {
+            perror("mmap");
+            exit(EXIT_FAILURE);
+        }
+    }
+    *largo = tamano + netascii_extra(mapa, tamano);
+    uint8_t *texto = malloc(*largo + 1);
+    if (!texto) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    size_t leidos;
+    int mitad = 0;
+    netascii_codificar(mapa, tamano, texto, *largo, &leidos, &mitad);
+    if (mapa)
+        munmap(mapa, tamano);
+    return texto;
+}
+
 /* Muestra mensaje de uso y sale */
 void usage(const char *progname) {
     fprintf(stderr,
         "Uso:\n"
-        "  %s -r <IP-servidor> <puerto> <archivo_remoto>   (descargar archivo)\n"
-        "  %s -w <IP-servidor> <puerto> <archivo_local>    (subir archivo)\n",
+        "  %s -r [-a] [-b blksize] [-W ventana] [-t segundos] [-R 0|1] [-m] <IP-servidor> <puerto> <archivo_remoto>   (descargar archivo)\n"
+        "  %s -w [-a] [-b blksize] [-W ventana] [-t segundos] [-R 0|1] <IP-servidor> <puerto> <archivo_local>    (subir archivo)\n"
+        "  -a: modo netascii (texto)\n",
         progname, progname);
     exit(EXIT_FAILURE);
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 5) {
+    int mode = 0, c;
+
+    while ((c = getopt(argc, argv, "rwab:W:t:R:m")) != -1) {
+        switch (c) {
+        case 'r':
+        case 'w':
+            mode = c;
+            break;
+        case 'a':
+            netascii = 1;
+            break;
+        case 'b':
+            blksize_pedido = atoi(optarg);
+            if (blksize_pedido < 8 || blksize_pedido > MAX_BLKSIZE)
+                usage(argv[0]);
+            break;
+        case 'W':
+            ventana_pedida = atoi(optarg);
+            if (ventana_pedida < 1 || ventana_pedida > MAX_VENTANA)
+                usage(argv[0]);
+            break;
+        case 't':
+            timeout_pedido = atoi(optarg);
+            if (timeout_pedido < 1 || timeout_pedido > 255)
+                usage(argv[0]);
+            break;
+        case 'R':
+            if (strcmp(optarg, "0") != 0 && strcmp(optarg, "1") != 0)
+                usage(argv[0]);
+            rollover_pedido = atoi(optarg);
+            break;
+        case 'm':
+            multicast_pedido = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    /* En netascii los bloques no se pueden ubicar por número en el archivo: sin multicast */
+    if (mode == 0 || argc - optind != 3 || (multicast_pedido && (mode != 'r' || netascii))) {
         usage(argv[0]);
     }
 
-    const char *mode = argv[1];
-    const char *ip   = argv[2];
-    int port         = atoi(argv[3]);
-    const char *filename = argv[4];
+    const char *ip   = argv[optind];
+    int port         = atoi(argv[optind + 1]);
+    const char *filename = argv[optind + 2];
 
-    if (strcmp(mode, "-r") == 0) {
+    if (mode == 'r') {
         receive_file(ip, port, filename);
     }
-    else if (strcmp(mode, "-w") == 0) {
-        send_file(ip, port, filename);
-    }
     else {
-        usage(argv[0]);
+        send_file(ip, port, filename);
     }
 
     return 0;
@@ -114,8 +548,8 @@ void receive_file(const char *ip, int port, const char *filename) {
         exit(EXIT_FAILURE);
     }
 
-    /* Configurar timeout de 5 segundos en recvfrom() */
-    struct timeval tv = {10, 0};
+    /* Configurar timeout de 1 segundo (o -t) en recvfrom(): al vencer se retransmite */
+    struct timeval tv = {timeout_pedido > 0 ? timeout_pedido : 1, 0};
     if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
         perror("setsockopt SO_RCVTIMEO");
         close(sockfd);
@@ -132,24 +566,16 @@ void receive_file(const char *ip, int port, const char *filename) {
         exit(EXIT_FAILURE);
     }
 
-    /* Construir paquete RRQ: [opcode=1][filename][0]['o''c''t''e''t'][0] */
+    /* Construir paquete RRQ: [opcode=1][filename][0]['o''c''t''e''t'][0][opciones] */
     size_t name_len = strlen(filename);
-    const char *mode_str = "octet";
-    size_t mode_len = strlen(mode_str);
-    size_t pkt_len = 2 + name_len + 1 + mode_len + 1;
-    uint8_t *rrq = malloc(pkt_len);
+    uint8_t *rrq = malloc(2 + name_len + 1 + OPCIONES_MAX);
     if (!rrq) {
         perror("malloc");
         close(sockfd);
         exit(EXIT_FAILURE);
     }
-
-    uint16_t op_net = htons(OPCODE_RRQ);
-    memcpy(rrq + 0, &op_net, 2);
-    memcpy(rrq + 2, filename, name_len);
-    rrq[2 + name_len] = 0;
-    memcpy(rrq + 3 + name_len, mode_str, mode_len);
-    rrq[3 + name_len + mode_len] = 0;
+    size_t pkt_len = armar_pedido(rrq, OPCODE_RRQ, filename, 0);
+    struct sockaddr_in principal = server_addr;   /* el TID del servidor reemplaza al puerto */
 
     /* Enviar RRQ */
     if (sendto(sockfd, rrq, pkt_len, 0, (struct sockaddr *)&server_addr, addr_len) < 0) {
@@ -158,7 +584,6 @@ void receive_file(const char *ip, int port, const char *filename) {
         close(sockfd);
         exit(EXIT_FAILURE);
     }
-    free(rrq);
 
     /* Abrir archivo local para escritura */
     FILE *file = fopen(filename, "wb");
@@ -168,12 +593,34 @@ void receive_file(const char *ip, int port, const char *filename) {
         exit(EXIT_FAILURE);
     }
 
-    uint16_t expected_block = 1;
+    uint64_t esperado = 1;  /* próximo bloque en orden; en el cable, en_cable(esperado) */
+    int respondio = 0;      /* ya llegó algo del servidor: su puerto es el TID */
+    int en_ventana = 0;     /* bloques recibidos desde el último ACK */
+    int hueco = 0;          /* ya se pidió retomar desde el último bloque en orden */
+    int fuera = 0;          /* distancia al esperado del último bloque fuera de orden */
+    int reintentos = 0;
+    long long recibidos = 0;
+    int cr = 0;             /* netascii: el último bloque terminó en CR */
+    uint8_t *buf = malloc(MAX_PACKET_SIZE);
+    uint8_t *texto = netascii ? malloc(MAX_BLKSIZE + 1) : NULL;
+    if (!buf || (netascii && !texto)) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
 
     while (1) {
-        uint8_t buf[MAX_PACKET_SIZE];
-        ssize_t n = recvfrom(sockfd, buf, sizeof(buf), 0, (struct sockaddr *)&server_addr, &addr_len);
+        ssize_t n = recvfrom(sockfd, buf, MAX_PACKET_SIZE, 0, (struct sockaddr *)&server_addr, &addr_len);
         if (n < 0) {
+            if ((errno == EWOULDBLOCK || errno == EAGAIN) && ++reintentos <= MAX_REINTENTOS) {
+                /* Sin respuesta todavía: repetir el pedido; si no, confirmar lo recibido */
+                if (!respondio) {
+                    sendto(sockfd, rrq, pkt_len, 0, (struct sockaddr *)&server_addr, addr_len);
+                } else {
+                    send_ack(sockfd, &server_addr, addr_len, en_cable(esperado - 1));
+                    en_ventana = 0;
+                }
+                continue;
+            }
             if (errno == EWOULDBLOCK || errno == EAGAIN) {
                 fprintf(stderr, "Timeout esperando DATA\n");
             } else {
@@ -183,6 +630,8 @@ void receive_file(const char *ip, int port, const char *filename) {
             close(sockfd);
             exit(EXIT_FAILURE);
         }
+        respondio = 1;
+        reintentos = 0;
 
         /* Leer opcode y code_or_block */
         uint16_t opcode = ntohs(*(uint16_t *)(buf + 0));
@@ -196,6 +645,18 @@ void receive_file(const char *ip, int port, const char *filename) {
             close(sockfd);
             exit(EXIT_FAILURE);
         }
+        else if (opcode == OPCODE_OACK && esperado == 1) {
+            /* El servidor aceptó opciones: se confirman con ACK 0 */
+            procesar_oack(buf, n);
+            opciones_buffer(sockfd, blksize, ventana);
+            preasignar(sockfd, &server_addr, addr_len, file);
+            if (grupo.sin_family == AF_INET) {
+                recibir_multicast(sockfd, &principal, &server_addr, rrq, pkt_len, file, filename);
+                break;
+            }
+            send_ack(sockfd, &server_addr, addr_len, 0);
+            continue;
+        }
         else if (opcode != OPCODE_DATA) {
             fprintf(stderr, "Paquete inesperado (opcode=%d)\n", opcode);
             fclose(file);
@@ -205,31 +666,61 @@ void receive_file(const char *ip, int port, const char *filename) {
 
         /* Es paquete DATA */
         uint16_t block = code_or_block;
-        if (block != expected_block) {
-            /* reenviar ACK del último bloque válido */
-            send_ack(sockfd, &server_addr, addr_len, expected_block - 1);
+        /* Sin la opción, el servidor elige el rollover: se ve en la primera vuelta */
+        if (!rollover_acordado && esperado == UINT16_MAX + 1 && block == !rollover)
+            rollover = block;
+        if (block != en_cable(esperado)) {
+            /*
+             * hueco en la ventana: reenviar ACK del último bloque válido, una
+             * vez por ráfaga (si la distancia no crece, el servidor retrocedió)
+             */
+            int lejos = distancia(block, esperado);
+            if (!hueco || lejos <= fuera) {
+                hueco = 1;
+                en_ventana = 0;
+                send_ack(sockfd, &server_addr, addr_len, en_cable(esperado - 1));
+            }
+            fuera = lejos;
             continue;
         }
+        hueco = 0;
 
         size_t data_len = n - 4;
-        if (fwrite(buf + 4, 1, data_len, file) != data_len) {
+        int ultimo = data_len < (size_t)blksize;
+        const uint8_t *datos = buf + 4;
+        size_t escribir = data_len;
+        if (netascii) {
+            escribir = netascii_decodificar(buf + 4, data_len, texto, &cr);
+            if (ultimo && cr)
+                escribir += netascii_decodificar(NULL, 0, texto + escribir, &cr);
+            datos = texto;
+        }
+        if (fwrite(datos, 1, escribir, file) != escribir) {
             perror("fwrite");
             fclose(file);
             close(sockfd);
             exit(EXIT_FAILURE);
         }
+        recibidos += data_len;
+        mostrar_progreso(filename, recibidos);
 
-        /* Enviar ACK de este bloque */
-        send_ack(sockfd, &server_addr, addr_len, block);
+        /* ACK acumulativo al completar la ventana o con el último bloque */
+        if (ultimo || ++en_ventana >= ventana) {
+            en_ventana = 0;
+            send_ack(sockfd, &server_addr, addr_len, block);
+        }
 
-        if (data_len < BLOCK_SIZE) {
+        if (ultimo) {
             /* último bloque recibido */
-            printf("Descarga completa: %s (%zu bytes)\n", filename, ftell(file));
+            printf("Descarga completa: %s (%lld bytes)\n", filename, recibidos);
             break;
         }
-        expected_block++;
+        esperado++;
     }
 
+    free(rrq);
+    free(buf);
+    free(texto);
     fclose(file);
     close(sockfd);
 }
@@ -250,6 +741,17 @@ void send_file(const char *ip, int port, const char *filename) {
         exit(EXIT_FAILURE);
     }
 
+    /* El tamaño viaja como tsize en el WRQ */
+    struct stat st;
+    if (fstat(fileno(file), &st) < 0) {
+        perror("fstat");
+        exit(EXIT_FAILURE);
+    }
+    tsize = st.st_size;
+    uint8_t *texto = NULL;      /* netascii: el archivo ya traducido, de 'tsize' bytes */
+    if (netascii)
+        texto = traducir_archivo(file, st.st_size, &tsize);
+
     /* Crear socket UDP */
     if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
         perror("socket");
@@ -257,8 +759,8 @@ void send_file(const char *ip, int port, const char *filename) {
         exit(EXIT_FAILURE);
     }
 
-    /* Configurar timeout de 5 segundos en recvfrom() */
-    struct timeval tv = {10, 0};
+    /* Configurar timeout de 1 segundo (o -t) en recvfrom(): al vencer se retransmite */
+    struct timeval tv = {timeout_pedido > 0 ? timeout_pedido : 1, 0};
     if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
         perror("setsockopt SO_RCVTIMEO");
         fclose(file);
@@ -277,25 +779,16 @@ void send_file(const char *ip, int port, const char *filename) {
         exit(EXIT_FAILURE);
     }
 
-    /* Construir paquete WRQ: [opcode=2][filename][0]['o''c''t''e''t'][0] */
+    /* Construir paquete WRQ: [opcode=2][filename][0]['o''c''t''e''t'][0][opciones] */
     size_t name_len = strlen(filename);
-    const char *mode_str = "octet";
-    size_t mode_len = strlen(mode_str);
-    size_t pkt_len = 2 + name_len + 1 + mode_len + 1;
-    uint8_t *wrq = malloc(pkt_len);
+    uint8_t *wrq = malloc(2 + name_len + 1 + OPCIONES_MAX);
     if (!wrq) {
         perror("malloc");
         fclose(file);
         close(sockfd);
         exit(EXIT_FAILURE);
     }
-
-    uint16_t op_net = htons(OPCODE_WRQ);
-    memcpy(wrq + 0, &op_net, 2);
-    memcpy(wrq + 2, filename, name_len);
-    wrq[2 + name_len] = 0;
-    memcpy(wrq + 3 + name_len, mode_str, mode_len);
-    wrq[3 + name_len + mode_len] = 0;
+    size_t pkt_len = armar_pedido(wrq, OPCODE_WRQ, filename, tsize);
 
     /* Enviar WRQ */
     if (sendto(sockfd, wrq, pkt_len, 0, (struct sockaddr *)&server_addr, addr_len) < 0) {
@@ -305,21 +798,26 @@ void send_file(const char *ip, int port, const char *filename) {
         close(sockfd);
         exit(EXIT_FAILURE);
     }
-    free(wrq);
 
-    /* Esperar respuesta: puede ser ACK(0) o ERROR */
+    /* Esperar respuesta: puede ser ACK(0), OACK o ERROR */
     uint8_t buf[MAX_PACKET_SIZE];
-    ssize_t n = recvfrom(sockfd, buf, sizeof(buf), 0, (struct sockaddr *)&server_addr, &addr_len);
-    if (n < 0) {
-        if (errno == EWOULDBLOCK || errno == EAGAIN) {
-            fprintf(stderr, "Timeout esperando ACK 0\n");
-        } else {
-            perror("recvfrom ACK 0 / ERROR");
+    ssize_t n;
+    int reintentos = 0;
+    while ((n = recvfrom(sockfd, buf, sizeof(buf), 0, (struct sockaddr *)&server_addr, &addr_len)) < 0) {
+        if ((errno != EWOULDBLOCK && errno != EAGAIN) || ++reintentos > MAX_REINTENTOS) {
+            if (errno == EWOULDBLOCK || errno == EAGAIN) {
+                fprintf(stderr, "Timeout esperando ACK 0\n");
+            } else {
+                perror("recvfrom ACK 0 / ERROR");
+            }
+            free(wrq);
+            fclose(file);
+            close(sockfd);
+            exit(EXIT_FAILURE);
         }
-        fclose(file);
-        close(sockfd);
-        exit(EXIT_FAILURE);
+        sendto(sockfd, wrq, pkt_len, 0, (struct sockaddr *)&server_addr, addr_len);
     }
+    free(wrq);
 
     uint16_t opcode = ntohs(*(uint16_t *)(buf + 0));
     uint16_t code_or_block = ntohs(*(uint16_t *)(buf + 2));
@@ -332,6 +830,10 @@ void send_file(const char *ip, int port, const char *filename) {
         close(sockfd);
         exit(EXIT_FAILURE);
     }
+    else if (opcode == OPCODE_OACK) {
+        /* El OACK reemplaza al ACK 0 */
+        procesar_oack(buf, n);
+    }
     else if (opcode != OPCODE_ACK || code_or_block != 0) {
         fprintf(stderr, "Respuesta inesperada: opcode=%d, block=%d\n", opcode, code_or_block);
         fclose(file);
@@ -339,33 +841,58 @@ void send_file(const char *ip, int port, const char *filename) {
         exit(EXIT_FAILURE);
     }
 
-    /* Si llegamos aquí, recibimos ACK(0). Enviar bloques DATA */
-    uint16_t block_num = 1;
+    /*
+     * Si llegamos aquí, recibimos ACK(0) u OACK. Se envían ventanas de hasta
+     * 'ventana' bloques; cada bloque se lee por su posición, así retroceder
+     * al último confirmado es solo volver a leer.
+     */
+    uint64_t total = tsize / blksize + 1;         /* el último bloque es corto (o vacío) */
+    uint64_t base = 1;                            /* primer bloque sin confirmar */
+    uint64_t siguiente = 1;                       /* próximo bloque a enviar */
+    int retrocedio = 0;
+    reintentos = 0;
+
+    uint8_t *data_pkt = malloc(4 + blksize);
+    if (!data_pkt) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
     while (1) {
-        uint8_t data_pkt[4 + BLOCK_SIZE] = {0};
-        size_t bytes_read = fread(data_pkt + 4, 1, BLOCK_SIZE, file);
-        if (bytes_read < 0) {
-            perror("fread");
-            break;
-        }
+        for (; siguiente < base + ventana && siguiente <= total; siguiente++) {
+            off_t offset = (off_t)(siguiente - 1) * blksize;
+            ssize_t bytes_read;
+            if (texto) {
+                bytes_read = tsize - offset < blksize ? tsize - offset : blksize;
+                memcpy(data_pkt + 4, texto + offset, bytes_read);
+            } else {
+                bytes_read = pread(fileno(file), data_pkt + 4, blksize, offset);
+            }
+            if (bytes_read < 0) {
+                perror("pread");
+                exit(EXIT_FAILURE);
+            }
 
-        uint16_t data_op_net = htons(OPCODE_DATA);
-        uint16_t blk_net     = htons(block_num);
-        memcpy(data_pkt + 0, &data_op_net, 2);
-        memcpy(data_pkt + 2, &blk_net,    2);
+            uint16_t data_op_net = htons(OPCODE_DATA);
+            uint16_t blk_net     = htons(en_cable(siguiente));
+            memcpy(data_pkt + 0, &data_op_net, 2);
+            memcpy(data_pkt + 2, &blk_net,    2);
 
-        /* Enviar DATA blok N */
-        size_t send_len = 4 + bytes_read;
-        if (sendto(sockfd, data_pkt, send_len, 0, (struct sockaddr *)&server_addr, addr_len) < 0) {
-            perror("sendto DATA");
-            break;
+            /* Enviar DATA blok N */
+            if (sendto(sockfd, data_pkt, 4 + bytes_read, 0, (struct sockaddr *)&server_addr, addr_len) < 0) {
+                perror("sendto DATA");
+                exit(EXIT_FAILURE);
+            }
         }
 
-        /* Esperar ACK N o ERROR */
+        /* Esperar ACK o ERROR */
         n = recvfrom(sockfd, buf, sizeof(buf), 0, (struct sockaddr *)&server_addr, &addr_len);
         if (n < 0) {
+            if ((errno == EWOULDBLOCK || errno == EAGAIN) && ++reintentos <= MAX_REINTENTOS) {
+                siguiente = base;   /* repetir la ventana desde el primer bloque sin confirmar */
+                continue;
+            }
             if (errno == EWOULDBLOCK || errno == EAGAIN) {
-                fprintf(stderr, "Timeout esperando ACK %d\n", block_num);
+                fprintf(stderr, "Timeout esperando ACK %u\n", (unsigned)en_cable(base));
             } else {
                 perror("recvfrom ACK / ERROR");
             }
@@ -384,21 +911,43 @@ void send_file(const char *ip, int port, const char *filename) {
             close(sockfd);
             exit(EXIT_FAILURE);
         }
-        else if (opcode != OPCODE_ACK || code_or_block != block_num) {
+        else if (opcode == OPCODE_OACK && base == 1) {
+            /* el OACK repetido vale como ACK 0: el servidor no recibió el DATA 1 */
+            siguiente = base;
+            continue;
+        }
+        else if (opcode != OPCODE_ACK) {
             fprintf(stderr, "ACK inválido: opcode=%d, block=%d\n", opcode, code_or_block);
             fclose(file);
             close(sockfd);
             exit(EXIT_FAILURE);
         }
 
-        if (bytes_read < BLOCK_SIZE) {
-            /* último bloque enviado */
-            printf("Subida completa: %s\n", filename);
-            break;
+        /* ACK acumulativo: cuántos bloques de la ventana en vuelo confirma */
+        uint64_t avance = adelante(base - 1, code_or_block);
+        if (avance > siguiente - base)
+            continue;   /* viejo o repetido: se ignora */
+        if (avance == 0) {
+            /* el servidor perdió el primer bloque: retroceder una vez por hueco */
+            if (ventana == 1 || retrocedio)
+                continue;
+            retrocedio = 1;
+        } else {
+            base += avance;
+            retrocedio = 0;
+            reintentos = 0;
+            mostrar_progreso(filename, base > total ? tsize : (long long)(base - 1) * blksize);
+            if (base > total) {
+                /* último bloque confirmado */
+                printf("Subida completa: %s\n", filename);
+                break;
+            }
         }
-        block_num++;
+        siguiente = base;
     }
 
+    free(data_pkt);
+    free(texto);
     fclose(file);
     close(sockfd);
 }
@@ -0,0 +1,560 @@
+/*
+ * Generador de carga para servidores TFTP
+ *
+ * Uso:
+ *   ./tftp-bench [-r] [-w] [-c concurrentes] [-s sesiones] [-z bytes] [-b blksize] [-W ventana]
+ *                [-t segundos] [-o resultados.json] <IP-servidor> <puerto> <archivo>
+ *
+ * Ejemplos:
+ *   ./tftp-bench -r -c 200 -s 2000 -b 1428 -W 16 127.0.0.1 6900 pxelinux.0
+ *   ./tftp-bench -w -c 50 -z 1048576 -o wrq.json 127.0.0.1 6900 subida
+ *
+ * Este programa:
+ *   - Arma los paquetes como cienteV3 (mismo RRQ/WRQ con opciones, ACK
+ *     acumulativo por ventana y go-back-N), pero cada sesión corre en un hilo
+ *     y no toca el disco: lo bajado se descarta y lo subido sale de memoria.
+ *   - Lanza -c hilos que toman sesiones de a una hasta completar -s (por
+ *     defecto, una por hilo). Con -r bajan 'archivo'; con -w suben -z bytes
+ *     a 'archivo.<pid>.<n>' (el servidor no acepta pisar un archivo); con
+ *     los dos se alternan.
+ *   - Con -r y -z primero sube 'archivo' con ese tamaño; si el servidor ya
+ *     lo tiene, se baja el que hay.
+ *   - Mide por sesión el tiempo hasta el primer byte (el primer DATA de un
+ *     RRQ, o el ACK 0 u OACK de un WRQ: cuando el servidor empieza a aceptar
+ *     datos) y hasta completar, y los reintentos por timeout.
+ *   - Informa rendimiento total, sesiones por segundo y la media, p50, p99 y
+ *     máximo de ambos tiempos. Con -o escribe lo mismo en JSON, para
+ *     comparar entre versiones del servidor.
+ *
+ * Compilar:
+ *   make tftp-bench
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "../tftp-opciones.h"
+
+#define BLOCK_SIZE      512
+#define MAX_BLKSIZE     65464
+#define MAX_PACKET_SIZE (4 + MAX_BLKSIZE)
+#define MAX_VENTANA     65535
+#define MAX_REINTENTOS  5                   /* timeouts seguidos antes de abandonar */
+#define MAX_HILOS       4096
+
+#define OPCODE_RRQ   1
+#define OPCODE_WRQ   2
+#define OPCODE_DATA  3
+#define OPCODE_ACK   4
+#define OPCODE_ERROR 5
+#define OPCODE_OACK  6
+
+#define TFTP_ERR_EXISTS 6
+
+/* Lo medido en una sesión; los tiempos son del reloj monotónico */
+typedef struct Medicion {
+    int tipo;                   /* OPCODE_RRQ u OPCODE_WRQ */
+    int completa;
+    int error;                  /* código del ERROR recibido, o -1 si fue timeout */
+    int reintentos;
+    long long bytes;
+    uint64_t inicio_ns;         /* cuándo salió el pedido */
+    uint64_t primero_ns;        /* primer DATA (RRQ) o ACK 0 / OACK (WRQ); 0 = nunca */
+    uint64_t fin_ns;
+} Medicion;
+
+/* Opciones de la línea de comandos */
+static int leer = 0, escribir = 0;
+static int concurrentes = 1;
+static int sesiones = 0;
+static long long tamano = -1;       /* -z: bytes de cada subida (-1 = no se indicó) */
+static int blksize_pedido = 0;
+static int ventana_pedida = 0;
+static int espera = 1;              /* -t: segundos antes de retransmitir */
+static const char *archivo;
+static struct sockaddr_in servidor;
+
+static uint8_t *contenido;          /* lo que se sube, 'tamano' bytes */
+static Medicion *mediciones;
+static atomic_int proxima;
+
+/* RRQ/WRQ en octet con las opciones pedidas. Devuelve la longitud. */
+static size_t armar_pedido(uint8_t *pkt, uint16_t opcode, const char *nombre, long long tsize) {
+    Opciones op = { .blksize = blksize_pedido, .ventana = ventana_pedida, .rollover = -1, .tsize = tsize };
+    return opciones_pedido(pkt, opcode, nombre, &op);
+}
+
+/* blksize y windowsize aceptados en un OACK */
+static void procesar_oack(const uint8_t *buf, ssize_t n, int *blksize, int *ventana) {
+    Acuerdo a = { .blksize = *blksize, .ventana = *ventana, .tsize = -1, .rollover = -1 };
+    opciones_oack(buf, n, &a);
+    *blksize = a.blksize;
+    *ventana = a.ventana;
+}
+
+/* Socket UDP con el timeout de -t en recvfrom(), en el próximo puerto libre */
+static int abrir_socket(void) {
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        perror("socket");
+        return -1;
+    }
+    struct timeval tv = { espera, 0 };
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    elegir_puerto(sockfd);
+    return sockfd;
+}
+
+/*
+ * bajar: un RRQ de 'archivo' hasta el último bloque, descartando los datos.
+ * Sin rollover: los bloques dan la vuelta a 0, como espera el servidor por defecto.
+ */
+static void bajar(Medicion *m, uint8_t *buf) {
+    struct sockaddr_in origen = servidor;
+    socklen_t addr_len = sizeof(origen);
+    int blksize = BLOCK_SIZE, ventana = 1;
+    uint8_t rrq[2 + 256 + OPCIONES_MAX];
+    size_t pkt_len = armar_pedido(rrq, OPCODE_RRQ, archivo, -1);
+
+    m->tipo = OPCODE_RRQ;
+    m->error = -1;
+    int sockfd = abrir_socket();
+    if (sockfd < 0)
+        return;
+    m->inicio_ns = monotonic_ns();
+    sendto(sockfd, rrq, pkt_len, 0, (struct sockaddr *)&servidor, sizeof(servidor));
+
+    uint64_t esperado = 1;
+    int respondio = 0, en_ventana = 0, hueco = 0, fuera = 0, reintentos = 0;
+    while (1) {
+        ssize_t n = recvfrom(sockfd, buf, MAX_PACKET_SIZE, 0, (struct sockaddr *)&origen, &addr_len);
+        if (n < 0) {
+            if ((errno != EWOULDBLOCK && errno != EAGAIN) || ++reintentos > MAX_REINTENTOS)
+                break;
+            m->reintentos++;
+            if (!respondio) {
+                sendto(sockfd, rrq, pkt_len, 0, (struct sockaddr *)&servidor, sizeof(servidor));
+            } else {
+                enviar_ack(sockfd, &origen, (uint16_t)(esperado - 1));
+                en_ventana = 0;
+            }
+            continue;
+        }
+        if (n < 4)
+            continue;
+        respondio = 1;
+        reintentos = 0;
+
+        uint16_t opcode = ntohs(*(uint16_t *)(buf + 0));
+        uint16_t block = ntohs(*(uint16_t *)(buf + 2));
+        if (opcode == OPCODE_ERROR) {
+            m->error = block;
+            break;
+        }
+        if (opcode == OPCODE_OACK && esperado == 1) {
+            procesar_oack(buf, n, &blksize, &ventana);
+            opciones_buffer(sockfd, blksize, ventana);
+            enviar_ack(sockfd, &origen, 0);
+            continue;
+        }
+        if (opcode != OPCODE_DATA)
+            break;
+
+        if (block != (uint16_t)esperado) {
+            /* Hueco: confirmar el último en orden, una vez por ráfaga */
+            int lejos = (int16_t)(block - (uint16_t)esperado);
+            if (!hueco || lejos <= fuera) {
+                hueco = 1;
+                en_ventana = 0;
+                enviar_ack(sockfd, &origen, (uint16_t)(esperado - 1));
+            }
+            fuera = lejos;
+            continue;
+        }
+        hueco = 0;
+        if (!m->primero_ns)
+            m->primero_ns = monotonic_ns();
+        m->bytes += n - 4;
+
+        int ultimo = n - 4 < blksize;
+        if (ultimo || ++en_ventana >= ventana) {
+            en_ventana = 0;
+            enviar_ack(sockfd, &origen, block);
+        }
+        if (ultimo) {
+            m->completa = 1;
+            break;
+        }
+        esperado++;
+    }
+    m->fin_ns = monotonic_ns();
+    close(sockfd);
+}
+
+/* subir: un WRQ de 'tamano' bytes de 'contenido' con el nombre 'nombre' */
+static void subir(Medicion *m, const char *nombre, uint8_t *buf) {
+    struct sockaddr_in origen = servidor;
+    socklen_t addr_len = sizeof(origen);
+    int blksize = BLOCK_SIZE, ventana = 1;
+    uint8_t wrq[2 + 256 + OPCIONES_MAX];
+    size_t pkt_len = armar_pedido(wrq, OPCODE_WRQ, nombre, tamano);
+
+    m->tipo = OPCODE_WRQ;
+    m->error = -1;
+    int sockfd = abrir_socket();
+    if (sockfd < 0)
+        return;
+    m->inicio_ns = monotonic_ns();
+    sendto(sockfd, wrq, pkt_len, 0, (struct sockaddr *)&servidor, sizeof(servidor));
+
+    /* Esperar ACK 0, OACK o ERROR */
+    ssize_t n;
+    int reintentos = 0;
+    while ((n = recvfrom(sockfd, buf, MAX_PACKET_SIZE, 0, (struct sockaddr *)&origen, &addr_len)) < 4) {
+        if (n >= 0)
+            continue;
+        if ((errno != EWOULDBLOCK && errno != EAGAIN) || ++reintentos > MAX_REINTENTOS)
+            goto fin;
+        m->reintentos++;
+        sendto(sockfd, wrq, pkt_len, 0, (struct sockaddr *)&servidor, sizeof(servidor));
+    }
+    uint16_t opcode = ntohs(*(uint16_t *)(buf + 0));
+    uint16_t block = ntohs(*(uint16_t *)(buf + 2));
+    if (opcode == OPCODE_ERROR) {
+        m->error = block;
+        goto fin;
+    }
+    if (opcode == OPCODE_OACK)
+        procesar_oack(buf, n, &blksize, &ventana);
+    else if (opcode != OPCODE_ACK || block != 0)
+        goto fin;
+    m->primero_ns = monotonic_ns();
+
+    /* Ventanas de hasta 'ventana' bloques; retroceder es volver a tomar de memoria */
+    uint64_t total = tamano / blksize + 1;
+    uint64_t base = 1, siguiente = 1;
+    int retrocedio = 0;
+    reintentos = 0;
+    uint8_t *data_pkt = malloc(4 + blksize);
+    if (!data_pkt)
+        goto fin;
+    while (1) {
+        for (; siguiente < base + ventana && siguiente <= total; siguiente++) {
+            long long offset = (long long)(siguiente - 1) * blksize;
+            size_t largo = tamano - offset < blksize ? tamano - offset : blksize;
+            uint16_t op_net = htons(OPCODE_DATA);
+            uint16_t blk_net = htons((uint16_t)siguiente);
+            memcpy(data_pkt + 0, &op_net, 2);
+            memcpy(data_pkt + 2, &blk_net, 2);
+            memcpy(data_pkt + 4, contenido + offset, largo);
+            sendto(sockfd, data_pkt, 4 + largo, 0, (struct sockaddr *)&origen, sizeof(origen));
+        }
+
+        n = recvfrom(sockfd, buf, MAX_PACKET_SIZE, 0, (struct sockaddr *)&origen, &addr_len);
+        if (n < 0) {
+            if ((errno != EWOULDBLOCK && errno != EAGAIN) || ++reintentos > MAX_REINTENTOS)
+                break;
+            m->reintentos++;
+            siguiente = base;
+            continue;
+        }
+        if (n < 4)
+            continue;
+        opcode = ntohs(*(uint16_t *)(buf + 0));
+        block = ntohs(*(uint16_t *)(buf + 2));
+        if (opcode == OPCODE_ERROR) {
+            m->error = block;
+            break;
+        }
+        if (opcode == OPCODE_OACK && base == 1) {
+            /* OACK repetido: el servidor no recibió el DATA 1, vale como ACK 0 */
+            siguiente = base;
+            continue;
+        }
+        if (opcode != OPCODE_ACK)
+            break;
+
+        uint64_t avance = (uint16_t)(block - (uint16_t)(base - 1));
+        if (avance > siguiente - base)
+            continue;
+        if (avance == 0) {
+            if (ventana == 1 || retrocedio)
+                continue;
+            retrocedio = 1;
+        } else {
+            base += avance;
+            retrocedio = 0;
+            reintentos = 0;
+            if (base > total) {
+                m->bytes = tamano;
+                m->completa = 1;
+                break;
+            }
+        }
+        siguiente = base;
+    }
+    free(data_pkt);
+fin:
+    m->fin_ns = monotonic_ns();
+    close(sockfd);
+}
+
+/* Cada hilo toma la próxima sesión sin hacer hasta que no quedan */
+static void *trabajador(void *arg) {
+    (void)arg;
+    uint8_t *buf = malloc(MAX_PACKET_SIZE);
+    char nombre[256 + 32];
+    if (!buf) {
+        perror("malloc");
+        return NULL;
+    }
+    int i;
+    while ((i = atomic_fetch_add(&proxima, 1)) < sesiones) {
+        Medicion *m = &mediciones[i];
+        if (leer && (!escribir || i % 2 == 0)) {
+            bajar(m, buf);
+        } else {
+            snprintf(nombre, sizeof(nombre), "%s.%d.%d", archivo, (int)getpid(), i);
+            subir(m, nombre, buf);
+        }
+        if (!m->completa) {
+            if (m->error >= 0)
+                fprintf(stderr, "Sesión %d: TFTP Error %d\n", i, m->error);
+            else
+                fprintf(stderr, "Sesión %d: sin respuesta\n", i);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static int comparar(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+typedef struct Resumen {
+    double media, p50, p99, maximo;
+} Resumen;
+
+/* Estadísticos de 'n' valores; ordena 'v' (percentil por rango más cercano) */
+static Resumen resumir(double *v, int n) {
+    Resumen r = { 0, 0, 0, 0 };
+    if (n == 0)
+        return r;
+    qsort(v, n, sizeof(double), comparar);
+    for (int i = 0; i < n; i++)
+        r.media += v[i];
+    r.media /= n;
+    r.p50 = v[(n * 50 + 99) / 100 - 1];
+    r.p99 = v[(n * 99 + 99) / 100 - 1];
+    r.maximo = v[n - 1];
+    return r;
+}
+
+static void json_resumen(FILE *f, const char *nombre, Resumen r, const char *sigue) {
+    fprintf(f, "  \"%s\": {\"media\": %.3f, \"p50\": %.3f, \"p99\": %.3f, \"max\": %.3f}%s\n",
+            nombre, r.media, r.p50, r.p99, r.maximo, sigue);
+}
+
+void usage(const char *progname) {
+    fprintf(stderr,
+        "Uso: %s [-r] [-w] [-c concurrentes] [-s sesiones] [-z bytes] [-b blksize] [-W ventana]\n"
+        "       [-t segundos] [-o resultados.json] <IP-servidor> <puerto> <archivo>\n"
+        "  -r / -w: bajar 'archivo' / subir 'archivo.<pid>.<n>' (con los dos, se alternan)\n"
+        "  -c: sesiones simultáneas (por defecto 1)\n"
+        "  -s: sesiones en total (por defecto, una por cada concurrente)\n"
+        "  -z: bytes de cada subida; con -r, sube 'archivo' con ese tamaño antes de empezar\n"
+        "  -o: escribe los resultados en JSON\n",
+        progname);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    const char *salida = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "rwc:s:z:b:W:t:o:")) != -1) {
+        switch (c) {
+        case 'r':
+            leer = 1;
+            break;
+        case 'w':
+            escribir = 1;
+            break;
+        case 'c':
+            concurrentes = atoi(optarg);
+            if (concurrentes < 1 || concurrentes > MAX_HILOS)
+                usage(argv[0]);
+            break;
+        case 's':
+            sesiones = atoi(optarg);
+            if (sesiones < 1)
+                usage(argv[0]);
+            break;
+        case 'z':
+            tamano = atoll(optarg);
+            if (tamano < 0)
+                usage(argv[0]);
+            break;
+        case 'b':
+            blksize_pedido = atoi(optarg);
+            if (blksize_pedido < 8 || blksize_pedido > MAX_BLKSIZE)
+                usage(argv[0]);
+            break;
+        case 'W':
+            ventana_pedida = atoi(optarg);
+            if (ventana_pedida < 1 || ventana_pedida > MAX_VENTANA)
+                usage(argv[0]);
+            break;
+        case 't':
+            espera = atoi(optarg);
+            if (espera < 1)
+                usage(argv[0]);
+            break;
+        case 'o':
+            salida = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if ((!leer && !escribir) || argc - optind != 3 || (escribir && tamano < 0))
+        usage(argv[0]);
+    archivo = argv[optind + 2];
+    if (strlen(archivo) > 200)
+        usage(argv[0]);
+    if (sesiones == 0)
+        sesiones = concurrentes;
+
+    leer_rango_efimero();
+    memset(&servidor, 0, sizeof(servidor));
+    servidor.sin_family = AF_INET;
+    servidor.sin_port = htons(atoi(argv[optind + 1]));
+    if (inet_aton(argv[optind], &servidor.sin_addr) == 0) {
+        fprintf(stderr, "IP inválida: %s\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Contenido de las subidas: no todo ceros, por si algo en el camino comprime */
+    if (tamano >= 0) {
+        contenido = malloc(tamano + 1);
+        if (!contenido) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        for (long long i = 0; i < tamano; i++)
+            contenido[i] = (uint8_t)(i * 2654435761u >> 24);
+    }
+    mediciones = calloc(sesiones, sizeof(Medicion));
+    if (!mediciones) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    if (leer && tamano >= 0) {
+        Medicion m = { 0 };
+        uint8_t *buf = malloc(MAX_PACKET_SIZE);
+        if (!buf) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        subir(&m, archivo, buf);
+        free(buf);
+        if (!m.completa && m.error != TFTP_ERR_EXISTS) {
+            fprintf(stderr, "No se pudo subir %s\n", archivo);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_t *hilos = malloc(concurrentes * sizeof(pthread_t));
+    if (!hilos) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t inicio = monotonic_ns();
+    int lanzados = 0;
+    for (; lanzados < concurrentes; lanzados++) {
+        int r = pthread_create(&hilos[lanzados], NULL, trabajador, NULL);
+        if (r != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(r));
+            break;
+        }
+    }
+    for (int i = 0; i < lanzados; i++)
+        pthread_join(hilos[i], NULL);
+    double segundos = (monotonic_ns() - inicio) / 1e9;
+    free(hilos);
+
+    /* Totales y tiempos de las sesiones completas, en ms */
+    double *primero = malloc(sesiones * sizeof(double));
+    double *completar = malloc(sesiones * sizeof(double));
+    if (!primero || !completar) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    int completas = 0, reintentos = 0;
+    long long bytes = 0;
+    for (int i = 0; i < sesiones; i++) {
+        Medicion *m = &mediciones[i];
+        reintentos += m->reintentos;
+        if (!m->completa)
+            continue;
+        bytes += m->bytes;
+        primero[completas] = (m->primero_ns - m->inicio_ns) / 1e6;
+        completar[completas] = (m->fin_ns - m->inicio_ns) / 1e6;
+        completas++;
+    }
+    Resumen ttfb = resumir(primero, completas);
+    Resumen total = resumir(completar, completas);
+    double mb_s = bytes / segundos / 1e6;
+    double sesiones_s = completas / segundos;
+    const char *modo = leer && escribir ? "rrq+wrq" : leer ? "rrq" : "wrq";
+
+    printf("%s %s: %d sesiones (%d completas, %d fallidas) en %.3f s con %d concurrentes\n",
+           modo, archivo, sesiones, completas, sesiones - completas, segundos, lanzados);
+    printf("Rendimiento: %.1f MB/s (%lld bytes), %.1f sesiones/s, %d reintentos\n",
+           mb_s, bytes, sesiones_s, reintentos);
+    printf("Primer byte (ms): media %.3f, p50 %.3f, p99 %.3f, máx %.3f\n",
+           ttfb.media, ttfb.p50, ttfb.p99, ttfb.maximo);
+    printf("Completar (ms):   media %.3f, p50 %.3f, p99 %.3f, máx %.3f\n",
+           total.media, total.p50, total.p99, total.maximo);
+
+    if (salida) {
+        FILE *f = fopen(salida, "w");
+        if (!f) {
+            perror("fopen resultados");
+            exit(EXIT_FAILURE);
+        }
+        fprintf(f, "{\n  \"modo\": \"%s\",\n  \"archivo\": \"%s\",\n", modo, archivo);
+        fprintf(f, "  \"concurrentes\": %d,\n  \"sesiones\": %d,\n  \"blksize\": %d,\n  \"ventana\": %d,\n"
+                "  \"tamano\": %lld,\n", lanzados, sesiones, blksize_pedido ? blksize_pedido : BLOCK_SIZE,
+                ventana_pedida ? ventana_pedida : 1, tamano);
+        fprintf(f, "  \"completas\": %d,\n  \"fallidas\": %d,\n  \"reintentos\": %d,\n",
+                completas, sesiones - completas, reintentos);
+        fprintf(f, "  \"segundos\": %.6f,\n  \"bytes\": %lld,\n  \"mb_s\": %.3f,\n  \"sesiones_s\": %.3f,\n",
+                segundos, bytes, mb_s, sesiones_s);
+        json_resumen(f, "primer_byte_ms", ttfb, ",");
+        json_resumen(f, "completar_ms", total, "");
+        fprintf(f, "}\n");
+        fclose(f);
+    }
+
+    free(primero);
+    free(completar);
+    free(mediciones);
+    free(contenido);
+    return completas == sesiones ? 0 : EXIT_FAILURE;
+}
@@ -0,0 +1,600 @@
+/*
+ * Cliente TFTP que baja muchos archivos a la vez desde un manifiesto
+ *
+ * Uso:
+ *   ./tftp-paralelo [-c concurrentes] [-b blksize] [-W ventana] [-d directorio] <IP-servidor> <puerto> <manifiesto>
+ *
+ * El manifiesto tiene un archivo por línea: el nombre en el servidor y,
+ * opcional, dónde guardarlo (por defecto, el mismo nombre sin directorios).
+ * Las líneas vacías y las que empiezan con '#' se ignoran. Con "-" se lee
+ * de la entrada estándar.
+ *
+ *   # artefactos de la imagen
+ *   pxelinux.0
+ *   imagenes/vmlinuz        vmlinuz-6.1
+ *   imagenes/initrd.img
+ *
+ * Ejemplo:
+ *   ./tftp-paralelo -c 64 -b 1428 -W 16 -d /srv/cache 10.0.0.1 69 artefactos.txt
+ *
+ * Este cliente:
+ *   - Atiende hasta -c descargas (16 por defecto) en un solo hilo con epoll:
+ *     cada una con su socket no bloqueante, es decir, su propio TID. Al
+ *     terminar una, arranca la siguiente del manifiesto.
+ *   - Negocia blksize, windowsize y tsize como cienteV3 y confirma con ACK
+ *     acumulativos por ventana; ante un hueco pide retomar desde el último
+ *     bloque en orden, una vez por ráfaga.
+ *   - Retransmite con un RTO por descarga calculado como el del servidor
+ *     (RFC 6298, con la regla de Karn y backoff) en lugar de un timeout
+ *     fijo: un servidor cercano se recupera de una pérdida en milisegundos.
+ *   - Escribe en 'local.parte' y lo renombra al completar; si la descarga
+ *     falla, lo borra. Con tsize reserva el espacio antes de recibir.
+ *   - Informa cada archivo al terminar y un resumen al final; sale con error
+ *     si falló alguno.
+ *
+ * Compilar:
+ *   make tftp-paralelo
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "../tftp-opciones.h"
+
+#define BLOCK_SIZE      512
+#define MAX_BLKSIZE     65464
+#define MAX_PACKET_SIZE (4 + MAX_BLKSIZE)
+#define MAX_VENTANA     65535
+#define MAX_REINTENTOS  5                   /* vencimientos seguidos antes de abandonar */
+#define MAX_CONCURRENTES 4096
+#define MAX_EVENTOS     256
+
+/* RTO como el del servidor: arranca en RTO_INICIAL_MS y se ajusta con el RTT medido */
+#define RTO_INICIAL_MS  1000
+#define RTO_MIN_MS      20
+#define RTO_MAX_MS      4000
+
+#define OPCODE_RRQ   1
+#define OPCODE_DATA  3
+#define OPCODE_ACK   4
+#define OPCODE_ERROR 5
+#define OPCODE_OACK  6
+
+#define TFTP_ERR_DISKFULL 3
+
+typedef struct Descarga {
+    char *remoto;
+    char *local;
+    char parte[PATH_MAX];
+    int sock;
+    int fd;
+    struct sockaddr_in servidor;    /* el puerto principal hasta la primera respuesta; después, el TID */
+    uint8_t pedido[2 + 256 + OPCIONES_MAX];
+    size_t pedido_len;
+
+    int respondio;
+    int blksize, ventana;
+    int rollover, rollover_acordado;
+    long long tsize;
+    uint64_t esperado;              /* próximo bloque en orden */
+    int en_ventana, hueco, fuera;
+    long long recibidos;
+
+    uint64_t inicio_ns;
+    uint64_t vence_ns;
+    int reintentos;
+    uint64_t srtt_ns, rttvar_ns, rto_ns;
+    int midiendo;
+    uint64_t marca_ns;
+    int pos_timer;
+} Descarga;
+
+static int concurrentes = 16;
+static int blksize_pedido = 0;
+static int ventana_pedida = 0;
+static const char *directorio = NULL;
+static struct sockaddr_in principal;
+static int ep;
+
+static Descarga *descargas;         /* las del manifiesto, en orden */
+static int n_descargas = 0;
+static int completas = 0, fallidas = 0;
+static long long bytes_totales = 0;
+
+/* Heap binario de descargas por vence_ns, como los temporizadores del motor epoll */
+static Descarga **timers;
+static int n_timers = 0;
+
+static void timer_colocar(int pos, Descarga *d) {
+    timers[pos] = d;
+    d->pos_timer = pos;
+}
+
+static void timer_subir(int pos) {
+    Descarga *d = timers[pos];
+    while (pos > 0) {
+        int padre = (pos - 1) / 2;
+        if (timers[padre]->vence_ns <= d->vence_ns)
+            break;
+        timer_colocar(pos, timers[padre]);
+        pos = padre;
+    }
+    timer_colocar(pos, d);
+}
+
+static void timer_bajar(int pos) {
+    Descarga *d = timers[pos];
+    while (1) {
+        int hijo = 2 * pos + 1;
+        if (hijo >= n_timers)
+            break;
+        if (hijo + 1 < n_timers && timers[hijo + 1]->vence_ns < timers[hijo]->vence_ns)
+            hijo++;
+        if (d->vence_ns <= timers[hijo]->vence_ns)
+            break;
+        timer_colocar(pos, timers[hijo]);
+        pos = hijo;
+    }
+    timer_colocar(pos, d);
+}
+
+static void timer_actualizar(Descarga *d) {
+    if (d->pos_timer < 0) {
+        timer_colocar(n_timers++, d);
+        timer_subir(d->pos_timer);
+        return;
+    }
+    timer_subir(d->pos_timer);
+    timer_bajar(d->pos_timer);
+}
+
+static void timer_quitar(Descarga *d) {
+    int pos = d->pos_timer;
+    if (pos < 0)
+        return;
+    d->pos_timer = -1;
+    Descarga *ultimo = timers[--n_timers];
+    if (pos == n_timers)
+        return;
+    timer_colocar(pos, ultimo);
+    timer_subir(pos);
+    timer_bajar(ultimo->pos_timer);
+}
+
+static void rearmar(Descarga *d) {
+    d->vence_ns = monotonic_ns() + d->rto_ns;
+    timer_actualizar(d);
+}
+
+/* Empieza a cronometrar lo que se acaba de enviar, si no hay otra medición en curso */
+static void cronometrar(Descarga *d) {
+    if (d->midiendo)
+        return;
+    d->midiendo = 1;
+    d->marca_ns = monotonic_ns();
+}
+
+/* Llegó la respuesta a lo cronometrado: srtt, rttvar y rto (RFC 6298) */
+static void medir_rtt(Descarga *d) {
+    uint64_t r = monotonic_ns() - d->marca_ns;
+    d->midiendo = 0;
+    if (d->srtt_ns == 0) {
+        d->srtt_ns = r;
+        d->rttvar_ns = r / 2;
+    } else {
+        uint64_t dif = d->srtt_ns > r ? d->srtt_ns - r : r - d->srtt_ns;
+        d->rttvar_ns = (3 * d->rttvar_ns + dif) / 4;
+        d->srtt_ns = (7 * d->srtt_ns + r) / 8;
+    }
+    /* La granularidad de epoll_wait es de 1 ms */
+    uint64_t var = 4 * d->rttvar_ns > 1000000 ? 4 * d->rttvar_ns : 1000000;
+    d->rto_ns = d->srtt_ns + var;
+    if (d->rto_ns < (uint64_t)RTO_MIN_MS * 1000000)
+        d->rto_ns = (uint64_t)RTO_MIN_MS * 1000000;
+    if (d->rto_ns > (uint64_t)RTO_MAX_MS * 1000000)
+        d->rto_ns = (uint64_t)RTO_MAX_MS * 1000000;
+}
+
+/* Número de bloque en el cable, con la vuelta después del 65535 a 'rollover' (ver cienteV3) */
+static uint16_t en_cable(const Descarga *d, uint64_t n) {
+    if (n <= UINT16_MAX || d->rollover == 0)
+        return (uint16_t)n;
+    return (uint16_t)(1 + (n - 1) % UINT16_MAX);
+}
+
+/* Distancia con signo del bloque que viaja como 'w' al bloque 'n' */
+static int distancia(const Descarga *d, uint16_t w, uint64_t n) {
+    int dif = (int)w - en_cable(d, n);
+    if (d->rollover == 0)
+        return (int16_t)dif;
+    if (dif > INT16_MAX)
+        dif -= UINT16_MAX;
+    else if (dif < -INT16_MAX)
+        dif += UINT16_MAX;
+    return dif;
+}
+
+static void enviar_error(Descarga *d, uint16_t code, const char *msg) {
+    uint8_t buf[4 + 64];
+    uint16_t op_net = htons(OPCODE_ERROR);
+    uint16_t code_net = htons(code);
+    size_t msg_len = strlen(msg);
+    memcpy(buf + 0, &op_net, 2);
+    memcpy(buf + 2, &code_net, 2);
+    memcpy(buf + 4, msg, msg_len + 1);
+    sendto(d->sock, buf, 4 + msg_len + 1, 0, (struct sockaddr *)&d->servidor, sizeof(d->servidor));
+}
+
+/* RRQ en octet con blksize, windowsize y tsize 0, como cienteV3 */
+static void armar_pedido(Descarga *d) {
+    Opciones op = { .blksize = blksize_pedido, .ventana = ventana_pedida, .rollover = -1, .tsize = 0 };
+    d->pedido_len = opciones_pedido(d->pedido, OPCODE_RRQ, d->remoto, &op);
+}
+
+static void procesar_oack(Descarga *d, const uint8_t *buf, ssize_t n) {
+    Acuerdo a = { .blksize = d->blksize, .ventana = d->ventana, .tsize = d->tsize, .rollover = -1 };
+    opciones_oack(buf, n, &a);
+    d->blksize = a.blksize;
+    d->ventana = a.ventana;
+    d->tsize = a.tsize;
+    if (a.rollover >= 0) {
+        d->rollover = a.rollover;
+        d->rollover_acordado = 1;
+    }
+    opciones_buffer(d->sock, d->blksize, d->ventana);
+}
+
+/* Cierra la descarga: renombra el archivo si se completó y si no lo borra */
+static void terminar(Descarga *d, const char *error) {
+    timer_quitar(d);
+    close(d->sock);
+    d->sock = -1;
+    if (d->fd >= 0 && close(d->fd) < 0 && !error)
+        error = strerror(errno);
+    d->fd = -1;
+    if (!error && rename(d->parte, d->local) < 0)
+        error = strerror(errno);
+
+    double ms = (monotonic_ns() - d->inicio_ns) / 1e6;
+    if (error) {
+        unlink(d->parte);
+        fallidas++;
+        fprintf(stderr, "Falló %s: %s\n", d->remoto, error);
+        return;
+    }
+    completas++;
+    bytes_totales += d->recibidos;
+    printf("%s -> %s (%lld bytes, %.1f ms)\n", d->remoto, d->local, d->recibidos, ms);
+}
+
+/* Procesa un paquete del servidor. Devuelve 1 si la descarga terminó. */
+static int recibir(Descarga *d, uint8_t *buf, ssize_t n, char *motivo, size_t motivo_len) {
+    if (n < 4)
+        return 0;
+    uint16_t opcode = ntohs(*(uint16_t *)(buf + 0));
+    uint16_t block = ntohs(*(uint16_t *)(buf + 2));
+
+    if (opcode == OPCODE_ERROR) {
+        buf[n - 1] = '\0';
+        snprintf(motivo, motivo_len, "TFTP Error %d: %s", block, (char *)(buf + 4));
+        return 1;
+    }
+    if (!d->respondio) {
+        d->respondio = 1;
+        if (d->midiendo)
+            medir_rtt(d); /* RRQ -> primera respuesta */
+    }
+    d->reintentos = 0;
+
+    if (opcode == OPCODE_OACK && d->esperado == 1) {
+        procesar_oack(d, buf, n);
+        if (d->tsize > 0 && fallocate(d->fd, FALLOC_FL_KEEP_SIZE, 0, d->tsize) < 0 &&
+            (errno == ENOSPC || errno == EFBIG)) {
+            enviar_error(d, TFTP_ERR_DISKFULL, "Disk full or allocation exceeded");
+            snprintf(motivo, motivo_len, "sin espacio para %lld bytes", d->tsize);
+            return 1;
+        }
+        cronometrar(d);
+        enviar_ack(d->sock, &d->servidor, 0);
+        rearmar(d);
+        return 0;
+    }
+    if (opcode != OPCODE_DATA) {
+        snprintf(motivo, motivo_len, "paquete inesperado (opcode=%d)", opcode);
+        return 1;
+    }
+
+    /* Sin la opción, el servidor elige el rollover: se ve en la primera vuelta */
+    if (!d->rollover_acordado && d->esperado == UINT16_MAX + 1 && block == !d->rollover)
+        d->rollover = block;
+    if (block != en_cable(d, d->esperado)) {
+        /* Hueco: confirmar el último en orden, una vez por ráfaga */
+        int lejos = distancia(d, block, d->esperado);
+        if (!d->hueco || lejos <= d->fuera) {
+            d->hueco = 1;
+            d->en_ventana = 0;
+            d->midiendo = 0;
+            enviar_ack(d->sock, &d->servidor, en_cable(d, d->esperado - 1));
+        }
+        d->fuera = lejos;
+        return 0;
+    }
+    d->hueco = 0;
+    if (d->midiendo)
+        medir_rtt(d); /* primer DATA después del ACK cronometrado */
+
+    size_t data_len = n - 4;
+    if (write(d->fd, buf + 4, data_len) != (ssize_t)data_len) {
+        enviar_error(d, TFTP_ERR_DISKFULL, "Disk full or allocation exceeded");
+        snprintf(motivo, motivo_len, "write: %s", strerror(errno));
+        return 1;
+    }
+    d->recibidos += data_len;
+
+    int ultimo = data_len < (size_t)d->blksize;
+    if (ultimo || ++d->en_ventana >= d->ventana) {
+        d->en_ventana = 0;
+        enviar_ack(d->sock, &d->servidor, block);
+        cronometrar(d);
+    }
+    if (ultimo)
+        return 1;
+    d->esperado++;
+    rearmar(d);
+    return 0;
+}
+
+/* Lee todo lo que hay en el socket de la descarga */
+static void drenar(Descarga *d, uint8_t *buf) {
+    char motivo[128];
+    while (d->sock >= 0) {
+        struct sockaddr_in origen;
+        socklen_t origen_len = sizeof(origen);
+        ssize_t n = recvfrom(d->sock, buf, MAX_PACKET_SIZE, 0, (struct sockaddr *)&origen, &origen_len);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR || errno == ECONNREFUSED)
+                return;
+            terminar(d, strerror(errno));
+            return;
+        }
+        /*
+         * La primera respuesta fija el TID, pero solo si viene del servidor al
+         * que se pidió; lo que venga de otra dirección o de otro puerto no es
+         * de esta descarga.
+         */
+        if (!d->respondio) {
+            if (origen.sin_addr.s_addr != principal.sin_addr.s_addr)
+                continue;
+            d->servidor = origen;
+        } else if (origen.sin_addr.s_addr != d->servidor.sin_addr.s_addr || origen.sin_port != d->servidor.sin_port)
+            continue;
+
+        motivo[0] = '\0';
+        if (recibir(d, buf, n, motivo, sizeof(motivo)))
+            terminar(d, motivo[0] ? motivo : NULL);
+    }
+}
+
+/* Venció el RTO: repetir el pedido o confirmar lo recibido, con backoff */
+static void vencer(Descarga *d) {
+    if (++d->reintentos > MAX_REINTENTOS) {
+        terminar(d, d->respondio ? "sin respuesta del servidor" : "el servidor no atendió el pedido");
+        return;
+    }
+    d->rto_ns = d->rto_ns * 2 < (uint64_t)RTO_MAX_MS * 1000000 ? d->rto_ns * 2 : (uint64_t)RTO_MAX_MS * 1000000;
+    d->midiendo = 0; /* Karn: lo retransmitido no sirve para medir */
+    if (!d->respondio) {
+        sendto(d->sock, d->pedido, d->pedido_len, 0, (struct sockaddr *)&d->servidor, sizeof(d->servidor));
+    } else {
+        d->en_ventana = 0;
+        enviar_ack(d->sock, &d->servidor, en_cable(d, d->esperado - 1));
+    }
+    rearmar(d);
+}
+
+/* Abre el archivo y el socket de la descarga y manda el RRQ */
+static void empezar(Descarga *d) {
+    d->sock = -1;
+    d->fd = -1;
+    d->pos_timer = -1;
+    d->blksize = BLOCK_SIZE;
+    d->ventana = 1;
+    d->tsize = -1;
+    d->esperado = 1;
+    d->rto_ns = (uint64_t)RTO_INICIAL_MS * 1000000;
+    d->servidor = principal;
+    d->inicio_ns = monotonic_ns();
+
+    snprintf(d->parte, sizeof(d->parte), "%s.parte", d->local);
+    d->fd = open(d->parte, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (d->fd < 0) {
+        fallidas++;
+        fprintf(stderr, "Falló %s: %s: %s\n", d->remoto, d->parte, strerror(errno));
+        return;
+    }
+    d->sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = d };
+    if (d->sock < 0 || epoll_ctl(ep, EPOLL_CTL_ADD, d->sock, &ev) < 0) {
+        terminar(d, strerror(errno));
+        return;
+    }
+    elegir_puerto(d->sock);
+    armar_pedido(d);
+    cronometrar(d);
+    if (sendto(d->sock, d->pedido, d->pedido_len, 0, (struct sockaddr *)&d->servidor, sizeof(d->servidor)) < 0) {
+        terminar(d, strerror(errno));
+        return;
+    }
+    rearmar(d);
+}
+
+/* Agrega una línea del manifiesto: "remoto [local]" */
+static int agregar(char *linea, int *capacidad) {
+    char *remoto = strtok(linea, " \t\r\n");
+    if (!remoto || remoto[0] == '#')
+        return 0;
+    char *local = strtok(NULL, " \t\r\n");
+    if (strlen(remoto) > 255) {
+        fprintf(stderr, "Nombre demasiado largo: %s\n", remoto);
+        return -1;
+    }
+    if (!local) {
+        local = strrchr(remoto, '/');
+        local = local ? local + 1 : remoto;
+    }
+
+    if (n_descargas == *capacidad) {
+        *capacidad = *capacidad ? 2 * *capacidad : 64;
+        Descarga *nuevo = realloc(descargas, *capacidad * sizeof(Descarga));
+        if (!nuevo)
+            return -1;
+        descargas = nuevo;
+    }
+    Descarga *d = &descargas[n_descargas];
+    memset(d, 0, sizeof(*d));
+    d->remoto = strdup(remoto);
+    if (directorio && local[0] != '/') {
+        if (asprintf(&d->local, "%s/%s", directorio, local) < 0)
+            d->local = NULL;
+    } else {
+        d->local = strdup(local);
+    }
+    if (!d->remoto || !d->local)
+        return -1;
+    n_descargas++;
+    return 0;
+}
+
+static void leer_manifiesto(const char *ruta) {
+    FILE *f = strcmp(ruta, "-") == 0 ? stdin : fopen(ruta, "r");
+    if (!f) {
+        perror(ruta);
+        exit(EXIT_FAILURE);
+    }
+    char *linea = NULL;
+    size_t largo = 0;
+    int capacidad = 0;
+    while (getline(&linea, &largo, f) >= 0) {
+        if (agregar(linea, &capacidad) < 0) {
+            fprintf(stderr, "Manifiesto inválido\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(linea);
+    if (f != stdin)
+        fclose(f);
+}
+
+void usage(const char *progname) {
+    fprintf(stderr,
+        "Uso: %s [-c concurrentes] [-b blksize] [-W ventana] [-d directorio] <IP-servidor> <puerto> <manifiesto>\n"
+        "  -c: descargas simultáneas (por defecto 16)\n"
+        "  -d: directorio donde se guardan los archivos\n"
+        "  manifiesto: una línea por archivo, \"remoto [local]\" (\"-\" = entrada estándar)\n",
+        progname);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+
+    while ((c = getopt(argc, argv, "c:b:W:d:")) != -1) {
+        switch (c) {
+        case 'c':
+            concurrentes = atoi(optarg);
+            if (concurrentes < 1 || concurrentes > MAX_CONCURRENTES)
+                usage(argv[0]);
+            break;
+        case 'b':
+            blksize_pedido = atoi(optarg);
+            if (blksize_pedido < 8 || blksize_pedido > MAX_BLKSIZE)
+                usage(argv[0]);
+            break;
+        case 'W':
+            ventana_pedida = atoi(optarg);
+            if (ventana_pedida < 1 || ventana_pedida > MAX_VENTANA)
+                usage(argv[0]);
+            break;
+        case 'd':
+            directorio = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 3)
+        usage(argv[0]);
+
+    memset(&principal, 0, sizeof(principal));
+    principal.sin_family = AF_INET;
+    principal.sin_port = htons(atoi(argv[optind + 1]));
+    if (inet_aton(argv[optind], &principal.sin_addr) == 0) {
+        fprintf(stderr, "IP inválida: %s\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    leer_manifiesto(argv[optind + 2]);
+    leer_rango_efimero();
+
+    ep = epoll_create1(EPOLL_CLOEXEC);
+    timers = malloc(concurrentes * sizeof(Descarga *));
+    uint8_t *buf = malloc(MAX_PACKET_SIZE);
+    if (ep < 0 || !timers || !buf) {
+        perror("epoll_create1/malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t inicio = monotonic_ns();
+    int proxima = 0;
+    struct epoll_event eventos[MAX_EVENTOS];
+    while (1) {
+        /* Las descargas en curso tienen siempre su temporizador: n_timers es cuántas hay */
+        while (proxima < n_descargas && n_timers < concurrentes)
+            empezar(&descargas[proxima++]);
+        if (n_timers == 0)
+            break;
+
+        uint64_t ahora = monotonic_ns();
+        int espera = timers[0]->vence_ns > ahora ? (int)((timers[0]->vence_ns - ahora + 999999) / 1000000) : 0;
+        int n = epoll_wait(ep, eventos, MAX_EVENTOS, espera);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < n; i++) {
+            Descarga *d = eventos[i].data.ptr;
+            if (d->sock >= 0)
+                drenar(d, buf);
+        }
+
+        ahora = monotonic_ns();
+        while (n_timers > 0 && timers[0]->vence_ns <= ahora)
+            vencer(timers[0]);
+    }
+
+    double segundos = (monotonic_ns() - inicio) / 1e9;
+    printf("%d archivos bajados, %d fallidos: %lld bytes en %.3f s (%.1f MB/s)\n",
+           completas, fallidas, bytes_totales, segundos, segundos > 0 ? bytes_totales / segundos / 1e6 : 0);
+
+    for (int i = 0; i < n_descargas; i++) {
+        free(descargas[i].remoto);
+        free(descargas[i].local);
+    }
+    free(descargas);
+    free(timers);
+    free(buf);
+    close(ep);
+    return fallidas ? EXIT_FAILURE : 0;
+}
@@ -12,8 +12,12 @@
     sleep 1
 ) | tftp 127.0.0.1 28002 &
 
+Para carga de verdad (cientos de sesiones, con tiempos y percentiles), ver
+bin/tftp-bench en el README.
 */
 
+#include <errno.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -21,54 +25,187 @@
 #include <unistd.h>
 #include <signal.h>            
 #include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <sys/wait.h>
 
-struct tftp_data {
-    uint16_t opcode;  // 3 = DATA
-    uint16_t block;   // número de bloque
-    char     data[512];
-};
+#include "tftp-sesion.h"
+#include "tftp-cache.h"
+#include "tftp-multicast.h"
+#include "tftp-metricas.h"
+#include "registro.h"
+
+/*
+ * Motores de atención:
+ *   fork  - un proceso hijo por pedido, que atiende su sesión bloqueando.
+ *   epoll - un proceso (o uno por núcleo con -n) multiplexa todas las
+ *           sesiones sobre sockets no bloqueantes y una tabla de sesiones.
+ *   pool  - hilos trabajadores creados al arrancar; el hilo principal les
+ *           pasa cada pedido por una cola y cada uno atiende su sesión
+ *           bloqueando, con un socket ya creado que reutiliza.
+ */
+#define MODO_FORK  0
+#define MODO_EPOLL 1
+#define MODO_POOL  2
+
+#ifndef MAX_SESIONES
+#define MAX_SESIONES 4096     // sesiones simultáneas por proceso en modo epoll
+#endif
+#define MAX_EVENTOS  256
+#define POOL_DEFECTO 32       // trabajadores del modo pool si no se indica -n
+#define MAX_COLA     1024     // pedidos esperando un trabajador libre
+#define TABLA_SIZE   16384    // potencia de 2, al menos el doble de MAX_SESIONES
+#define GRACIA_MS    3000     // tras terminar una sesión, sus pedidos repetidos se ignoran
+
+/*
+ * Pedidos por cliente, identificados por IP y puerto de origen (su TID) y
+ * una huella de los bytes del pedido. El mismo RRQ/WRQ de un cliente con una
+ * sesión en curso, o que terminó hace menos de GRACIA_MS, es una
+ * retransmisión: se descarta en lugar de abrir otra transferencia en
+ * paralelo. Un pedido distinto desde el mismo puerto (un cargador PXE que
+ * pregunta el tamaño, corta con ERROR 8 y vuelve a pedir) es una sesión
+ * nueva. Hash con direccionamiento abierto; los vencimientos de gracia se
+ * encolan en orden en 'gracia'.
+ */
+typedef struct Activa {
+    uint32_t ip;
+    uint16_t puerto;
+    uint8_t ocupada;
+    pid_t pid;                // modo fork: hijo que atiende la sesión
+    uint64_t huella;          // huella_pedido() del RRQ/WRQ
+    uint64_t expira_ns;       // 0 mientras la sesión sigue; luego, fin de la gracia
+} Activa;
+
+static Activa tabla[TABLA_SIZE];
+static int n_activas = 0;
+static struct { uint32_t ip; uint16_t puerto; uint64_t huella, expira_ns; } gracia[TABLA_SIZE];
+static int gracia_inicio = 0, gracia_len = 0;
+
+// FNV-1a de 64 bits del datagrama: dos pedidos iguales dan la misma huella
+static uint64_t huella_pedido(const char *pedido, int len) {
+    uint64_t h = 14695981039346656037ull;
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)pedido[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
 
-struct tftp_ack {
-    uint16_t opcode;  // 4 = ACK
-    uint16_t block;
-};
+static unsigned tabla_hash(uint32_t ip, uint16_t puerto, uint64_t huella) {
+    return ((ip * 2654435761u) ^ (puerto * 40503u) ^ (uint32_t)(huella ^ huella >> 32)) & (TABLA_SIZE - 1);
+}
 
-void tftp_rrq(char buffer[], int sockfd, struct sockaddr_in client_addr, socklen_t addr_len, int bytes_recv);
-void tftp_wrq(char buffer[], int sockfd, struct sockaddr_in client_addr, socklen_t addr_len);
-void send_ack(int sockfd, struct sockaddr_in *client_addr, socklen_t addr_len, uint16_t block);
+static Activa *tabla_buscar(uint32_t ip, uint16_t puerto, uint64_t huella) {
+    for (unsigned i = tabla_hash(ip, puerto, huella); tabla[i].ocupada; i = (i + 1) & (TABLA_SIZE - 1))
+        if (tabla[i].ip == ip && tabla[i].puerto == puerto && tabla[i].huella == huella)
+            return &tabla[i];
+    return NULL;
+}
 
-void sigchld_handler(int signo) {
-    while (waitpid(-1, NULL, WNOHANG) > 0);
+// Borrado con corrimiento hacia atrás: no deja lápidas en las cadenas
+static void tabla_borrar(Activa *a) {
+    unsigned i = a - tabla, j = i;
+    tabla[i].ocupada = 0;
+    n_activas--;
+    while (1) {
+        j = (j + 1) & (TABLA_SIZE - 1);
+        if (!tabla[j].ocupada)
+            return;
+        unsigned k = tabla_hash(tabla[j].ip, tabla[j].puerto, tabla[j].huella);
+        // Si j no puede quedar en su lugar sin pasar por el hueco i, se mueve
+        if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+            tabla[i] = tabla[j];
+            tabla[j].ocupada = 0;
+            i = j;
+        }
+    }
 }
 
-#define MAX_BUFFER  516
+/*
+ * Registra un pedido nuevo con su huella. Devuelve NULL si es una
+ * retransmisión de una sesión en curso o reciente (o si la tabla está llena).
+ */
+static Activa *tabla_registrar(const struct sockaddr_in *cliente, uint64_t huella, uint64_t ahora) {
+    uint32_t ip = cliente->sin_addr.s_addr;
+    uint16_t puerto = cliente->sin_port;
+    Activa *a = tabla_buscar(ip, puerto, huella);
+    if (a) {
+        if (a->expira_ns == 0 || a->expira_ns > ahora)
+            return NULL;
+        tabla_borrar(a); // la gracia ya pasó: es un pedido nuevo
+    }
+    if (n_activas >= TABLA_SIZE * 3 / 4)
+        return NULL;
+
+    unsigned i = tabla_hash(ip, puerto, huella);
+    while (tabla[i].ocupada)
+        i = (i + 1) & (TABLA_SIZE - 1);
+    tabla[i] = (Activa){ .ip = ip, .puerto = puerto, .ocupada = 1, .huella = huella };
+    n_activas++;
+    return &tabla[i];
+}
 
-// Lleva la cuenta de qué puerto usará el siguiente proceso hijo.
-// Empieza en PORT_BASE+1 y va subiendo.
+// La sesión terminó: su entrada queda GRACIA_MS para absorber pedidos atrasados
+static void tabla_terminar(Activa *a, uint64_t ahora) {
+    if (gracia_len == TABLA_SIZE) {
+        tabla_borrar(a);
+        return;
+    }
+    a->expira_ns = ahora + (uint64_t)GRACIA_MS * 1000000;
+    int pos = (gracia_inicio + gracia_len++) % TABLA_SIZE;
+    gracia[pos].ip = a->ip;
+    gracia[pos].puerto = a->puerto;
+    gracia[pos].huella = a->huella;
+    gracia[pos].expira_ns = a->expira_ns;
+}
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) 
-    {
-      printf("Uso: %s [PUERTO]\n", argv[0]);
-      exit(EXIT_FAILURE);
+static void tabla_purgar(uint64_t ahora) {
+    while (gracia_len > 0 && gracia[gracia_inicio].expira_ns <= ahora) {
+        Activa *a = tabla_buscar(gracia[gracia_inicio].ip, gracia[gracia_inicio].puerto,
+                                 gracia[gracia_inicio].huella);
+        if (a && a->expira_ns == gracia[gracia_inicio].expira_ns)
+            tabla_borrar(a);
+        gracia_inicio = (gracia_inicio + 1) % TABLA_SIZE;
+        gracia_len--;
     }
+}
 
-    const int PORT_BASE = atoi(argv[1]);
-    uint16_t next_port = PORT_BASE + 1;
-    int server_fd, opt = 1;
-    struct sockaddr_in server_addr, client_addr;
-    char buffer[MAX_BUFFER];
-    socklen_t addr_len = sizeof(client_addr);
+// Sin SA_RESTART: el recvfrom() del padre vuelve con EINTR y recoge a los hijos
+static volatile sig_atomic_t hijos_terminados = 0;
 
-    // Manejar hijos zombie
-    signal(SIGCHLD, sigchld_handler);
+void sigchld_handler(int signo) {
+    hijos_terminados = 1;
+}
+
+static void uso(const char *prog) {
+    printf("Uso: %s [-m fork|epoll|pool] [-n cantidad] [-M mtu] [-g] [-c MB] [-G red] [-S fsync] [-R 0|1] [-E socket] [PUERTO]\n"
+           "  -m  motor de atención (por defecto fork)\n"
+           "  -n  procesos del motor epoll (por defecto 1) o hilos del pool\n"
+           "      (por defecto %d); 0 = uno por núcleo\n"
+           "  -M  MTU del camino: limita el blksize negociado para no fragmentar\n"
+           "  -g  ventanas con offload de UDP (GSO al enviar, GRO al recibir)\n"
+           "  -c  MB de la caché de archivos calientes (por defecto %u; 0 = sin caché)\n"
+           "  -G  acepta la opción multicast (RFC 2090, solo epoll) con grupos en\n"
+           "      la red /16 indicada, por ejemplo 239.255.0.0\n"
+           "  -S  fsync de los WRQ: nunca, final (por defecto) o lote\n"
+           "  -R  número de bloque después del 65535 si el cliente no lo negocia\n"
+           "      (por defecto 0)\n"
+           "  -E  socket UNIX donde se leen las métricas (sesiones, retransmisiones,\n"
+           "      RTT, errores) de todos los procesos\n",
+           prog, POOL_DEFECTO, CACHE_DEFECTO >> 20);
+    exit(EXIT_FAILURE);
+}
+
+// Socket UDP del puerto principal, compartible entre procesos con SO_REUSEPORT
+static int crear_socket_principal(int puerto) {
+    int server_fd, opt = 1;
+    struct sockaddr_in server_addr;
 
     // Crear socket UDP principal
     if ((server_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-        perror("socket");
+        reg_errno("socket");
         exit(EXIT_FAILURE);
     }
 
@@ -81,282 +218,549 @@ int main(int argc, char *argv[]) {
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    server_addr.sin_port = htons(PORT_BASE);
+    server_addr.sin_port = htons(puerto);
 
     if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("bind");
+        reg_errno("bind");
         exit(EXIT_FAILURE);
     }
+    return server_fd;
+}
+
+static void recoger_hijos(void) {
+    pid_t pid;
+    uint64_t ahora = monotonic_ns();
+
+    hijos_terminados = 0;
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        for (int i = 0; i < TABLA_SIZE; i++) {
+            if (tabla[i].ocupada && tabla[i].expira_ns == 0 && tabla[i].pid == pid) {
+                tabla_terminar(&tabla[i], ahora);
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * Si el pedido es un RRQ, toma el archivo de la caché (cargándolo si hace
+ * falta). Así los hijos comparten el mapeo del padre y los aciertos y fallos
+ * se cuentan en un solo lugar.
+ */
+static Cacheado *precargar(const char *pedido, int len) {
+    if (len < 4 || ntohs(*(uint16_t *)pedido) != OPCODE_RRQ)
+        return NULL;
+    const char *nombre = pedido + 2;
+    if (!memchr(nombre, '\0', len - 2))
+        return NULL;
+    return cache_tomar(nombre);
+}
+
+static void motor_fork(int server_fd) {
+    struct sockaddr_in client_addr;
+    char buffer[MAX_BUFFER];
+    socklen_t addr_len = sizeof(client_addr);
+
+    // Manejar hijos zombie
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchld_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
 
-    printf("Servidor TFTP escuchando en puerto %d\n", PORT_BASE);
+    // Despertar de vez en cuando para vencer los períodos de gracia
+    struct timeval tv = {1, 0};
+    setsockopt(server_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
     while (1) {
+        if (hijos_terminados)
+            recoger_hijos();
+        tabla_purgar(monotonic_ns());
+
         int bytes_recv = recvfrom(server_fd, buffer, sizeof(buffer), 0,
                                  (struct sockaddr *)&client_addr, &addr_len);
         if (bytes_recv < 0) {
-            perror("recvfrom");
+            if (errno != EINTR && errno != EAGAIN)
+                reg_errno("recvfrom");
             continue;
         }
 
-        // Solo RRQ (1) o WRQ (2)
-        uint16_t opcode = ntohs(*(uint16_t *)buffer);
-
-         int child_port = 0;
-        // El padre reserva el puerto antes de forkear
-        child_port = next_port++;
+        Activa *a = tabla_registrar(&client_addr, huella_pedido(buffer, bytes_recv), monotonic_ns());
+        if (!a)
+            continue; // retransmisión de un pedido que ya se está atendiendo
 
+        // El padre carga el archivo en la caché para que el hijo herede el mapeo
+        Cacheado *c = precargar(buffer, bytes_recv);
 
         pid_t pid = fork();
+        if (c)
+            cache_soltar(c); // en el padre; el hijo toma su propia referencia
         if (pid < 0) {
-            perror("fork");
+            reg_errno("fork");
+            tabla_borrar(a);
             continue;
         }
         if (pid == 0) {  // Proceso hijo
-    close(server_fd);
+            close(server_fd);
 
-    int child_sock, bind_ok = 0, retries = 0;
-    do {
-        child_sock = socket(AF_INET, SOCK_DGRAM, 0);
-        if (child_sock < 0) {
-            perror("socket hijo");
-            exit(EXIT_FAILURE);
-        }
-
-        setsockopt(child_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-        #ifdef SO_REUSEPORT
-        setsockopt(child_sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
-        #endif
-
-        struct sockaddr_in child_addr;
-        memset(&child_addr, 0, sizeof(child_addr));
-        child_addr.sin_family = AF_INET;
-        child_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-        child_addr.sin_port = htons(child_port);   // <-- Usá el valor que heredó del padre
-
-        if (bind(child_sock, (struct sockaddr *)&child_addr, sizeof(child_addr)) == 0) {
-            bind_ok = 1;
-        } else {
-            close(child_sock);
-            if (retries++ > 100) {
-                fprintf(stderr, "No se pudo bindear un puerto para el hijo\n");
+            // El kernel elige un puerto efímero libre para la sesión
+            int child_sock = crear_socket_sesion(0);
+            if (child_sock < 0)
                 exit(EXIT_FAILURE);
-            }
-        }
-    } while (!bind_ok);
-
-    printf("Hijo atendiendo cliente en puerto %d (PID %d)\n", child_port, getpid());
 
-    // El hijo atiende SOLO a este cliente
-    if (opcode == 1) {
-        tftp_rrq(buffer, child_sock, client_addr, addr_len, bytes_recv);
-    } else if (opcode == 2) {
-        tftp_wrq(buffer, child_sock, client_addr, addr_len);
-    } else {
-        printf("Opcode desconocido: %u\n", opcode);
-    }
-
-    close(child_sock);
-    exit(0);
+            // El hijo atiende SOLO a este cliente
+            Sesion sesion;
+            if (sesion_iniciar(&sesion, child_sock, buffer, bytes_recv, &client_addr) == SESION_SIGUE)
+                sesion_atender(&sesion);
+            sesion_cerrar(&sesion);
+            exit(0);
+        }
         // El padre sigue escuchando
+        a->pid = pid;
     }
 }
-    // Nunca llega aquí
-    close(server_fd);
-    return 0;
+
+/*
+ * Temporizadores del motor epoll: heap binario de sesiones ordenado por
+ * vence_ns. Cada sesión guarda su posición (pos_timer) para poder
+ * reubicarla en O(log n) cuando cambia su vencimiento.
+ */
+static Sesion *timers[MAX_SESIONES];
+static int n_timers = 0;
+
+static void timer_colocar(int pos, Sesion *s) {
+    timers[pos] = s;
+    s->pos_timer = pos;
 }
 
+static void timer_subir(int pos) {
+    Sesion *s = timers[pos];
+    while (pos > 0) {
+        int padre = (pos - 1) / 2;
+        if (timers[padre]->vence_ns <= s->vence_ns)
+            break;
+        timer_colocar(pos, timers[padre]);
+        pos = padre;
+    }
+    timer_colocar(pos, s);
+}
 
-//Read Request
-void tftp_rrq(char buffer[], int sockfd, struct sockaddr_in client_addr, socklen_t addr_len, int bytes_recv)
-{
-    char *filename = &buffer[2];
-    char *mode = filename + strlen(filename) + 1;
-    printf("Received RRQ for file: %s, mode: %s\n", filename, mode);
+static void timer_bajar(int pos) {
+    Sesion *s = timers[pos];
+    while (1) {
+        int hijo = 2 * pos + 1;
+        if (hijo >= n_timers)
+            break;
+        if (hijo + 1 < n_timers && timers[hijo + 1]->vence_ns < timers[hijo]->vence_ns)
+            hijo++;
+        if (s->vence_ns <= timers[hijo]->vence_ns)
+            break;
+        timer_colocar(pos, timers[hijo]);
+        pos = hijo;
+    }
+    timer_colocar(pos, s);
+}
 
-  /*   FILE *file = fopen(filename, "rb");
-    if (!file)
-    {
-        perror("fopen");
-        close(sockfd);
-        exit(EXIT_FAILURE);
-    } */
-   //---
-    FILE *file = fopen(filename, "rb");
-            if (file == NULL) {
-        /* fopen falló → construyo y envío paquete ERROR(1) en este mismo bloque */
-        uint8_t err_buf[4 + 16 + 1];
-        uint16_t op_net = htons(5);   /* opcode = 5 (ERROR) */
-        memcpy(err_buf + 0, &op_net, 2);
-
-        uint16_t code_net = htons(1); /* código = 1 (File not found) */
-        memcpy(err_buf + 2, &code_net, 2);
-
-        /* Mensaje ASCII corto: “File not found” */
-        const char *msg = "File not found";
-        memcpy(err_buf + 4, msg, strlen(msg));
-        /* err_buf[4 + strlen(msg)] ya está a '\0' */
-        
-        /* Enviar por UDP de inmediato */
-        sendto(sockfd, err_buf, 4 + strlen(msg) + 1, 0,
-            (struct sockaddr *)&client_addr, addr_len);
-
-        close(sockfd);
+// Reubica la sesión en el heap después de que cambió su vencimiento
+static void timer_actualizar(Sesion *s) {
+    if (s->pos_timer < 0) {
+        timer_colocar(n_timers++, s);
+        timer_subir(s->pos_timer);
         return;
     }
-//--
-
-    uint16_t block = 1;
+    timer_subir(s->pos_timer);
+    timer_bajar(s->pos_timer);
+}
 
-    while (1)
-    {
-        struct tftp_data packet;
-        memset(&packet, 0, sizeof(packet));
-        packet.opcode = htons(3); // Opcode for DATA
-        packet.block = htons(block);
+static void timer_quitar(Sesion *s) {
+    int pos = s->pos_timer;
+    if (pos < 0)
+        return;
+    s->pos_timer = -1;
+    Sesion *ultimo = timers[--n_timers];
+    if (pos == n_timers)
+        return;
+    timer_colocar(pos, ultimo);
+    timer_subir(pos);
+    timer_bajar(ultimo->pos_timer);
+}
 
-        int bytes_read = fread(packet.data, 1, sizeof(packet.data), file);
-        int packet_size = bytes_read + 4; // 2 bytes for opcode and 2 bytes for block
+static Sesion sesiones[MAX_SESIONES];
+static Sesion *libres[MAX_SESIONES];
+static int n_libres = 0;
+
+static void terminar_sesion(int ep, Sesion *s) {
+    // Un grupo multicast no ocupa la tabla: sus clientes se dieron de baja al sumarse
+    Activa *a = s->grupo ? NULL : tabla_buscar(s->cliente.sin_addr.s_addr, s->cliente.sin_port, s->huella);
+    if (a)
+        tabla_terminar(a, monotonic_ns());
+    timer_quitar(s);
+    epoll_ctl(ep, EPOLL_CTL_DEL, s->sock, NULL);
+    sesion_cerrar(s);
+    libres[n_libres++] = s;
+}
 
-        if (sendto(sockfd, &packet, packet_size, 0, (struct sockaddr *)&client_addr, addr_len) < 0)
-        {
-            perror("sendto");
-            break;
-        }
+// Atiende todos los pedidos encolados en el puerto principal
+static void aceptar_pedidos(int ep, int server_fd) {
+    char buffer[MAX_BUFFER];
+    struct sockaddr_in client_addr;
+    socklen_t addr_len = sizeof(client_addr);
 
-        //espera el ACK del cliente...
-        bytes_recv = recvfrom(sockfd, buffer, MAX_BUFFER, 0, (struct sockaddr *)&client_addr, &addr_len);
-        if (bytes_recv < 0)
-        {
-            perror("recvfrom ACK");
-            break;
+    while (1) {
+        int bytes_recv = recvfrom(server_fd, buffer, sizeof(buffer), MSG_DONTWAIT,
+                                  (struct sockaddr *)&client_addr, &addr_len);
+        if (bytes_recv < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                reg_errno("recvfrom");
+            return;
         }
-
-        struct tftp_ack *ack = (struct tftp_ack *)buffer;
-        if (ntohs(ack->opcode) != 4 || ntohs(ack->block) != block)
-        {
-            fprintf(stderr, "Invalid ACK received\n");
-            break;
+        if (n_libres == 0) {
+            reg_aviso("Tabla de sesiones llena, pedido descartado");
+            continue;
         }
 
-        //Si se leyó menos de 512 bytes, 
-        //significa que fue el último bloque del archivo, 
-        //y se rompe el bucle.
-        if (bytes_read < sizeof(packet.data))
-            break;
+        uint64_t ahora = monotonic_ns();
+        uint64_t huella = huella_pedido(buffer, bytes_recv);
+        Activa *a = tabla_registrar(&client_addr, huella, ahora);
+        if (!a)
+            continue; // retransmisión de un pedido que ya se está atendiendo
 
-        block++;
+        int sock = crear_socket_sesion(0);
+        if (sock < 0) {
+            tabla_borrar(a);
+            continue;
+        }
+        Sesion *s = libres[--n_libres];
+        int r = sesion_iniciar(s, sock, buffer, bytes_recv, &client_addr);
+        s->huella = huella;
+        if (r != SESION_SIGUE) {
+            sesion_cerrar(s);
+            libres[n_libres++] = s;
+            tabla_terminar(a, ahora);
+            continue;
+        }
+        // El grupo sigue con otros maestros: los pedidos repetidos los filtra él
+        if (s->grupo)
+            tabla_terminar(a, ahora);
+
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = s };
+        if (epoll_ctl(ep, EPOLL_CTL_ADD, s->sock, &ev) < 0) {
+            reg_errno("epoll_ctl");
+            sesion_cerrar(s);
+            libres[n_libres++] = s;
+            tabla_borrar(a);
+            continue;
+        }
+        timer_actualizar(s);
     }
+}
 
-    fclose(file);
-    printf("Archivo enviado exitosamente.\n");
+// Marca del eventfd del hilo escritor en epoll (el socket principal es NULL)
+static int marca_escritor;
+
+// Continúa los WRQ cuyas tandas terminó de escribir el hilo escritor
+static void atender_escritas(int ep) {
+    Sesion *s;
+    while ((s = sesion_escrita_siguiente()) != NULL) {
+        if (sesion_escrita(s) == SESION_FIN)
+            terminar_sesion(ep, s);
+        else
+            timer_actualizar(s);
+    }
 }
 
-void tftp_wrq(char buffer[], int sockfd, struct sockaddr_in client_addr, socklen_t addr_len)
-{
-    // 1. Extraer nombre de archivo y modo (netascii, octet, etc.)
-    char *filename = &buffer[2];
-    char *mode = filename + strlen(filename) + 1;
-    printf("Received WRQ for file: %s, mode: %s\n", filename, mode);
-
-    /* 1) Verificar si el archivo YA existe */
-      if (access(filename, F_OK) == 0)
-    {
-        /* Construir y enviar paquete ERROR(6, "File already exists") en línea */
-        uint8_t err_buf[4 + 20 + 1] = { 0 };
-        uint16_t op_net   = htons(5);  /* opcode = 5 (ERROR) */
-        memcpy(err_buf + 0, &op_net, 2);
-        uint16_t code_net = htons(6);  /* código = 6 (File already exists) */
-        memcpy(err_buf + 2, &code_net, 2);
-        const char *msg = "File already exists";
-        size_t msg_len = strlen(msg);
-        memcpy(err_buf + 4, msg, msg_len);
-        /* err_buf[4 + msg_len] ya está a 0 por la inicialización */
-
-        sendto(sockfd,
-               err_buf,
-               4 + msg_len + 1,
-               0,
-               (struct sockaddr *)&client_addr,
-               addr_len);
-
-        close(sockfd);
+// Procesa todo lo que haya llegado al socket de la sesión
+static void atender_paquetes(int ep, Sesion *s) {
+    static unsigned char area[LOTE_BYTES]; // un solo hilo: el lote se comparte entre sesiones
+
+    if (sesion_drenar(s, area, sizeof(area)) == SESION_FIN) {
+        terminar_sesion(ep, s);
         return;
     }
+    timer_actualizar(s);
+}
 
-    // 2. Abrir (o crear) el archivo en modo binario para escritura
-    FILE *file = fopen(filename, "wb");
-    if (!file)
-    {
-        perror("fopen");
-        close(sockfd);
+static void motor_epoll(int server_fd) {
+    int ep = epoll_create1(0);
+    if (ep < 0) {
+        reg_errno("epoll_create1");
         exit(EXIT_FAILURE);
     }
 
-    // 3. Enviar ACK0 para indicar al cliente que comience a mandar datos
-    send_ack(sockfd, &client_addr, addr_len, 0);
-    //printf("ACK 0 enviadoo \b \n");
-
-
-    // 4. Inicializar el número de bloque esperado:
-    //    el primer bloque de datos que llegará será el bloque #1
-    uint16_t expected_block = 1;
-    
-    // 5. Bucle de recepción de datos hasta que se complete la transferencia
-    while (1)
-    {
-        char buffer_data[516] = {0};
-        int bytes_recv = recvfrom(sockfd, buffer_data, sizeof(buffer_data), 0, (struct sockaddr *)&client_addr, &addr_len);
-        if (bytes_recv < 0)
-        {
-            perror("recvfrom DATA");
-            break;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, server_fd, &ev) < 0) {
+        reg_errno("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+
+    // Un disco lento no debe frenar a todas las sesiones: los WRQ escriben en otro hilo
+    int escritor = sesion_escritor();
+    if (escritor >= 0) {
+        ev.data.ptr = &marca_escritor;
+        if (epoll_ctl(ep, EPOLL_CTL_ADD, escritor, &ev) < 0) {
+            reg_errno("epoll_ctl");
+            exit(EXIT_FAILURE);
         }
+    }
 
-        // 5.a) Interpretar lo recibido como un paquete TFTP DATA
-        struct tftp_data *data_packet = (struct tftp_data *)buffer_data;
+    for (int i = MAX_SESIONES - 1; i >= 0; i--) {
+        sesiones[i].pos_timer = -1;
+        libres[n_libres++] = &sesiones[i];
+    }
 
-        uint16_t opcode = ntohs(data_packet->opcode);
-        uint16_t block = ntohs(data_packet->block);
+    struct epoll_event eventos[MAX_EVENTOS];
+    while (1) {
+        int espera = -1;
+        if (n_timers > 0) {
+            uint64_t ahora = monotonic_ns();
+            uint64_t vence = timers[0]->vence_ns;
+            espera = vence > ahora ? (int)((vence - ahora + 999999) / 1000000) : 0;
+        }
 
-        if (opcode != 3)
-        {
-            fprintf(stderr, "Esperado DATA (3), recibido opcode %d\n", opcode);
-            break;
+        int n = epoll_wait(ep, eventos, MAX_EVENTOS, espera);
+        if (n < 0 && errno != EINTR) {
+            reg_errno("epoll_wait");
+            exit(EXIT_FAILURE);
         }
 
-        if (block != expected_block)
-        {
-            fprintf(stderr, "Bloque inesperado: %d, esperado: %d\b", block, expected_block);
-            send_ack(sockfd, &client_addr, addr_len, expected_block - 1);
-            continue;
+        for (int i = 0; i < n; i++) {
+            Sesion *s = eventos[i].data.ptr;
+            if (s == NULL)
+                aceptar_pedidos(ep, server_fd);
+            else if ((void *)s == &marca_escritor)
+                atender_escritas(ep);
+            else
+                atender_paquetes(ep, s);
         }
 
-        int data_size = bytes_recv - 4; // 2 bytes for opcode and 2 bytes for block
-        fwrite(data_packet->data, 1, data_size, file);
-        printf("Bloque %d recibido (%d bytes)\n", block, data_size);
+        uint64_t ahora = monotonic_ns();
+        tabla_purgar(ahora);
+        while (n_timers > 0 && timers[0]->vence_ns <= ahora) {
+            Sesion *s = timers[0];
+            if (sesion_vencida(s) == SESION_FIN)
+                terminar_sesion(ep, s);
+            else
+                timer_actualizar(s);
+        }
+    }
+}
 
-        send_ack(sockfd, &client_addr, addr_len, block);
+/*
+ * Modo pool: cola de pedidos entre el hilo que escucha en el puerto
+ * principal y los trabajadores. Un pedido ocupa un datagrama, así que la
+ * entrega cuesta un memcpy y un signal de la condición, no un fork().
+ */
+typedef struct Pedido {
+    char buffer[MAX_BUFFER];
+    int len;
+    struct sockaddr_in cliente;
+    uint64_t huella;
+} Pedido;
+
+static Pedido cola[MAX_COLA];
+static int cola_inicio = 0, cola_len = 0;
+static pthread_mutex_t cola_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cola_cond = PTHREAD_COND_INITIALIZER;
+
+static void *trabajador(void *arg) {
+    // Socket "tibio": se crea una vez y se reconecta a cada cliente
+    int sock = crear_socket_sesion(0);
+    if (sock < 0)
+        return NULL;
+
+    Pedido pedido;
+    Sesion sesion;
+    while (1) {
+        pthread_mutex_lock(&cola_mutex);
+        while (cola_len == 0)
+            pthread_cond_wait(&cola_cond, &cola_mutex);
+        pedido = cola[cola_inicio];
+        cola_inicio = (cola_inicio + 1) % MAX_COLA;
+        cola_len--;
+        pthread_mutex_unlock(&cola_mutex);
+
+        if (sesion_iniciar(&sesion, sock, pedido.buffer, pedido.len, &pedido.cliente) == SESION_SIGUE)
+            sesion_atender(&sesion);
+        sesion.sock = -1; // el socket queda para la próxima sesión
+        sesion_cerrar(&sesion);
+
+        // La tabla de sesiones se comparte con el hilo principal bajo cola_mutex
+        pthread_mutex_lock(&cola_mutex);
+        Activa *a = tabla_buscar(pedido.cliente.sin_addr.s_addr, pedido.cliente.sin_port, pedido.huella);
+        if (a)
+            tabla_terminar(a, monotonic_ns());
+        pthread_mutex_unlock(&cola_mutex);
+
+        // Deshacer el connect() para que el próximo cliente pueda conectarse
+        struct sockaddr sin_destino = { .sa_family = AF_UNSPEC };
+        connect(sock, &sin_destino, sizeof(sin_destino));
+    }
+    return NULL;
+}
 
-        if (data_size < sizeof(data_packet->data))
-            break;
+static void motor_pool(int server_fd, long hilos) {
+    // Despertar de vez en cuando para vencer los períodos de gracia
+    struct timeval tv = {1, 0};
+    setsockopt(server_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
-        expected_block++;
+    for (long i = 0; i < hilos; i++) {
+        pthread_t hilo;
+        if (pthread_create(&hilo, NULL, trabajador, NULL) != 0) {
+            reg_errno("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(hilo);
+    }
+
+    while (1) {
+        pthread_mutex_lock(&cola_mutex);
+        int lleno = cola_len == MAX_COLA;
+        tabla_purgar(monotonic_ns());
+        pthread_mutex_unlock(&cola_mutex);
+
+        Pedido pedido;
+        socklen_t addr_len = sizeof(pedido.cliente);
+        pedido.len = recvfrom(server_fd, pedido.buffer, sizeof(pedido.buffer), 0,
+                              (struct sockaddr *)&pedido.cliente, &addr_len);
+        if (pedido.len < 0) {
+            if (errno != EINTR && errno != EAGAIN)
+                reg_errno("recvfrom");
+            continue;
+        }
+        if (lleno) {
+            // El cliente retransmitirá el pedido cuando haya lugar
+            reg_aviso("Cola de pedidos llena, pedido descartado");
+            continue;
+        }
+
+        pedido.huella = huella_pedido(pedido.buffer, pedido.len);
+        pthread_mutex_lock(&cola_mutex);
+        if (cola_len < MAX_COLA && tabla_registrar(&pedido.cliente, pedido.huella, monotonic_ns())) {
+            cola[(cola_inicio + cola_len) % MAX_COLA] = pedido;
+            cola_len++;
+            pthread_cond_signal(&cola_cond);
+        }
+        pthread_mutex_unlock(&cola_mutex);
     }
-    fclose(file);
-    printf("Archivo recibido exitosamente.\n");
 }
 
-void send_ack(int sockfd, struct sockaddr_in *client_addr, socklen_t addr_len, uint16_t block)
-{
-    struct tftp_ack ack;
-    ack.opcode = htons(4); // Opcode de ACK
-    ack.block = htons(block);
-    
-
-    if (sendto(sockfd, &ack, sizeof(ack), 0, (struct sockaddr *)client_addr, addr_len) < 0)
-    {
-        perror("sendto");
-        printf("ack: %ld", sizeof(ack));
+int main(int argc, char *argv[]) {
+    int modo = MODO_FORK;
+    long procesos = -1;
+    const char *ruta_metricas = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "m:n:M:gc:G:S:R:E:")) != -1) {
+        switch (c) {
+        case 'm':
+            if (strcmp(optarg, "fork") == 0)
+                modo = MODO_FORK;
+            else if (strcmp(optarg, "epoll") == 0)
+                modo = MODO_EPOLL;
+            else if (strcmp(optarg, "pool") == 0)
+                modo = MODO_POOL;
+            else
+                uso(argv[0]);
+            break;
+        case 'n':
+            procesos = atol(optarg);
+            break;
+        case 'M':
+            // DATA = MTU - cabecera IP (20) - UDP (8) - TFTP (4)
+            blksize_max = atoi(optarg) - 32;
+            if (blksize_max < BLOCK_SIZE || blksize_max > MAX_BLKSIZE)
+                uso(argv[0]);
+            break;
+        case 'g':
+            usar_offload = 1;
+            break;
+        case 'c':
+            cache_max_bytes = (size_t)atol(optarg) << 20;
+            break;
+        case 'G':
+            if (inet_aton(optarg, &multicast_red) == 0 || !IN_MULTICAST(ntohl(multicast_red.s_addr)))
+                uso(argv[0]);
+            break;
+        case 'S':
+            if (strcmp(optarg, "nunca") == 0)
+                politica_fsync = FSYNC_NUNCA;
+            else if (strcmp(optarg, "final") == 0)
+                politica_fsync = FSYNC_FINAL;
+            else if (strcmp(optarg, "lote") == 0)
+                politica_fsync = FSYNC_LOTE;
+            else
+                uso(argv[0]);
+            break;
+        case 'R':
+            if (strcmp(optarg, "0") != 0 && strcmp(optarg, "1") != 0)
+                uso(argv[0]);
+            rollover_defecto = atoi(optarg);
+            break;
+        case 'E':
+            ruta_metricas = optarg;
+            break;
+        default:
+            uso(argv[0]);
+        }
+    }
+    if (argc - optind != 1) 
+        uso(argv[0]);
+    // Un grupo necesita ver todos los pedidos de su archivo en un mismo proceso
+    if (multicast_red.s_addr != 0 && modo != MODO_EPOLL) {
+        fprintf(stderr, "-G solo con -m epoll\n");
+        uso(argv[0]);
+    }
+    registro_iniciar();
+    // Antes de cualquier fork(): hijos y procesos epoll suman en el mismo mapeo
+    if (ruta_metricas && (metricas_compartir() < 0 || metricas_servir(ruta_metricas) < 0))
         exit(EXIT_FAILURE);
+
+    const int PORT_BASE = atoi(argv[optind]);
+    if (procesos < 0)
+        procesos = modo == MODO_POOL ? POOL_DEFECTO : 1;
+    else if (procesos == 0)
+        procesos = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (modo == MODO_FORK) {
+        int server_fd = crear_socket_principal(PORT_BASE);
+        reg_info("Servidor TFTP escuchando en puerto %d", PORT_BASE);
+        motor_fork(server_fd);
+        // Nunca llega aquí
+        close(server_fd);
+        return 0;
+    }
+
+    // Cada sesión ocupa un socket y un archivo: subir el límite de descriptores
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max) {
+        lim.rlim_cur = lim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &lim);
     }
+
+    if (modo == MODO_POOL) {
+        reg_info("Servidor TFTP (pool de %ld hilos) escuchando en puerto %d", procesos, PORT_BASE);
+        motor_pool(crear_socket_principal(PORT_BASE), procesos);
+    }
+
+    reg_info("Servidor TFTP (epoll, %ld proceso%s) escuchando en puerto %d",
+             procesos, procesos > 1 ? "s" : "", PORT_BASE);
+    if (procesos == 1)
+        motor_epoll(crear_socket_principal(PORT_BASE));
+
+    /*
+     * Un proceso por núcleo, cada uno con su propio socket en el puerto
+     * principal: SO_REUSEPORT reparte los pedidos por dirección del cliente,
+     * así que las retransmisiones de un cliente llegan siempre al mismo.
+     */
+    for (long i = 0; i < procesos; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            reg_errno("fork");
+            exit(EXIT_FAILURE);
+        }
+        if (pid == 0)
+            motor_epoll(crear_socket_principal(PORT_BASE));
+    }
+    while (wait(NULL) > 0);
+    return 0;
 }
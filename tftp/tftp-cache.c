@@ -0,0 +1,142 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tftp-cache.h"
+#include "tftp-metricas.h"
+#include "registro.h"
+
+size_t cache_max_bytes = CACHE_DEFECTO;
+
+/*
+ * Pocas entradas (los archivos calientes son unos pocos): búsqueda lineal.
+ * Las sesiones guardan punteros a las entradas, así que nunca se mueven; un
+ * lugar está libre cuando no tiene mapa.
+ */
+static Cacheado tabla[MAX_CACHEADOS];
+static size_t mapeados;               // bytes de esta caché, para el tope
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Saca la entrada de la tabla; si hay sesiones usándola, el mapeo sigue vivo
+static void quitar(Cacheado *c) {
+    if (c->referencias > 0) {
+        c->obsoleto = 1;
+        c->nombre[0] = '\0'; // ya no se encuentra por nombre
+        return;
+    }
+    munmap(c->mapa, c->tamano);
+    mapeados -= c->tamano;
+    SUMAR(metricas->cache_bytes, -(int64_t)c->tamano);
+    SUMAR(metricas->cache_entradas, -1);
+    c->mapa = NULL;
+}
+
+static Cacheado *lugar_libre(void) {
+    for (int i = 0; i < MAX_CACHEADOS; i++) {
+        if (!tabla[i].mapa)
+            return &tabla[i];
+    }
+    return NULL;
+}
+
+/*
+ * Hace lugar para 'tamano' bytes desalojando las entradas sin sesiones, de la
+ * usada hace más tiempo a la más reciente. Devuelve 0 si lo logró.
+ */
+static int hacer_lugar(off_t tamano) {
+    while (mapeados + tamano > cache_max_bytes || !lugar_libre()) {
+        Cacheado *viejo = NULL;
+        for (int i = 0; i < MAX_CACHEADOS; i++) {
+            if (tabla[i].mapa && tabla[i].referencias == 0 &&
+                (!viejo || tabla[i].ultimo_uso < viejo->ultimo_uso))
+                viejo = &tabla[i];
+        }
+        if (!viejo)
+            return -1;
+        reg_info("Caché: se desaloja %s (%lld bytes)", viejo->nombre, (long long)viejo->tamano);
+        SUMAR(metricas->cache_desalojos, 1);
+        quitar(viejo);
+    }
+    return 0;
+}
+
+static Cacheado *cargar(const char *nombre, const struct stat *st) {
+    if ((size_t)st->st_size > cache_max_bytes || hacer_lugar(st->st_size) < 0)
+        return NULL;
+
+    int fd = open(nombre, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    // El mapeo no necesita el descriptor abierto
+    unsigned char *mapa = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapa == MAP_FAILED)
+        return NULL;
+    madvise(mapa, st->st_size, MADV_SEQUENTIAL);
+    madvise(mapa, st->st_size, MADV_WILLNEED);
+
+    Cacheado *c = lugar_libre();
+    memset(c, 0, sizeof(*c));
+    strcpy(c->nombre, nombre);
+    c->dev = st->st_dev;
+    c->ino = st->st_ino;
+    c->tamano = st->st_size;
+    c->mtime = st->st_mtim;
+    c->mapa = mapa;
+    mapeados += c->tamano;
+    SUMAR(metricas->cache_fallos, 1);
+    SUMAR(metricas->cache_bytes, c->tamano);
+    SUMAR(metricas->cache_entradas, 1);
+    reg_info("Caché: cargado %s (%lld bytes); %llu aciertos, %llu fallos", nombre,
+             (long long)c->tamano, (unsigned long long)LEER(metricas->cache_aciertos),
+             (unsigned long long)LEER(metricas->cache_fallos));
+    return c;
+}
+
+Cacheado *cache_tomar(const char *nombre) {
+    if (cache_max_bytes == 0 || strlen(nombre) >= MAX_NOMBRE)
+        return NULL;
+
+    // Un stat() por pedido alcanza para saber si la copia sigue vigente
+    struct stat st;
+    if (stat(nombre, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        return NULL;
+
+    pthread_mutex_lock(&cache_mutex);
+    Cacheado *c = NULL;
+    for (int i = 0; i < MAX_CACHEADOS; i++) {
+        if (tabla[i].mapa && strcmp(tabla[i].nombre, nombre) == 0) {
+            c = &tabla[i];
+            break;
+        }
+    }
+    if (c && (c->dev != st.st_dev || c->ino != st.st_ino || c->tamano != st.st_size ||
+              c->mtime.tv_sec != st.st_mtim.tv_sec || c->mtime.tv_nsec != st.st_mtim.tv_nsec)) {
+        reg_info("Caché: %s cambió en disco, se vuelve a cargar", nombre);
+        SUMAR(metricas->cache_invalidaciones, 1);
+        quitar(c);
+        c = NULL;
+    }
+    if (c)
+        SUMAR(metricas->cache_aciertos, 1);
+    else
+        c = cargar(nombre, &st);
+    if (c) {
+        c->referencias++;
+        c->ultimo_uso = monotonic_ns();
+    }
+    pthread_mutex_unlock(&cache_mutex);
+    return c;
+}
+
+void cache_soltar(Cacheado *c) {
+    pthread_mutex_lock(&cache_mutex);
+    if (--c->referencias == 0 && c->obsoleto)
+        quitar(c);
+    pthread_mutex_unlock(&cache_mutex);
+}
@@ -0,0 +1,59 @@
+/*
+ * Caché de archivos calientes para RRQ.
+ *
+ * En un arranque masivo (PXE) cientos de clientes piden los mismos pocos
+ * archivos casi a la vez. La caché guarda cada archivo mapeado de solo
+ * lectura una sola vez y todas las sesiones que lo sirven comparten ese
+ * mapeo: no hay open/fstat/mmap/munmap por sesión, solo un stat() para
+ * verificar que el archivo no cambió.
+ *
+ * Cada entrada se valida contra dispositivo, inodo, tamaño y mtime; si el
+ * archivo cambió se descarta (se libera cuando la suelta la última sesión) y
+ * se carga de nuevo. El total mapeado se limita a cache_max_bytes y, al
+ * llenarse, se desaloja la entrada sin sesiones usada hace más tiempo (LRU).
+ *
+ * En el modo fork el padre toma la entrada antes de fork(): el hijo hereda
+ * el mapeo y los contadores quedan en el padre. En epoll y pool la caché es
+ * del proceso, protegida con un mutex para los hilos del pool.
+ *
+ * Aciertos, fallos, invalidaciones, desalojos y lo mapeado se cuentan en las
+ * métricas (tftp-metricas.h), que suman lo de todos los procesos.
+ */
+#ifndef TFTP_CACHE_H
+#define TFTP_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "tftp-sesion.h"
+
+#define MAX_CACHEADOS   64                 // archivos distintos en caché
+#define CACHE_DEFECTO   (256u << 20)       // bytes mapeados como máximo
+
+typedef struct Cacheado {
+    char nombre[MAX_NOMBRE];
+    dev_t dev;
+    ino_t ino;
+    off_t tamano;
+    struct timespec mtime;
+    unsigned char *mapa;
+    int referencias;                // sesiones que lo están sirviendo
+    int obsoleto;                   // cambió en disco: se libera al soltarlo
+    uint64_t ultimo_uso;            // para el LRU
+} Cacheado;
+
+// Tope de bytes mapeados; 0 desactiva la caché
+extern size_t cache_max_bytes;
+
+/*
+ * Devuelve el archivo mapeado, cargándolo si hace falta, con una referencia
+ * más. NULL si la caché está desactivada, el archivo no existe o está vacío,
+ * o no hay lugar: en ese caso la sesión lo abre por su cuenta.
+ */
+Cacheado *cache_tomar(const char *nombre);
+
+void cache_soltar(Cacheado *c);
+
+#endif
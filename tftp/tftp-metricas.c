@@ -0,0 +1,232 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "tftp-metricas.h"
+#include "registro.h"
+
+static Metricas locales;
+Metricas *metricas = &locales;
+
+static const char *nombres_finales[FINALES] = { "otro", "completa", "error", "abortada", "abandonada" };
+
+int metricas_compartir(void) {
+    Metricas *m = mmap(NULL, sizeof(Metricas), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED) {
+        reg_errno("mmap métricas");
+        return -1;
+    }
+    // El mapeo anónimo viene en cero, igual que 'locales' antes de la primera sesión
+    metricas = m;
+    return 0;
+}
+
+// Cubeta de 'v': la primera cuyo límite 2^i no es menor que v
+static int cubeta(uint64_t v) {
+    if (v <= 1)
+        return 0;
+    int i = 64 - __builtin_clzll(v - 1);
+    return i < CUBETAS - 1 ? i : CUBETAS - 1;
+}
+
+static void anotar(Histograma *h, uint64_t v) {
+    SUMAR(h->cubetas[cubeta(v)], 1);
+    SUMAR(h->suma, v);
+    SUMAR(h->cantidad, 1);
+}
+
+void metricas_empieza(Sesion *s) {
+    s->inicio_ns = monotonic_ns();
+    SUMAR(metricas->activas, 1);
+}
+
+void metricas_termina(Sesion *s) {
+    if (s->inicio_ns == 0)
+        return; // ya contada (o nunca empezó)
+    uint64_t duracion = monotonic_ns() - s->inicio_ns;
+    s->inicio_ns = 0;
+
+    uint64_t bytes;
+    if (s->tipo == OPCODE_WRQ)
+        bytes = s->offset; // guardar() ya suma lo que sigue en 'escritura'
+    else if (s->resultado == FIN_COMPLETA)
+        bytes = s->largo;
+    else if (s->bloque > 1)
+        bytes = (s->bloque - 1) * s->blksize < (uint64_t)s->largo ? (s->bloque - 1) * s->blksize : (uint64_t)s->largo;
+    else
+        bytes = 0;
+
+    if (s->tipo == OPCODE_RRQ || s->tipo == OPCODE_WRQ) {
+        SUMAR(metricas->sesiones[s->tipo - OPCODE_RRQ], 1);
+        SUMAR(metricas->bytes[s->tipo - OPCODE_RRQ], bytes);
+    }
+    SUMAR(metricas->finales[s->resultado], 1);
+    if (s->resultado == FIN_ERROR)
+        SUMAR(metricas->errores[s->codigo_error <= MAX_CODIGO ? s->codigo_error : 0], 1);
+    SUMAR(metricas->paquetes_enviados, s->enviados);
+    SUMAR(metricas->paquetes_recibidos, s->recibidos);
+    SUMAR(metricas->retransmisiones, s->vencimientos);
+    if (s->tipo == OPCODE_RRQ)
+        SUMAR(metricas->duplicados, s->duplicados);
+    else
+        SUMAR(metricas->fuera_de_orden, s->duplicados);
+
+    anotar(&metricas->duracion_ms, duracion / 1000000);
+    if (s->resultado == FIN_COMPLETA && duracion > 0)
+        anotar(&metricas->rendimiento, (uint64_t)((double)bytes * 1e9 / duracion));
+    if (s->srtt_ns)
+        anotar(&metricas->rtt_us, s->srtt_ns / 1000);
+    SUMAR(metricas->activas, -1);
+}
+
+static void contador(FILE *f, const char *nombre, const char *ayuda, uint64_t valor) {
+    fprintf(f, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", nombre, ayuda, nombre, nombre,
+            (unsigned long long)valor);
+}
+
+static void histograma(FILE *f, const char *nombre, const char *ayuda, Histograma *h) {
+    fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", nombre, ayuda, nombre);
+    uint64_t acumulado = 0;
+    for (int i = 0; i < CUBETAS - 1; i++) {
+        acumulado += LEER(h->cubetas[i]);
+        fprintf(f, "%s_bucket{le=\"%llu\"} %llu\n", nombre, 1ULL << i, (unsigned long long)acumulado);
+    }
+    acumulado += LEER(h->cubetas[CUBETAS - 1]);
+    fprintf(f, "%s_bucket{le=\"+Inf\"} %llu\n", nombre, (unsigned long long)acumulado);
+    fprintf(f, "%s_sum %llu\n%s_count %llu\n", nombre, (unsigned long long)LEER(h->suma),
+            nombre, (unsigned long long)LEER(h->cantidad));
+}
+
+/*
+ * Las lecturas no son una foto atómica: con sesiones terminando a la vez un
+ * contador puede ir una sesión adelante de otro.
+ */
+static void escribir(FILE *f) {
+    Metricas *m = metricas;
+
+    fprintf(f, "# HELP tftp_sesiones_activas Sesiones en curso.\n# TYPE tftp_sesiones_activas gauge\n"
+            "tftp_sesiones_activas %lld\n", (long long)LEER(m->activas));
+    fprintf(f, "# HELP tftp_sesiones_total Sesiones terminadas, por tipo de pedido.\n"
+            "# TYPE tftp_sesiones_total counter\n"
+            "tftp_sesiones_total{tipo=\"rrq\"} %llu\ntftp_sesiones_total{tipo=\"wrq\"} %llu\n",
+            (unsigned long long)LEER(m->sesiones[0]), (unsigned long long)LEER(m->sesiones[1]));
+    fprintf(f, "# HELP tftp_sesiones_terminadas_total Sesiones terminadas, por cómo terminaron.\n"
+            "# TYPE tftp_sesiones_terminadas_total counter\n");
+    for (int i = 0; i < FINALES; i++)
+        fprintf(f, "tftp_sesiones_terminadas_total{resultado=\"%s\"} %llu\n", nombres_finales[i],
+                (unsigned long long)LEER(m->finales[i]));
+    fprintf(f, "# HELP tftp_errores_total Paquetes ERROR enviados, por código.\n"
+            "# TYPE tftp_errores_total counter\n");
+    for (int i = 0; i <= MAX_CODIGO; i++)
+        fprintf(f, "tftp_errores_total{codigo=\"%d\"} %llu\n", i, (unsigned long long)LEER(m->errores[i]));
+    fprintf(f, "# HELP tftp_bytes_total Bytes de datos servidos (rrq) y recibidos (wrq).\n"
+            "# TYPE tftp_bytes_total counter\n"
+            "tftp_bytes_total{tipo=\"rrq\"} %llu\ntftp_bytes_total{tipo=\"wrq\"} %llu\n",
+            (unsigned long long)LEER(m->bytes[0]), (unsigned long long)LEER(m->bytes[1]));
+    contador(f, "tftp_paquetes_enviados_total", "Paquetes enviados por las sesiones.", LEER(m->paquetes_enviados));
+    contador(f, "tftp_paquetes_recibidos_total", "Paquetes recibidos por las sesiones.", LEER(m->paquetes_recibidos));
+    contador(f, "tftp_retransmisiones_total", "Vencimientos del RTO (cada uno retransmite).", LEER(m->retransmisiones));
+    contador(f, "tftp_acks_duplicados_total", "ACK repetidos recibidos en los RRQ.", LEER(m->duplicados));
+    contador(f, "tftp_datos_fuera_de_orden_total", "DATA fuera de orden recibidos en los WRQ.", LEER(m->fuera_de_orden));
+    histograma(f, "tftp_sesion_duracion_ms", "Duración de las sesiones en milisegundos.", &m->duracion_ms);
+    histograma(f, "tftp_sesion_rendimiento_bytes_por_segundo", "Rendimiento de las sesiones completas.",
+               &m->rendimiento);
+    histograma(f, "tftp_sesion_rtt_us", "RTT suavizado de cada sesión al cerrarse, en microsegundos.", &m->rtt_us);
+    contador(f, "tftp_cache_aciertos_total", "RRQ servidos desde la caché de archivos calientes.", LEER(m->cache_aciertos));
+    contador(f, "tftp_cache_fallos_total", "Archivos cargados desde disco a la caché.", LEER(m->cache_fallos));
+    contador(f, "tftp_cache_invalidaciones_total", "Entradas descartadas porque el archivo cambió.",
+             LEER(m->cache_invalidaciones));
+    contador(f, "tftp_cache_desalojos_total", "Entradas desalojadas por falta de lugar.", LEER(m->cache_desalojos));
+    fprintf(f, "# HELP tftp_cache_bytes Bytes mapeados por la caché.\n# TYPE tftp_cache_bytes gauge\n"
+            "tftp_cache_bytes %lld\n", (long long)LEER(m->cache_bytes));
+    fprintf(f, "# HELP tftp_cache_entradas Archivos en la caché.\n# TYPE tftp_cache_entradas gauge\n"
+            "tftp_cache_entradas %lld\n", (long long)LEER(m->cache_entradas));
+}
+
+static void responder(int c) {
+    char *texto = NULL;
+    size_t largo = 0;
+    FILE *f = open_memstream(&texto, &largo);
+    if (!f) {
+        reg_errno("open_memstream");
+        return;
+    }
+    escribir(f);
+    fclose(f);
+
+    // Un lector que no lee no traba el hilo más de un segundo
+    struct timeval espera = { .tv_sec = 1 };
+    setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &espera, sizeof(espera));
+    for (size_t hecho = 0; hecho < largo;) {
+        ssize_t r = send(c, texto + hecho, largo - hecho, MSG_NOSIGNAL);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        hecho += r;
+    }
+    free(texto);
+}
+
+static void *atender(void *arg) {
+    int fd = (int)(intptr_t)arg;
+
+    while (1) {
+        int c = accept(fd, NULL, NULL);
+        if (c < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                reg_errno("accept métricas");
+                sleep(1);
+            }
+            continue;
+        }
+        responder(c);
+        close(c);
+    }
+    return NULL;
+}
+
+int metricas_servir(const char *ruta) {
+    struct sockaddr_un dir = { .sun_family = AF_UNIX };
+    if (strlen(ruta) >= sizeof(dir.sun_path)) {
+        reg_error("Ruta de métricas demasiado larga: %s", ruta);
+        return -1;
+    }
+    strcpy(dir.sun_path, ruta);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        reg_errno("socket métricas");
+        return -1;
+    }
+    // Solo se reemplaza un socket viejo, nunca otro archivo
+    struct stat st;
+    if (lstat(ruta, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(ruta);
+    if (bind(fd, (struct sockaddr *)&dir, sizeof(dir)) < 0 || listen(fd, 16) < 0) {
+        reg_errno("bind métricas");
+        close(fd);
+        return -1;
+    }
+
+    pthread_t hilo;
+    int r = pthread_create(&hilo, NULL, atender, (void *)(intptr_t)fd);
+    if (r != 0) {
+        reg_error("pthread_create métricas: %s", strerror(r));
+        close(fd);
+        return -1;
+    }
+    pthread_detach(hilo);
+    reg_info("Métricas en %s", ruta);
+    return 0;
+}
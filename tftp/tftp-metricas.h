@@ -0,0 +1,88 @@
+/*
+ * Métricas del servidor para dimensionar arranques masivos.
+ *
+ * Contadores e histogramas de todas las sesiones: cuántas hay activas, cómo
+ * terminan, bytes y paquetes, retransmisiones, ACK duplicados, errores por
+ * código, y por sesión la duración, el rendimiento y el RTT suavizado. Cada
+ * sesión lleva sus números en la Sesion y los suma acá al cerrarse, así que
+ * el camino de los datos no toca memoria compartida; solo el gauge de
+ * activas se mueve al empezar.
+ *
+ * Los contadores son atómicos y viven en un mapeo anónimo compartido que se
+ * crea antes de cualquier fork(): los hijos del modo fork y los procesos del
+ * epoll con -n suman en el mismo lugar que los hilos del pool. Con -E el
+ * servidor atiende un socket UNIX que, a cada conexión, responde con todo en
+ * el formato de texto de Prometheus y cierra:
+ *
+ *     socat - UNIX-CONNECT:/run/tftp.sock
+ */
+#ifndef TFTP_METRICAS_H
+#define TFTP_METRICAS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "tftp-sesion.h"
+
+// Cómo terminó una sesión (Sesion.resultado)
+#define FIN_OTRO        0      // sin clasificar: se sumó a un grupo multicast, falló el socket...
+#define FIN_COMPLETA    1
+#define FIN_ERROR       2      // el servidor mandó un ERROR
+#define FIN_ABORTADA    3      // el cliente mandó un ERROR
+#define FIN_ABANDONADA  4      // el cliente dejó de responder
+#define FINALES         5
+
+#define MAX_CODIGO      8      // mayor código de ERROR de TFTP (RFC 2347)
+#define CUBETAS         40     // la cubeta i cuenta valores hasta 2^i; la última, el resto
+
+typedef struct Histograma {
+    _Atomic uint64_t cubetas[CUBETAS];
+    _Atomic uint64_t suma;
+    _Atomic uint64_t cantidad;
+} Histograma;
+
+typedef struct Metricas {
+    _Atomic int64_t activas;
+    _Atomic uint64_t sesiones[2];               // por tipo: RRQ, WRQ
+    _Atomic uint64_t finales[FINALES];          // por FIN_*
+    _Atomic uint64_t errores[MAX_CODIGO + 1];   // ERROR enviados, por código
+    _Atomic uint64_t bytes[2];                  // de archivo servidos (RRQ) y recibidos (WRQ)
+    _Atomic uint64_t paquetes_enviados;
+    _Atomic uint64_t paquetes_recibidos;
+    _Atomic uint64_t retransmisiones;           // RTO vencidos
+    _Atomic uint64_t duplicados;                // ACK repetidos de los RRQ
+    _Atomic uint64_t fuera_de_orden;            // DATA fuera de orden de los WRQ
+    Histograma duracion_ms;
+    Histograma rendimiento;                     // bytes/s de las sesiones completas
+    Histograma rtt_us;                          // RTT suavizado al cerrar
+    _Atomic uint64_t cache_aciertos;            // RRQ servidos desde la caché
+    _Atomic uint64_t cache_fallos;              // cargas desde disco
+    _Atomic uint64_t cache_invalidaciones;      // el archivo cambió desde que se cargó
+    _Atomic uint64_t cache_desalojos;           // sacados por falta de lugar
+    _Atomic int64_t cache_bytes;                // mapeado ahora, en todos los procesos
+    _Atomic int64_t cache_entradas;             // incluye las que cambiaron y siguen en uso
+} Metricas;
+
+#define SUMAR(c, n) atomic_fetch_add_explicit(&(c), (n), memory_order_relaxed)
+#define LEER(c)     atomic_load_explicit(&(c), memory_order_relaxed)
+
+/*
+ * Dónde se suma. Por defecto, una estructura del proceso; metricas_compartir()
+ * la pasa a memoria compartida con los procesos que se creen después.
+ */
+extern Metricas *metricas;
+
+// Mueve las métricas a un mapeo compartido; se llama antes de crear procesos
+int metricas_compartir(void);
+
+// Una sesión empieza (sesion_iniciar) o termina (sesion_cerrar, o al completar un WRQ)
+void metricas_empieza(Sesion *s);
+void metricas_termina(Sesion *s);
+
+/*
+ * Atiende el socket UNIX 'ruta' en un hilo propio. Si ya existe un socket
+ * con ese nombre (de una ejecución anterior) se reemplaza.
+ */
+int metricas_servir(const char *ruta);
+
+#endif
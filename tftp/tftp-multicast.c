@@ -0,0 +1,222 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "tftp-multicast.h"
+#include "tftp-metricas.h"
+#include "registro.h"
+
+struct in_addr multicast_red;
+
+// Un lugar está libre cuando no tiene sesión; las sesiones apuntan a su grupo
+static Grupo grupos[MAX_GRUPOS];
+
+static int misma_direccion(const struct sockaddr_in *a, const struct sockaddr_in *b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+// "multicast" y su valor más largo, con los dos \0
+#define OPCION_MULTICAST (sizeof("multicast") + sizeof("255.255.255.255,65535,1"))
+
+/*
+ * Agrega "multicast" = "dirección,puerto,mc" al OACK de s->paquete, que ya
+ * tiene 'len' bytes (2 si no hay otras opciones aceptadas). multicast_rrq()
+ * ya comprobó que entra.
+ */
+static void armar_oack(Sesion *s, const Grupo *g, int maestro, size_t len) {
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &g->direccion.sin_addr, ip, sizeof(ip));
+
+    uint16_t op_net = htons(OPCODE_OACK);
+    memcpy(s->paquete, &op_net, 2);
+    s->paquete_len = len;
+    sesion_oack_opcion(s, "multicast", "%s,%d,%d", ip, ntohs(g->direccion.sin_port), maestro);
+    s->oack = 1;
+}
+
+static const char *nombre_grupo(const Grupo *g) {
+    static char nombre[INET_ADDRSTRLEN + 8];
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &g->direccion.sin_addr, ip, sizeof(ip));
+    snprintf(nombre, sizeof(nombre), "%s:%d", ip, ntohs(g->direccion.sin_port));
+    return nombre;
+}
+
+// Le da el control al próximo cliente en espera con un OACK con mc=1
+static int siguiente_maestro(Grupo *g) {
+    Sesion *s = g->s;
+    if (g->n_miembros == 0)
+        return SESION_FIN;
+
+    s->cliente = g->miembros[0];
+    g->n_miembros--;
+    memmove(&g->miembros[0], &g->miembros[1], g->n_miembros * sizeof(g->miembros[0]));
+    reg_info("Grupo %s: nuevo maestro %s:%d (%d esperando)", nombre_grupo(g),
+             inet_ntoa(s->cliente.sin_addr), ntohs(s->cliente.sin_port), g->n_miembros);
+    armar_oack(s, g, 1, 2);
+    sesion_ofrecer(s);
+    return SESION_SIGUE;
+}
+
+// El cliente no es el maestro: queda escuchando con un OACK con mc=0
+static int unir(Grupo *g, Sesion *s) {
+    int i = 0;
+    while (i < g->n_miembros && !misma_direccion(&g->miembros[i], &s->cliente))
+        i++;
+    // Un pedido repetido (se perdió el OACK) solo recibe el OACK de nuevo
+    if (i == g->n_miembros && !misma_direccion(&g->s->cliente, &s->cliente)) {
+        if (g->n_miembros == MAX_MIEMBROS)
+            return -1;
+        g->miembros[g->n_miembros++] = s->cliente;
+        g->clientes++;
+        reg_info("Grupo %s: se suma %s:%d (%d esperando)", nombre_grupo(g),
+                 inet_ntoa(s->cliente.sin_addr), ntohs(s->cliente.sin_port), g->n_miembros);
+    }
+
+    // El OACK sale del socket del grupo: ese puerto es el TID para este cliente
+    armar_oack(s, g, 0, s->oack ? s->paquete_len : 2);
+    if (sendto(g->s->sock, s->paquete, s->paquete_len, 0,
+               (const struct sockaddr *)&s->cliente, sizeof(s->cliente)) < 0)
+        reg_errno("sendto OACK");
+    return SESION_FIN;
+}
+
+static int crear(Grupo *g, Sesion *s) {
+    // Los DATA salen por la interfaz por la que se llega al primer cliente
+    struct sockaddr_in local;
+    socklen_t len = sizeof(local);
+    if (getsockname(s->sock, (struct sockaddr *)&local, &len) < 0) {
+        reg_errno("getsockname");
+        return -1;
+    }
+
+    // El grupo recibe ACK de varios clientes: su socket no puede estar conectado
+    int sock = crear_socket_sesion(0);
+    if (sock < 0)
+        return -1;
+    setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &local.sin_addr, sizeof(local.sin_addr));
+    len = sizeof(local);
+    getsockname(sock, (struct sockaddr *)&local, &len);
+    close(s->sock);
+    s->sock = sock;
+
+    memset(g, 0, sizeof(*g));
+    g->s = s;
+    g->clientes = 1;
+    g->direccion.sin_family = AF_INET;
+    g->direccion.sin_port = htons(MULTICAST_PUERTO);
+    g->direccion.sin_addr.s_addr = htonl((ntohl(multicast_red.s_addr) & 0xffff0000) | ntohs(local.sin_port));
+    s->grupo = g;
+    reg_info("Grupo %s para %s, maestro %s:%d", nombre_grupo(g), s->archivo,
+             inet_ntoa(s->cliente.sin_addr), ntohs(s->cliente.sin_port));
+
+    armar_oack(s, g, 1, s->oack ? s->paquete_len : 2);
+    sesion_ofrecer(s);
+    return SESION_SIGUE;
+}
+
+int multicast_rrq(Sesion *s) {
+    // Un OACK ya lleno de otras opciones no tiene lugar para la respuesta
+    if ((s->oack ? s->paquete_len : 2) + OPCION_MULTICAST > MAX_BUFFER)
+        return -1;
+
+    Grupo *libre = NULL;
+
+    for (int i = 0; i < MAX_GRUPOS; i++) {
+        Grupo *g = &grupos[i];
+        if (!g->s) {
+            if (!libre)
+                libre = g;
+            continue;
+        }
+        // Mismos DATA: mismo archivo (y la misma versión) cortado igual
+        if (strcmp(g->s->archivo, s->archivo) == 0 && g->s->blksize == s->blksize &&
+            g->s->ventana == s->ventana && g->s->tamano == s->tamano &&
+            g->s->cacheado == s->cacheado)
+            return unir(g, s);
+    }
+    return libre ? crear(libre, s) : -1;
+}
+
+static void quitar_miembro(Grupo *g, const struct sockaddr_in *cliente) {
+    for (int i = 0; i < g->n_miembros; i++) {
+        if (misma_direccion(&g->miembros[i], cliente)) {
+            g->n_miembros--;
+            memmove(&g->miembros[i], &g->miembros[i + 1], (g->n_miembros - i) * sizeof(g->miembros[0]));
+            g->completos++;
+            return;
+        }
+    }
+}
+
+int multicast_drenar(Sesion *s, unsigned char *area, size_t area_len) {
+    Grupo *g = s->grupo;
+    struct sockaddr_in origen;
+
+    while (1) {
+        socklen_t origen_len = sizeof(origen);
+        int r = recvfrom(s->sock, area, MAX_BUFFER, MSG_DONTWAIT, (struct sockaddr *)&origen, &origen_len);
+        if (r < 0) {
+            if (errno == EAGAIN || errno == EINTR || errno == ECONNREFUSED)
+                return SESION_SIGUE;
+            reg_errno("recvfrom grupo");
+            return SESION_FIN;
+        }
+        s->recepciones++;
+        s->recibidos++;
+        if (r < 4)
+            continue;
+
+        uint16_t opcode = ntohs(*(uint16_t *)area);
+        uint16_t block = ntohs(*(uint16_t *)(area + 2));
+        int termino = opcode == OPCODE_ERROR || (opcode == OPCODE_ACK && block == s->total_bloques);
+
+        if (!misma_direccion(&origen, &s->cliente)) {
+            // Solo el maestro controla la transmisión; los demás avisan que terminaron
+            if (termino)
+                quitar_miembro(g, &origen);
+            continue;
+        }
+        if (termino) {
+            if (opcode == OPCODE_ACK) {
+                g->completos++;
+                s->resultado = FIN_COMPLETA;
+            }
+            if (siguiente_maestro(g) == SESION_FIN)
+                return SESION_FIN;
+            continue;
+        }
+        if (opcode != OPCODE_ACK)
+            continue;
+
+        /*
+         * El primer ACK de un maestro, o uno que confirma más allá de lo
+         * enviado (ya tenía esos bloques de antes), dice desde dónde seguir.
+         */
+        if (s->oack || block >= s->siguiente)
+            r = sesion_reanudar(s, block);
+        else
+            r = sesion_recibir(s, area, r);
+        if (r == SESION_FIN)
+            return SESION_FIN;
+    }
+}
+
+int multicast_sin_maestro(Sesion *s) {
+    reg_aviso("Grupo %s: el maestro %s:%d no responde", nombre_grupo(s->grupo),
+              inet_ntoa(s->cliente.sin_addr), ntohs(s->cliente.sin_port));
+    // El backoff fue por el maestro caído; el próximo arranca de nuevo
+    if (!s->timeout)
+        s->rto_ns = (uint64_t)RTO_INICIAL_MS * 1000000;
+    return siguiente_maestro(s->grupo);
+}
+
+void multicast_cerrar(Grupo *g) {
+    reg_info("Grupo %s (%s): %d clientes, %d completos, %llu paquetes enviados",
+             nombre_grupo(g), g->s->archivo, g->clientes, g->completos,
+             (unsigned long long)g->s->enviados);
+    g->s = NULL;
+}
@@ -0,0 +1,66 @@
+/*
+ * TFTP multicast (RFC 2090) para descargas idénticas simultáneas.
+ *
+ * Un RRQ con la opción "multicast" se suma al grupo abierto para el mismo
+ * archivo, blksize y windowsize, o abre uno nuevo. Los DATA del grupo salen
+ * una sola vez hacia una dirección multicast, sin importar cuántos clientes
+ * la escuchen, y los controla un único cliente, el maestro, que confirma con
+ * ACK como en una descarga normal. Los demás escuchan sin responder.
+ *
+ * Cuando el maestro termina (o deja de responder) se elige al siguiente por
+ * orden de llegada con un OACK "multicast" con mc=1. El nuevo maestro
+ * confirma el bloque anterior al primero que le falta y la transmisión sigue
+ * desde ahí, así que cada cliente que llegó tarde recupera los bloques que
+ * se perdió por su cuenta (por unicast hasta el servidor) y el reenvío le
+ * sirve también a los demás que tengan el mismo hueco. Un cliente que no es
+ * maestro y ya tiene todo avisa con un ACK del último bloque y deja el grupo.
+ *
+ * El grupo es la sesión del primer cliente: su socket, sin conectar, es el
+ * TID del grupo, y su puerto fija la dirección multicast dentro de la red
+ * configurada (base /16), así que dos grupos nunca comparten dirección ni
+ * aun con varios procesos. Los bloques se identifican por su número de 16
+ * bits sin rollover: los archivos más grandes se sirven por unicast.
+ *
+ * Solo el motor epoll, un proceso que ve todos los pedidos, abre grupos.
+ */
+#ifndef TFTP_MULTICAST_H
+#define TFTP_MULTICAST_H
+
+#include <netinet/in.h>
+
+#include "tftp-sesion.h"
+
+#define MULTICAST_PUERTO 1758      // puerto de IANA para tftp-mcast
+#define MAX_GRUPOS       64
+#define MAX_MIEMBROS     256       // clientes esperando ser maestro, por grupo
+
+typedef struct Grupo {
+    Sesion *s;                      // transferencia hacia el grupo; s->cliente es el maestro (NULL = libre)
+    struct sockaddr_in direccion;   // destino de los DATA
+    struct sockaddr_in miembros[MAX_MIEMBROS];  // los que no son maestro, por orden de llegada
+    int n_miembros;
+    int clientes;                   // cuántos se sumaron en total
+    int completos;                  // cuántos terminaron la descarga
+} Grupo;
+
+// Red de los grupos (-G); mientras sea 0 la opción multicast se ignora
+extern struct in_addr multicast_red;
+
+/*
+ * Un RRQ con la opción multicast y el archivo ya abierto: lo suma a un grupo
+ * existente (le manda el OACK con mc=0 y devuelve SESION_FIN para cerrar la
+ * sesión propia) o convierte la sesión en un grupo nuevo del que es maestro.
+ * Devuelve -1 si no hay lugar para otro grupo o miembro, o para la opción en
+ * el OACK: se atiende por unicast.
+ */
+int multicast_rrq(Sesion *s);
+
+// Lee lo que llegó al socket del grupo: ACK del maestro y avisos de los demás
+int multicast_drenar(Sesion *s, unsigned char *area, size_t area_len);
+
+// El maestro dejó de responder: pasa al siguiente, o SESION_FIN si no queda nadie
+int multicast_sin_maestro(Sesion *s);
+
+void multicast_cerrar(Grupo *g);
+
+#endif
@@ -0,0 +1,231 @@
+#include "tftp-netascii.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define NETASCII_X86
+#endif
+
+#define EN_LINEA static inline __attribute__((always_inline))
+
+typedef size_t (*Copiador)(const unsigned char *in, unsigned char *out, size_t len,
+                           unsigned char a, unsigned char b);
+
+/*
+ * Copia 'in' a 'out' hasta el primer 'a' o 'b' (sin incluirlo) o hasta 'len'
+ * bytes, y devuelve cuántos copió. Las versiones SIMD buscan y copian en la
+ * misma pasada: guardan el bloque entero de 16 o 32 bytes antes de mirar si
+ * hay un CR o LF, así que pueden escribir en 'out' más allá de lo copiado,
+ * pero nunca más allá de 'len'; lo de más lo pisa lo que se escribe después.
+ */
+EN_LINEA size_t copiar_escalar(const unsigned char *in, unsigned char *out, size_t len,
+                               unsigned char a, unsigned char b) {
+    size_t i = 0;
+    for (; i < len && in[i] != a && in[i] != b; i++)
+        out[i] = in[i];
+    return i;
+}
+
+static uint64_t contar_escalar(const unsigned char *p, size_t len, unsigned char a, unsigned char b) {
+    uint64_t n = 0;
+    for (size_t i = 0; i < len; i++)
+        n += p[i] == a || p[i] == b;
+    return n;
+}
+
+#ifdef NETASCII_X86
+// SSE2 está siempre en x86-64
+EN_LINEA size_t copiar_sse2(const unsigned char *in, unsigned char *out, size_t len,
+                            unsigned char a, unsigned char b) {
+    const __m128i va = _mm_set1_epi8((char)a);
+    const __m128i vb = _mm_set1_epi8((char)b);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+        _mm_storeu_si128((__m128i *)(out + i), v);
+        int m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+        if (m)
+            return i + __builtin_ctz(m);
+    }
+    return i + copiar_escalar(in + i, out + i, len - i, a, b);
+}
+
+static uint64_t contar_sse2(const unsigned char *p, size_t len, unsigned char a, unsigned char b) {
+    const __m128i va = _mm_set1_epi8((char)a);
+    const __m128i vb = _mm_set1_epi8((char)b);
+    uint64_t n = 0;
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        n += __builtin_popcount(_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb))));
+    }
+    return n + contar_escalar(p + i, len - i, a, b);
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline size_t copiar_avx2(const unsigned char *in, unsigned char *out, size_t len,
+                                 unsigned char a, unsigned char b) {
+    const __m256i va = _mm256_set1_epi8((char)a);
+    const __m256i vb = _mm256_set1_epi8((char)b);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+        _mm256_storeu_si256((__m256i *)(out + i), v);
+        unsigned m = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)));
+        if (m)
+            return i + __builtin_ctz(m);
+    }
+    return i + copiar_sse2(in + i, out + i, len - i, a, b);
+}
+
+__attribute__((target("avx2,popcnt")))
+static uint64_t contar_avx2(const unsigned char *p, size_t len, unsigned char a, unsigned char b) {
+    const __m256i va = _mm256_set1_epi8((char)a);
+    const __m256i vb = _mm256_set1_epi8((char)b);
+    uint64_t n = 0;
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        n += __builtin_popcount(_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb))));
+    }
+    return n + contar_sse2(p + i, len - i, a, b);
+}
+#endif
+
+/*
+ * Los dos recorridos se escriben una vez y se instancian por juego de
+ * instrucciones con su copiador metido adentro: una llamada indirecta por
+ * cada fin de línea costaría más que copiar la línea.
+ */
+EN_LINEA size_t codificar_con(Copiador copiar, const unsigned char *in, size_t len,
+                              unsigned char *out, size_t max, size_t *leidos, int *mitad) {
+    size_t i = 0, o = 0;
+
+    // Cada byte del archivo da al menos uno en el cable
+    if (len > max)
+        len = max;
+    if (*mitad && len > 0) {
+        out[o++] = in[0] == '\n' ? '\n' : '\0';
+        i = 1;
+        *mitad = 0;
+    }
+    while (i < len && o < max) {
+        size_t tramo = len - i < max - o ? len - i : max - o;
+        size_t corrido = copiar(in + i, out + o, tramo, '\n', '\r');
+        i += corrido;
+        o += corrido;
+        if (corrido == tramo)
+            break;
+
+        out[o++] = '\r';
+        if (o == max) {
+            *mitad = 1; // el segundo byte del par abre el bloque siguiente
+            break;
+        }
+        out[o++] = in[i] == '\n' ? '\n' : '\0';
+        i++;
+    }
+    *leidos = i;
+    return o;
+}
+
+EN_LINEA size_t decodificar_con(Copiador copiar, const unsigned char *in, size_t len,
+                                unsigned char *out, int *cr) {
+    size_t i = 0, o = 0;
+
+    if (*cr) {
+        *cr = 0;
+        if (len > 0 && (in[0] == '\n' || in[0] == '\0')) {
+            out[o++] = in[0] == '\n' ? '\n' : '\r';
+            i = 1;
+        } else {
+            out[o++] = '\r'; // CR seguido de otra cosa (o del fin): se deja como vino
+        }
+    }
+    while (i < len) {
+        size_t corrido = copiar(in + i, out + o, len - i, '\r', '\r');
+        i += corrido;
+        o += corrido;
+        if (i == len)
+            break;
+
+        if (i + 1 == len) {
+            *cr = 1; // el par sigue en el próximo bloque
+            break;
+        }
+        if (in[i + 1] == '\n') {
+            out[o++] = '\n';
+            i += 2;
+        } else if (in[i + 1] == '\0') {
+            out[o++] = '\r';
+            i += 2;
+        } else {
+            out[o++] = '\r';
+            i++;
+        }
+    }
+    return o;
+}
+
+typedef struct Implementacion {
+    uint64_t (*contar)(const unsigned char *, size_t, unsigned char, unsigned char);
+    size_t (*codificar)(const unsigned char *, size_t, unsigned char *, size_t, size_t *, int *);
+    size_t (*decodificar)(const unsigned char *, size_t, unsigned char *, int *);
+} Implementacion;
+
+static size_t codificar_escalar(const unsigned char *in, size_t len, unsigned char *out, size_t max,
+                                size_t *leidos, int *mitad) {
+    return codificar_con(copiar_escalar, in, len, out, max, leidos, mitad);
+}
+
+static size_t decodificar_escalar(const unsigned char *in, size_t len, unsigned char *out, int *cr) {
+    return decodificar_con(copiar_escalar, in, len, out, cr);
+}
+
+static Implementacion elegida = { contar_escalar, codificar_escalar, decodificar_escalar };
+
+#ifdef NETASCII_X86
+static size_t codificar_sse2(const unsigned char *in, size_t len, unsigned char *out, size_t max,
+                             size_t *leidos, int *mitad) {
+    return codificar_con(copiar_sse2, in, len, out, max, leidos, mitad);
+}
+
+static size_t decodificar_sse2(const unsigned char *in, size_t len, unsigned char *out, int *cr) {
+    return decodificar_con(copiar_sse2, in, len, out, cr);
+}
+
+__attribute__((target("avx2")))
+static size_t codificar_avx2(const unsigned char *in, size_t len, unsigned char *out, size_t max,
+                             size_t *leidos, int *mitad) {
+    return codificar_con(copiar_avx2, in, len, out, max, leidos, mitad);
+}
+
+__attribute__((target("avx2")))
+static size_t decodificar_avx2(const unsigned char *in, size_t len, unsigned char *out, int *cr) {
+    return decodificar_con(copiar_avx2, in, len, out, cr);
+}
+#endif
+
+// Se elige una vez, antes de main(): las sesiones no pagan la consulta
+__attribute__((constructor))
+static void elegir_implementacion(void) {
+#ifdef NETASCII_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        elegida = (Implementacion){ contar_avx2, codificar_avx2, decodificar_avx2 };
+    else
+        elegida = (Implementacion){ contar_sse2, codificar_sse2, decodificar_sse2 };
+#endif
+}
+
+uint64_t netascii_extra(const unsigned char *in, size_t len) {
+    return elegida.contar(in, len, '\n', '\r');
+}
+
+size_t netascii_codificar(const unsigned char *in, size_t len, unsigned char *out, size_t max,
+                          size_t *leidos, int *mitad) {
+    return elegida.codificar(in, len, out, max, leidos, mitad);
+}
+
+size_t netascii_decodificar(const unsigned char *in, size_t len, unsigned char *out, int *cr) {
+    return elegida.decodificar(in, len, out, cr);
+}
@@ -0,0 +1,55 @@
+/*
+ * Modo netascii (RFC 1350, con las reglas de Telnet de RFC 764).
+ *
+ * En el cable cada fin de línea es CR LF y un CR suelto viaja como CR NUL.
+ * Al enviar, cada LF del archivo se vuelve CR LF y cada CR, CR NUL; al
+ * recibir se deshace. El texto crece o se achica, así que los bloques del
+ * cable no coinciden con bloques del archivo y un par CR LF puede quedar
+ * partido entre dos bloques: las funciones traducen de a tramos y se pasan
+ * ese estado de un tramo al siguiente.
+ *
+ * Lo caro es encontrar los CR y LF. Se buscan de a 16 bytes con SSE2, o de a
+ * 32 con AVX2 si el procesador lo tiene (se elige al arrancar), y lo que hay
+ * entre uno y otro se copia con memcpy(); en otras arquitecturas se busca
+ * byte a byte. Con texto común la traducción anda cerca de la velocidad de
+ * una copia.
+ */
+#ifndef TFTP_NETASCII_H
+#define TFTP_NETASCII_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Dónde empieza un bloque del cable en el archivo original. 'mitad' indica
+ * que el byte en 'entrada' es un LF o CR del que el bloque anterior ya
+ * mandó el CR: el bloque empieza con el segundo byte del par.
+ */
+typedef struct Corte {
+    uint64_t bloque;
+    off_t entrada;
+    int mitad;
+} Corte;
+
+// Bytes que agrega netascii a 'len' bytes de texto: uno por cada LF y cada CR
+uint64_t netascii_extra(const unsigned char *in, size_t len);
+
+/*
+ * Traduce a netascii desde 'in' hasta llenar 'max' bytes de 'out' o agotar
+ * la entrada. '*mitad' entra y sale como en Corte. Devuelve los bytes
+ * escritos; en '*leidos', los de 'in' que ya salieron enteros. Nunca lee más
+ * de 'max' bytes de 'in'.
+ */
+size_t netascii_codificar(const unsigned char *in, size_t len, unsigned char *out, size_t max,
+                          size_t *leidos, int *mitad);
+
+/*
+ * De netascii al texto local: CR LF queda LF y CR NUL queda CR. Un CR al
+ * final de 'in' no se escribe hasta ver el byte siguiente: queda en '*cr'
+ * para la próxima llamada (y con len 0 se escribe tal cual, al terminar).
+ * 'out' necesita lugar para len + 1 bytes. Devuelve los bytes escritos.
+ */
+size_t netascii_decodificar(const unsigned char *in, size_t len, unsigned char *out, int *cr);
+
+#endif
@@ -0,0 +1,113 @@
+#include "tftp-opciones.h"
+
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define BLKSIZE_DEFECTO 512
+#define BLKSIZE_MAXIMO  65464      // RFC 2348
+#define VENTANA_MAXIMA  65535      // RFC 7440
+
+size_t opciones_pedido(uint8_t *pkt, uint16_t opcode, const char *nombre, const Opciones *op) {
+    uint16_t op_net = htons(opcode);
+    size_t len = 2;
+    memcpy(pkt, &op_net, 2);
+    len += sprintf((char *)pkt + len, "%s", nombre) + 1;
+    len += sprintf((char *)pkt + len, "%s", op->netascii ? "netascii" : "octet") + 1;
+    if (op->blksize > 0)
+        len += sprintf((char *)pkt + len, "blksize%c%d", 0, op->blksize) + 1;
+    if (op->ventana > 0)
+        len += sprintf((char *)pkt + len, "windowsize%c%d", 0, op->ventana) + 1;
+    if (op->timeout > 0)
+        len += sprintf((char *)pkt + len, "timeout%c%d", 0, op->timeout) + 1;
+    if (op->rollover >= 0)
+        len += sprintf((char *)pkt + len, "rollover%c%d", 0, op->rollover) + 1;
+    if (op->tsize >= 0)
+        len += sprintf((char *)pkt + len, "tsize%c%lld", 0, op->tsize) + 1;
+    if (op->multicast)
+        len += sprintf((char *)pkt + len, "multicast%c", 0) + 1;
+    return len;
+}
+
+void opciones_oack(const uint8_t *buf, size_t n, Acuerdo *a) {
+    const char *p = (const char *)buf + 2;
+    const char *fin = (const char *)buf + n;
+    while (p < fin) {
+        const char *nombre = p;
+        const char *valor = nombre + strnlen(nombre, fin - nombre) + 1;
+        if (valor >= fin)
+            break;
+        if (strcasecmp(nombre, "blksize") == 0)
+            a->blksize = atoi(valor);
+        else if (strcasecmp(nombre, "windowsize") == 0)
+            a->ventana = atoi(valor);
+        else if (strcasecmp(nombre, "tsize") == 0)
+            a->tsize = atoll(valor);
+        else if (strcasecmp(nombre, "rollover") == 0)
+            a->rollover = atoi(valor) == 1;
+        else if (strcasecmp(nombre, "multicast") == 0)
+            a->multicast = valor;
+        p = valor + strnlen(valor, fin - valor) + 1;
+    }
+    if (a->blksize < 8 || a->blksize > BLKSIZE_MAXIMO)
+        a->blksize = BLKSIZE_DEFECTO;
+    if (a->ventana < 1 || a->ventana > VENTANA_MAXIMA)
+        a->ventana = 1;
+}
+
+void opciones_buffer(int sockfd, int blksize, int ventana) {
+    // 65535 bloques de 65468 bytes no entran en un int
+    long long pedido = 2LL * ventana * (4 + blksize);
+    int bytes = pedido > INT_MAX ? INT_MAX : (int)pedido, actual;
+    socklen_t largo = sizeof(actual);
+    // Con bloques chicos el cálculo da menos que el defecto
+    if (ventana > 1 && getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &actual, &largo) == 0 && actual < bytes)
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes));
+}
+
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void enviar_ack(int sockfd, const struct sockaddr_in *destino, uint16_t block) {
+    uint8_t buf[4];
+    uint16_t op_net = htons(4);     // ACK
+    uint16_t block_net = htons(block);
+    memcpy(buf + 0, &op_net, 2);
+    memcpy(buf + 2, &block_net, 2);
+    sendto(sockfd, buf, 4, 0, (const struct sockaddr *)destino, sizeof(*destino));
+}
+
+static unsigned puerto_min = 32768, puertos = 28232;
+static atomic_uint proximo_puerto;
+
+void leer_rango_efimero(void) {
+    unsigned desde, hasta;
+    FILE *f = fopen("/proc/sys/net/ipv4/ip_local_port_range", "r");
+    if (f) {
+        if (fscanf(f, "%u %u", &desde, &hasta) == 2 && desde > 0 && hasta > desde && hasta < 65536) {
+            puerto_min = desde;
+            puertos = hasta - desde + 1;
+        }
+        fclose(f);
+    }
+    // Otra corrida en los últimos segundos no empieza en el mismo lugar
+    atomic_store(&proximo_puerto, (unsigned)time(NULL) * 7919u);
+}
+
+void elegir_puerto(int sockfd) {
+    for (int intento = 0; intento < 64; intento++) {
+        struct sockaddr_in local = { .sin_family = AF_INET };
+        local.sin_port = htons(puerto_min + atomic_fetch_add(&proximo_puerto, 1) % puertos);
+        if (bind(sockfd, (struct sockaddr *)&local, sizeof(local)) == 0)
+            return;
+    }
+}
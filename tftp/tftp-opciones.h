@@ -0,0 +1,84 @@
+/*
+ * Opciones de TFTP del lado de los clientes (RFC 2347).
+ *
+ * cienteV3, tftp-bench y tftp-paralelo arman el RRQ/WRQ con las opciones
+ * que piden, leen las que el servidor acepta en el OACK y agrandan el buffer
+ * de recepción para la ventana acordada; lo hacen igual, con estas funciones.
+ * tftp-bench y tftp-paralelo comparten además el reloj, el ACK y el
+ * recorrido de puertos locales.
+ */
+#ifndef TFTP_OPCIONES_H
+#define TFTP_OPCIONES_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+// Lugar para el modo y las opciones de un pedido
+#define OPCIONES_MAX 128
+
+// Lo que se pide en el RRQ/WRQ
+typedef struct Opciones {
+    int netascii;           // modo "netascii"; si no, "octet"
+    int blksize;            // RFC 2348; 0 = no pedirlo
+    int ventana;            // windowsize (RFC 7440); 0 = no pedirlo
+    int timeout;            // segundos (RFC 2349); 0 = no pedirlo
+    int rollover;           // 0 o 1; -1 = no pedirlo
+    long long tsize;        // RFC 2349; -1 = no pedirlo
+    int multicast;          // RFC 2090
+} Opciones;
+
+/*
+ * Lo aceptado en el OACK. opciones_oack() cambia solo lo que viene en el
+ * paquete: quien llama lo inicializa con lo que tiene en uso.
+ */
+typedef struct Acuerdo {
+    int blksize;
+    int ventana;
+    long long tsize;
+    int rollover;           // 0 o 1 si vino la opción
+    const char *multicast;  // valor de "multicast", dentro del paquete (o NULL)
+} Acuerdo;
+
+/*
+ * Arma [opcode][nombre][0][modo][0] y las opciones pedidas en 'pkt', que
+ * necesita 2 + strlen(nombre) + 1 + OPCIONES_MAX bytes. Devuelve la longitud.
+ */
+size_t opciones_pedido(uint8_t *pkt, uint16_t opcode, const char *nombre, const Opciones *op);
+
+/*
+ * Lee las opciones de un OACK de 'n' bytes. Un blksize o windowsize fuera de
+ * rango vuelve a 512 o a 1.
+ */
+void opciones_oack(const uint8_t *buf, size_t n, Acuerdo *a);
+
+/*
+ * Una ventana de bloques grandes no entra en el buffer de recepción por
+ * defecto (unos 200 KB): se pierde el final de cada ventana y se repite
+ * entera. Se agranda para dos ventanas; el kernel lo limita a rmem_max y
+ * nunca se achica.
+ */
+void opciones_buffer(int sockfd, int blksize, int ventana);
+
+// Nanosegundos de CLOCK_MONOTONIC
+uint64_t monotonic_ns(void);
+
+// ACK del bloque 'block' a 'destino'
+void enviar_ack(int sockfd, const struct sockaddr_in *destino, uint16_t block);
+
+/*
+ * El servidor toma el mismo pedido desde el mismo IP y puerto que una sesión
+ * de hace menos de GRACIA_MS como repetido y lo ignora: todos los RRQ de una
+ * corrida de tftp-bench son iguales y un manifiesto puede bajar dos veces el
+ * mismo archivo. El kernel elige el puerto efímero al azar y con miles de
+ * sesiones por segundo repetiría alguno enseguida, o devolvería el de una
+ * descarga recién cerrada: los sockets recorren el rango efímero en orden.
+ *
+ * leer_rango_efimero() se llama una vez al empezar; elegir_puerto() hace el
+ * bind() de un socket al próximo puerto libre y se puede llamar desde varios
+ * hilos. Si no encuentra uno, lo elige el kernel en el primer sendto().
+ */
+void leer_rango_efimero(void);
+void elegir_puerto(int sockfd);
+
+#endif
@@ -0,0 +1,469 @@
+/*
+ * Proxy UDP que degrada el camino entre un cliente y un servidor TFTP.
+ *
+ * Para probar retransmisiones, ventanas y el RTO sin netem (que pide root):
+ * el cliente le habla al proxy y el proxy al servidor, y en cada sentido
+ * cada datagrama puede perderse, demorarse con jitter, duplicarse o
+ * adelantarse a los demás. Las reglas son las de netem:
+ *
+ *   -p  porcentaje de datagramas que se descartan
+ *   -d  demora fija en ms, más o menos -j ms de jitter (uniforme); con
+ *       jitter los datagramas ya pueden llegar en otro orden
+ *   -u  porcentaje que se manda dos veces (cada copia con su propio jitter)
+ *   -o  porcentaje que sale sin la demora y pasa a los que esperan (solo
+ *       tiene efecto con -d)
+ *
+ * Los TID se respetan: por cada cliente hay un socket hacia el servidor, y
+ * por cada puerto desde el que responde el servidor, un socket hacia el
+ * cliente, así que el cliente ve un TID distinto por sesión como si hablara
+ * con el servidor. Un cliente que no manda nada en FLUJO_INACTIVO_MS se
+ * olvida. Multicast no pasa por el proxy.
+ *
+ *   ./bin/tftp-proxy -p 2 -d 20 -j 5 6969 127.0.0.1 6900
+ *   ./bin/cienteV3 -r -b 1428 -W 16 127.0.0.1 6969 grande.bin
+ */
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#define MAX_DATAGRAMA      65536
+#define MAX_TIDS           8           // puertos del servidor por cliente (sesiones seguidas)
+#define FLUJOS_HASH        4096        // potencia de 2
+#define FLUJO_INACTIVO_MS  10000       // más que la gracia del servidor para pedidos repetidos
+#define MAX_PENDIENTES     (1 << 20)   // datagramas demorados a la vez; los que sobran se pierden
+#define MAX_EVENTOS        256
+
+#define EXTREMO_PRINCIPAL  0           // puerto del proxy al que llegan los pedidos
+#define EXTREMO_ARRIBA     1           // socket de un cliente hacia el servidor
+#define EXTREMO_ABAJO      2           // socket hacia el cliente por un TID del servidor
+
+struct Flujo;
+
+typedef struct Extremo {
+    int fd;
+    int tipo;                       // EXTREMO_*
+    struct Flujo *flujo;
+    struct sockaddr_in tid;         // ABAJO: puerto del servidor al que se reenvía
+} Extremo;
+
+// Un cliente, identificado por IP y puerto de origen
+typedef struct Flujo {
+    struct sockaddr_in cliente;
+    Extremo arriba;
+    Extremo abajo[MAX_TIDS];
+    int n_abajo;
+    int pendientes;                 // datagramas demorados que salen por sus sockets
+    uint64_t ultimo_ns;
+    struct Flujo *siguiente;        // en la cadena de su cubeta
+} Flujo;
+
+// Datagrama demorado: sale por 'fd' hacia 'destino' en 'sale_ns'
+typedef struct Paquete {
+    uint64_t sale_ns;
+    uint64_t orden;                 // a igual hora, el que llegó antes sale antes
+    int fd;
+    struct sockaddr_in destino;
+    Flujo *flujo;
+    size_t len;
+    unsigned char datos[];
+} Paquete;
+
+static double perdida, demora_ms, jitter_ms, duplicado, reorden;
+static struct sockaddr_in servidor;
+static int ep;
+
+static Flujo *flujos[FLUJOS_HASH];
+static int n_flujos = 0;
+
+static Paquete **pendientes;
+static int n_pendientes = 0, cap_pendientes = 0;
+static uint64_t orden = 0;
+
+static uint64_t reenviados, perdidos, duplicados, reordenados, desbordados;
+static volatile sig_atomic_t terminar = 0;
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// xorshift64*: reproducible con -S y más barato que rand() en el camino de cada datagrama
+static uint64_t semilla = 88172645463325252ull;
+
+static double azar(void) {
+    semilla ^= semilla >> 12;
+    semilla ^= semilla << 25;
+    semilla ^= semilla >> 27;
+    return ((semilla * 2685821657736338717ull) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int sucede(double porcentaje) {
+    return porcentaje > 0 && azar() * 100 < porcentaje;
+}
+
+/*
+ * Heap binario de datagramas demorados por (sale_ns, orden), como los
+ * temporizadores del motor epoll del servidor.
+ */
+static int antes(const Paquete *a, const Paquete *b) {
+    return a->sale_ns < b->sale_ns || (a->sale_ns == b->sale_ns && a->orden < b->orden);
+}
+
+static void heap_subir(int pos) {
+    Paquete *p = pendientes[pos];
+    while (pos > 0) {
+        int padre = (pos - 1) / 2;
+        if (!antes(p, pendientes[padre]))
+            break;
+        pendientes[pos] = pendientes[padre];
+        pos = padre;
+    }
+    pendientes[pos] = p;
+}
+
+static void heap_bajar(int pos) {
+    Paquete *p = pendientes[pos];
+    while (1) {
+        int hijo = 2 * pos + 1;
+        if (hijo >= n_pendientes)
+            break;
+        if (hijo + 1 < n_pendientes && antes(pendientes[hijo + 1], pendientes[hijo]))
+            hijo++;
+        if (!antes(pendientes[hijo], p))
+            break;
+        pendientes[pos] = pendientes[hijo];
+        pos = hijo;
+    }
+    pendientes[pos] = p;
+}
+
+static Paquete *heap_sacar(void) {
+    Paquete *p = pendientes[0];
+    pendientes[0] = pendientes[--n_pendientes];
+    if (n_pendientes > 0)
+        heap_bajar(0);
+    return p;
+}
+
+static void enviar(int fd, const struct sockaddr_in *destino, const void *datos, size_t len) {
+    if (sendto(fd, datos, len, 0, (const struct sockaddr *)destino, sizeof(*destino)) < 0)
+        perdidos++; // socket lleno: lo mismo que una pérdida en el camino
+    else
+        reenviados++;
+}
+
+// Demora en ns de una copia: la fija, más el jitter, o nada si se adelanta
+static uint64_t demora(int adelantar) {
+    if (adelantar)
+        return 0;
+    double ms = demora_ms + (jitter_ms > 0 ? (azar() * 2 - 1) * jitter_ms : 0);
+    return ms > 0 ? (uint64_t)(ms * 1e6) : 0;
+}
+
+static void demorar(Flujo *f, int fd, const struct sockaddr_in *destino, const unsigned char *datos,
+                    size_t len, uint64_t espera) {
+    if (n_pendientes == MAX_PENDIENTES) {
+        desbordados++;
+        return;
+    }
+    if (n_pendientes == cap_pendientes) {
+        int cap = cap_pendientes ? 2 * cap_pendientes : 1024;
+        Paquete **nuevo = realloc(pendientes, cap * sizeof(*nuevo));
+        if (!nuevo) {
+            desbordados++;
+            return;
+        }
+        pendientes = nuevo;
+        cap_pendientes = cap;
+    }
+    Paquete *p = malloc(sizeof(Paquete) + len);
+    if (!p) {
+        desbordados++;
+        return;
+    }
+    p->sale_ns = monotonic_ns() + espera;
+    p->orden = orden++;
+    p->fd = fd;
+    p->destino = *destino;
+    p->flujo = f;
+    p->len = len;
+    memcpy(p->datos, datos, len);
+    f->pendientes++;
+    pendientes[n_pendientes++] = p;
+    heap_subir(n_pendientes - 1);
+}
+
+// Aplica las degradaciones a un datagrama que tiene que salir por 'fd' hacia 'destino'
+static void reenviar(Flujo *f, int fd, const struct sockaddr_in *destino, const unsigned char *datos, size_t len) {
+    if (sucede(perdida)) {
+        perdidos++;
+        return;
+    }
+    int copias = sucede(duplicado) ? 2 : 1;
+    if (copias == 2)
+        duplicados++;
+    for (int i = 0; i < copias; i++) {
+        int adelantar = demora_ms > 0 && sucede(reorden);
+        if (adelantar)
+            reordenados++;
+        uint64_t espera = demora(adelantar);
+        // Sin demora ni nada esperando delante, sale ya sin pasar por el heap
+        if (espera == 0 && (n_pendientes == 0 || adelantar))
+            enviar(fd, destino, datos, len);
+        else
+            demorar(f, fd, destino, datos, len, espera);
+    }
+}
+
+static int abrir_extremo(Extremo *e, int tipo, Flujo *f, uint16_t puerto) {
+    e->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (e->fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    struct sockaddr_in local = { .sin_family = AF_INET, .sin_addr.s_addr = INADDR_ANY, .sin_port = htons(puerto) };
+    // Con bloques grandes y ventana, un buffer chico perdería datagramas que no pidió -p
+    int bytes = 4 << 20;
+    setsockopt(e->fd, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes));
+    setsockopt(e->fd, SOL_SOCKET, SO_SNDBUF, &bytes, sizeof(bytes));
+    if (bind(e->fd, (struct sockaddr *)&local, sizeof(local)) < 0) {
+        perror("bind");
+        close(e->fd);
+        return -1;
+    }
+    e->tipo = tipo;
+    e->flujo = f;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = e };
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, e->fd, &ev) < 0) {
+        perror("epoll_ctl");
+        close(e->fd);
+        return -1;
+    }
+    return 0;
+}
+
+static unsigned flujo_hash(const struct sockaddr_in *a) {
+    return ((a->sin_addr.s_addr * 2654435761u) ^ (a->sin_port * 40503u)) & (FLUJOS_HASH - 1);
+}
+
+static Flujo *flujo_buscar(const struct sockaddr_in *cliente, int crear) {
+    unsigned h = flujo_hash(cliente);
+    for (Flujo *f = flujos[h]; f; f = f->siguiente)
+        if (f->cliente.sin_addr.s_addr == cliente->sin_addr.s_addr && f->cliente.sin_port == cliente->sin_port)
+            return f;
+    if (!crear)
+        return NULL;
+
+    Flujo *f = calloc(1, sizeof(Flujo));
+    if (!f)
+        return NULL;
+    f->cliente = *cliente;
+    if (abrir_extremo(&f->arriba, EXTREMO_ARRIBA, f, 0) < 0) {
+        free(f);
+        return NULL;
+    }
+    f->siguiente = flujos[h];
+    flujos[h] = f;
+    n_flujos++;
+    return f;
+}
+
+// Socket hacia el cliente para el TID 'tid' del servidor; si ya hay MAX_TIDS, se recicla el más viejo
+static Extremo *abajo_para(Flujo *f, const struct sockaddr_in *tid) {
+    for (int i = 0; i < f->n_abajo && i < MAX_TIDS; i++)
+        if (f->abajo[i].tid.sin_addr.s_addr == tid->sin_addr.s_addr && f->abajo[i].tid.sin_port == tid->sin_port)
+            return &f->abajo[i];
+
+    Extremo *e = &f->abajo[f->n_abajo % MAX_TIDS];
+    if (f->n_abajo >= MAX_TIDS) {
+        if (f->pendientes > 0)
+            return NULL; // su socket puede tener datagramas demorados: se pierde este
+        close(e->fd);
+    }
+    if (abrir_extremo(e, EXTREMO_ABAJO, f, 0) < 0)
+        return NULL;
+    e->tid = *tid;
+    f->n_abajo++;
+    return e;
+}
+
+static void flujo_cerrar(Flujo **enlace) {
+    Flujo *f = *enlace;
+    *enlace = f->siguiente;
+    close(f->arriba.fd);
+    for (int i = 0; i < f->n_abajo && i < MAX_TIDS; i++)
+        close(f->abajo[i].fd);
+    free(f);
+    n_flujos--;
+}
+
+// Olvida los clientes inactivos sin datagramas demorados
+static void flujos_purgar(uint64_t ahora) {
+    for (int h = 0; h < FLUJOS_HASH; h++) {
+        Flujo **enlace = &flujos[h];
+        while (*enlace) {
+            Flujo *f = *enlace;
+            if (f->pendientes == 0 && ahora - f->ultimo_ns > (uint64_t)FLUJO_INACTIVO_MS * 1000000)
+                flujo_cerrar(enlace);
+            else
+                enlace = &f->siguiente;
+        }
+    }
+}
+
+// Lee todo lo que hay en el socket del extremo y lo reenvía del otro lado
+static void atender(Extremo *e, unsigned char *buf) {
+    struct sockaddr_in origen;
+    while (1) {
+        socklen_t origen_len = sizeof(origen);
+        ssize_t n = recvfrom(e->fd, buf, MAX_DATAGRAMA, 0, (struct sockaddr *)&origen, &origen_len);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EINTR && errno != ECONNREFUSED)
+                perror("recvfrom");
+            return;
+        }
+        uint64_t ahora = monotonic_ns();
+
+        if (e->tipo == EXTREMO_PRINCIPAL) {
+            // Pedido nuevo (o repetido): al puerto principal del servidor
+            Flujo *f = flujo_buscar(&origen, 1);
+            if (!f)
+                continue;
+            f->ultimo_ns = ahora;
+            reenviar(f, f->arriba.fd, &servidor, buf, n);
+        } else if (e->tipo == EXTREMO_ARRIBA) {
+            // Del servidor: al cliente desde el socket que representa ese TID
+            Flujo *f = e->flujo;
+            Extremo *abajo = abajo_para(f, &origen);
+            if (abajo)
+                reenviar(f, abajo->fd, &f->cliente, buf, n);
+        } else {
+            // Del cliente a un TID: solo desde el cliente dueño del flujo
+            Flujo *f = e->flujo;
+            if (origen.sin_addr.s_addr != f->cliente.sin_addr.s_addr || origen.sin_port != f->cliente.sin_port)
+                continue;
+            f->ultimo_ns = ahora;
+            reenviar(f, f->arriba.fd, &e->tid, buf, n);
+        }
+    }
+}
+
+static void al_terminar(int sig) {
+    (void)sig;
+    terminar = 1;
+}
+
+static void uso(const char *prog) {
+    fprintf(stderr,
+            "Uso: %s [-p pérdida%%] [-d demora_ms] [-j jitter_ms] [-u duplicados%%] [-o reorden%%] [-S semilla]\n"
+            "       <puerto-local> <IP-servidor> <puerto-servidor>\n"
+            "  -p  porcentaje de datagramas descartados, en cada sentido\n"
+            "  -d  demora fija en ms; -j  jitter en ms (uniforme, +-)\n"
+            "  -u  porcentaje de datagramas duplicados\n"
+            "  -o  porcentaje que sale sin la demora, antes que los que esperan\n"
+            "  -S  semilla para repetir la misma secuencia de degradaciones\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+
+    semilla ^= (uint64_t)time(NULL) * 0x9e3779b97f4a7c15ull ^ (uint64_t)getpid();
+    while ((c = getopt(argc, argv, "p:d:j:u:o:S:")) != -1) {
+        switch (c) {
+        case 'p':
+            perdida = atof(optarg);
+            break;
+        case 'd':
+            demora_ms = atof(optarg);
+            break;
+        case 'j':
+            jitter_ms = atof(optarg);
+            break;
+        case 'u':
+            duplicado = atof(optarg);
+            break;
+        case 'o':
+            reorden = atof(optarg);
+            break;
+        case 'S':
+            semilla = strtoull(optarg, NULL, 10) | 1; // xorshift no sale nunca del 0
+            break;
+        default:
+            uso(argv[0]);
+        }
+    }
+    if (argc - optind != 3 || perdida < 0 || perdida > 100 || demora_ms < 0 || jitter_ms < 0 ||
+        duplicado < 0 || duplicado > 100 || reorden < 0 || reorden > 100)
+        uso(argv[0]);
+
+    memset(&servidor, 0, sizeof(servidor));
+    servidor.sin_family = AF_INET;
+    servidor.sin_port = htons(atoi(argv[optind + 2]));
+    if (inet_aton(argv[optind + 1], &servidor.sin_addr) == 0) {
+        fprintf(stderr, "IP inválida: %s\n", argv[optind + 1]);
+        exit(EXIT_FAILURE);
+    }
+
+    ep = epoll_create1(0);
+    if (ep < 0) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+    Extremo principal;
+    if (abrir_extremo(&principal, EXTREMO_PRINCIPAL, NULL, atoi(argv[optind])) < 0)
+        exit(EXIT_FAILURE);
+
+    struct sigaction sa = { .sa_handler = al_terminar };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    printf("Proxy en puerto %s hacia %s:%s: pérdida %.2f%%, demora %.1f ms +- %.1f, duplicados %.2f%%, reorden %.2f%%\n",
+           argv[optind], argv[optind + 1], argv[optind + 2], perdida, demora_ms, jitter_ms, duplicado, reorden);
+    fflush(stdout);
+
+    static unsigned char buf[MAX_DATAGRAMA];
+    struct epoll_event eventos[MAX_EVENTOS];
+    uint64_t purga_ns = monotonic_ns();
+    while (!terminar) {
+        // Despierta para el próximo datagrama demorado, o cada segundo para purgar
+        uint64_t ahora = monotonic_ns();
+        int espera = 1000;
+        if (n_pendientes > 0)
+            espera = pendientes[0]->sale_ns > ahora ? (int)((pendientes[0]->sale_ns - ahora + 999999) / 1000000) : 0;
+        int n = epoll_wait(ep, eventos, MAX_EVENTOS, espera);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++)
+            atender(eventos[i].data.ptr, buf);
+
+        ahora = monotonic_ns();
+        while (n_pendientes > 0 && pendientes[0]->sale_ns <= ahora) {
+            Paquete *p = heap_sacar();
+            enviar(p->fd, &p->destino, p->datos, p->len);
+            p->flujo->pendientes--;
+            free(p);
+        }
+        if (ahora - purga_ns > 1000000000ull) {
+            flujos_purgar(ahora);
+            purga_ns = ahora;
+        }
+    }
+
+    printf("%llu reenviados, %llu perdidos, %llu duplicados, %llu reordenados, %llu desbordados; %d clientes\n",
+           (unsigned long long)reenviados, (unsigned long long)perdidos, (unsigned long long)duplicados,
+           (unsigned long long)reordenados, (unsigned long long)desbordados, n_flujos);
+    return 0;
+}
@@ -0,0 +1,1481 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/udp.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "tftp-sesion.h"
+#include "tftp-cache.h"
+#include "tftp-multicast.h"
+#include "tftp-metricas.h"
+#include "tftp-netascii.h"
+#include "registro.h"
+
+int blksize_max = MAX_BLKSIZE;
+int usar_offload = 0;
+int politica_fsync = FSYNC_FINAL;
+int rollover_defecto = 0;
+
+/*
+ * Un archivo mapeado que se trunca mientras se sirve da SIGBUS al leer las
+ * páginas que ya no tiene, y el proceso moriría con todas sus sesiones. Las
+ * lecturas del mapeo que hace el programa (la traducción netascii) se hacen
+ * con 'salto_mapa' armado: el manejador vuelve ahí y esa sesión termina con
+ * un ERROR. Las que hace el kernel al enviar un DATA octet fallan con EFAULT.
+ */
+#define TRUNCADO (-2)              // armar_bloque(): el archivo se achicó
+
+static __thread sigjmp_buf *salto_mapa;
+static pthread_once_t sigbus_instalado = PTHREAD_ONCE_INIT;
+
+static void al_sigbus(int sig) {
+    if (salto_mapa)
+        siglongjmp(*salto_mapa, 1);
+    // Fuera de una lectura del mapeo: lo de siempre
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static void instalar_sigbus(void) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = al_sigbus;
+    // Se sale con siglongjmp() sin restaurar la máscara: SIGBUS no puede quedar bloqueada
+    sa.sa_flags = SA_NODEFER;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, NULL);
+}
+
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int crear_socket_sesion(uint16_t puerto) {
+    int sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (sock < 0) {
+        reg_errno("socket sesion");
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(puerto);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        reg_errno("bind sesion");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/*
+ * Número de bloque en el cable. Los bloques se cuentan en 64 bits y viajan
+ * en 16: pasado el 65535 siguen desde s->rollover. El 0 solo aparece al
+ * principio (el ACK del OACK o del WRQ), así que con rollover 1 los números
+ * dan vueltas de 65535 bloques.
+ */
+static uint16_t en_cable(const Sesion *s, uint64_t n) {
+    if (n <= UINT16_MAX || s->rollover == 0)
+        return (uint16_t)n;
+    return (uint16_t)(1 + (n - 1) % UINT16_MAX);
+}
+
+// Bloques desde 'desde' hasta el primero, sin ir para atrás, que viaja como 'w'
+static uint64_t adelante(const Sesion *s, uint64_t desde, uint16_t w) {
+    if (s->rollover == 0)
+        return (uint16_t)(w - (uint16_t)desde);
+    if (desde == 0)
+        return w;
+    if (w == 0)
+        return UINT64_MAX; // el 0 ya pasó
+    return (w - en_cable(s, desde) + UINT16_MAX) % UINT16_MAX;
+}
+
+// Distancia con signo del bloque que viaja como 'w' al bloque 'n'
+static int distancia(const Sesion *s, uint16_t w, uint64_t n) {
+    int d = (int)w - en_cable(s, n);
+    if (s->rollover == 0)
+        return (int16_t)d;
+    if (d > INT16_MAX)
+        d -= UINT16_MAX;
+    else if (d < -INT16_MAX)
+        d += UINT16_MAX;
+    return d;
+}
+
+static void rearmar(Sesion *s) {
+    s->vence_ns = monotonic_ns() + s->rto_ns;
+}
+
+// Empieza a cronometrar el paquete 'marca' si no hay otra medición en curso
+static void cronometrar(Sesion *s, uint64_t marca) {
+    if (s->midiendo)
+        return;
+    s->midiendo = 1;
+    s->marca = marca;
+    s->marca_ns = monotonic_ns();
+}
+
+// Llegó la respuesta al paquete cronometrado: actualiza srtt, rttvar y rto
+static void medir_rtt(Sesion *s) {
+    uint64_t r = monotonic_ns() - s->marca_ns;
+    s->midiendo = 0;
+
+    if (s->srtt_ns == 0) {
+        s->srtt_ns = r;
+        s->rttvar_ns = r / 2;
+    } else {
+        uint64_t dif = s->srtt_ns > r ? s->srtt_ns - r : r - s->srtt_ns;
+        s->rttvar_ns = (3 * s->rttvar_ns + dif) / 4;
+        s->srtt_ns = (7 * s->srtt_ns + r) / 8;
+    }
+    // Con la opción timeout el cliente fijó cuánto esperar: no se adapta
+    if (s->timeout)
+        return;
+
+    // La granularidad del reloj es de 1 ms (poll/epoll_wait)
+    uint64_t var = 4 * s->rttvar_ns > 1000000 ? 4 * s->rttvar_ns : 1000000;
+    s->rto_ns = s->srtt_ns + var;
+    if (s->rto_ns < (uint64_t)RTO_MIN_MS * 1000000)
+        s->rto_ns = (uint64_t)RTO_MIN_MS * 1000000;
+    if (s->rto_ns > (uint64_t)RTO_MAX_MS * 1000000)
+        s->rto_ns = (uint64_t)RTO_MAX_MS * 1000000;
+}
+
+/*
+ * Paquete de control (OACK, ACK, ERROR) para el cliente. El socket de un
+ * grupo multicast no está conectado: se manda al maestro.
+ */
+static ssize_t enviar_control(Sesion *s, const void *buf, size_t len) {
+    if (s->grupo)
+        return sendto(s->sock, buf, len, 0, (const struct sockaddr *)&s->cliente, sizeof(s->cliente));
+    return send(s->sock, buf, len, 0);
+}
+
+// Envía (o reenvía) el último paquete armado y rearma el temporizador
+static void transmitir(Sesion *s) {
+    if (enviar_control(s, s->paquete, s->paquete_len) < 0) {
+        if (errno != EAGAIN)
+            reg_errno("send");
+    } else {
+        s->enviados++;
+        s->envios++;
+    }
+    rearmar(s);
+}
+
+static void send_error(Sesion *s, uint16_t code, const char *msg) {
+    unsigned char err_buf[4 + 64];
+    uint16_t op_net = htons(OPCODE_ERROR);
+    uint16_t code_net = htons(code);
+    size_t msg_len = strlen(msg);
+    s->resultado = FIN_ERROR;
+    s->codigo_error = code;
+    memcpy(err_buf + 0, &op_net, 2);
+    memcpy(err_buf + 2, &code_net, 2);
+    memcpy(err_buf + 4, msg, msg_len + 1);
+    enviar_control(s, err_buf, 4 + msg_len + 1);
+}
+
+static void send_ack(Sesion *s, uint16_t block) {
+    uint16_t op_net = htons(OPCODE_ACK);
+    uint16_t block_net = htons(block);
+    memcpy(s->paquete + 0, &op_net, 2);
+    memcpy(s->paquete + 2, &block_net, 2);
+    s->paquete_len = 4;
+    transmitir(s);
+}
+
+/*
+ * netascii: el bloque 'n' se traduce desde donde terminó el n-1, a
+ * continuación de la cabecera. Los cortes de los bloques entre el primero sin
+ * confirmar y el siguiente a enviar están en s->cortes (ventana + 1 lugares),
+ * así que retroceder es volver a traducir desde un corte guardado.
+ */
+static int traducir_bloque(Sesion *s, uint64_t n, unsigned char *pkt, size_t len) {
+    Corte *c = &s->cortes[n % (s->ventana + 1)];
+    if (c->bloque != n) {
+        reg_error("%s: bloque %llu fuera de los cortes guardados", s->archivo, (unsigned long long)n);
+        return -1;
+    }
+
+    // Un byte del archivo da al menos uno en el cable: con blksize bytes alcanza
+    const unsigned char *texto;
+    size_t disponible = c->entrada < s->tamano ? s->tamano - c->entrada : 0;
+    if (disponible > (size_t)s->blksize)
+        disponible = s->blksize;
+    if (s->mapa) {
+        texto = s->mapa + c->entrada;
+    } else {
+        ssize_t r = pread(s->fd, s->crudo, disponible, c->entrada);
+        if (r < 0) {
+            reg_errno("pread");
+            return -1;
+        }
+        texto = s->crudo;
+        disponible = r;
+    }
+
+    size_t leidos, hecho;
+    int mitad = c->mitad;
+    if (s->mapa) {
+        sigjmp_buf salto;
+        if (sigsetjmp(salto, 0)) {
+            salto_mapa = NULL;
+            return TRUNCADO;
+        }
+        salto_mapa = &salto;
+        hecho = netascii_codificar(texto, disponible, pkt + 4, len, &leidos, &mitad);
+        salto_mapa = NULL;
+    } else {
+        hecho = netascii_codificar(texto, disponible, pkt + 4, len, &leidos, &mitad);
+    }
+    Corte *prox = &s->cortes[(n + 1) % (s->ventana + 1)];
+    prox->bloque = n + 1;
+    prox->entrada = c->entrada + leidos;
+    prox->mitad = mitad;
+
+    // Cada byte del archivo da al menos uno: un bloque corto agotó el archivo
+    if (hecho < len && s->total_bloques == UINT64_MAX) {
+        s->total_bloques = n;
+        s->largo = (off_t)(n - 1) * s->blksize + hecho;
+    }
+    return hecho;
+}
+
+/*
+ * Arma el DATA del bloque 'n' como dos iovec: la cabecera en 'pkt' y los
+ * datos. Con el archivo mapeado los datos se apuntan directo en el mapeo, sin
+ * copiarlos; si no, o en netascii, van en 'pkt' a continuación de la cabecera.
+ */
+static int armar_bloque(Sesion *s, uint64_t n, unsigned char *pkt, struct iovec iov[2]) {
+    off_t offset = (off_t)(n - 1) * s->blksize;
+    size_t len = offset < s->largo ? s->largo - offset : 0;
+    if (len > (size_t)s->blksize)
+        len = s->blksize;
+
+    uint16_t op_net = htons(OPCODE_DATA);
+    uint16_t block_net = htons(en_cable(s, n));
+    memcpy(pkt + 0, &op_net, 2);
+    memcpy(pkt + 2, &block_net, 2);
+    iov[0].iov_base = pkt;
+    iov[0].iov_len = 4;
+
+    if (s->netascii) {
+        int hecho = traducir_bloque(s, n, pkt, s->blksize);
+        if (hecho < 0)
+            return hecho;
+        iov[1].iov_base = pkt + 4;
+        iov[1].iov_len = hecho;
+        return 0;
+    }
+    if (s->mapa) {
+        iov[1].iov_base = s->mapa + offset;
+        iov[1].iov_len = len;
+        return 0;
+    }
+    ssize_t bytes_read = pread(s->fd, pkt + 4, len, offset);
+    if (bytes_read < 0) {
+        reg_errno("pread");
+        return -1;
+    }
+    iov[1].iov_base = pkt + 4;
+    iov[1].iov_len = bytes_read;
+    return 0;
+}
+
+/*
+ * Manda los 'n' DATA del lote con un solo sendmsg() y UDP_SEGMENT: el kernel
+ * concatena los iovec y corta segmentos de 4 + blksize, que es lo que mide
+ * cada DATA salvo, quizás, el último. Devuelve -1 si no soporta GSO, TRUNCADO
+ * si el mapeo ya no tiene los datos y 0 si no.
+ */
+static int enviar_gso(Sesion *s, struct iovec *iov, int n) {
+    char control[CMSG_SPACE(sizeof(uint16_t))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg = {
+        .msg_iov = iov, .msg_iovlen = 2 * n,
+        .msg_control = control, .msg_controllen = sizeof(control),
+    };
+    if (s->grupo) {
+        msg.msg_name = &s->grupo->direccion;
+        msg.msg_namelen = sizeof(s->grupo->direccion);
+    }
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_UDP;
+    cm->cmsg_type = UDP_SEGMENT;
+    cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    uint16_t segmento = 4 + s->blksize;
+    memcpy(CMSG_DATA(cm), &segmento, sizeof(segmento));
+
+    if (sendmsg(s->sock, &msg, 0) < 0) {
+        if (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP) {
+            reg_aviso("UDP GSO no disponible (%s), se sigue sin offload", strerror(errno));
+            usar_offload = 0;
+            s->gso = 0;
+            return -1;
+        }
+        if (errno == EFAULT)
+            return TRUNCADO;
+        if (errno != EAGAIN)
+            reg_errno("sendmsg GSO");
+        return 0;
+    }
+    s->envios++;
+    s->enviados += n;
+    return 0;
+}
+
+/*
+ * Manda los 'n' DATA armados; si el socket se llena, el resto lo recupera el
+ * RTO. Devuelve TRUNCADO si el kernel no pudo leer los datos del mapeo
+ * (EFAULT: el archivo se achicó) y 0 si no.
+ */
+static int enviar_lote(Sesion *s, struct mmsghdr *msgs, struct iovec *iov, int n) {
+    int hechos = 0;
+    // Un solo DATA (stop-and-wait): sendmsg() cuesta menos que armar un sendmmsg()
+    if (n == 1) {
+        if (sendmsg(s->sock, &msgs[0].msg_hdr, 0) < 0) {
+            if (errno == EFAULT)
+                return TRUNCADO;
+            if (errno != EAGAIN)
+                reg_errno("sendmsg");
+            return 0;
+        }
+        s->envios++;
+        s->enviados++;
+        return 0;
+    }
+    if (s->gso) {
+        int r = enviar_gso(s, iov, n);
+        if (r >= 0 || r == TRUNCADO)
+            return r;
+    }
+    while (hechos < n) {
+        int r = sendmmsg(s->sock, msgs + hechos, n - hechos, 0);
+        if (r < 0) {
+            if (errno == EFAULT)
+                return TRUNCADO;
+            if (errno != EAGAIN)
+                reg_errno("sendmmsg");
+            return 0;
+        }
+        s->envios++;
+        s->enviados += r;
+        hechos += r;
+    }
+    return 0;
+}
+
+// El archivo se truncó mientras se servía: no se puede seguir
+static int archivo_truncado(Sesion *s) {
+    reg_error("%s: el archivo se truncó mientras se enviaba", s->archivo);
+    send_error(s, TFTP_ERR_UNDEFINED, "File truncated");
+    return SESION_FIN;
+}
+
+/*
+ * Envía los bloques que faltan de la ventana, desde s->siguiente hasta
+ * s->bloque + ventana - 1 (o el último del archivo), de a lote_slots por
+ * sendmmsg(), y rearma el temporizador.
+ */
+static int enviar_ventana(Sesion *s) {
+    // Con GSO el lote puede tener hasta MAX_SEGMENTOS DATA (más que LOTE)
+    struct mmsghdr msgs[MAX_SEGMENTOS];
+    struct iovec iov[2 * MAX_SEGMENTOS];
+    unsigned char cabeceras[MAX_SEGMENTOS][4];
+    int n = 0;
+
+    while (s->siguiente < s->bloque + s->ventana && s->siguiente <= s->total_bloques) {
+        // Mapeado solo hace falta la cabecera; si no, el slot del lote entero
+        unsigned char *pkt = cabeceras[n];
+        if (!s->mapa || s->netascii)
+            pkt = (s->lote ? s->lote : s->paquete) + (size_t)n * (4 + s->blksize);
+        int r = armar_bloque(s, s->siguiente, pkt, &iov[2 * n]);
+        if (r == TRUNCADO)
+            return archivo_truncado(s);
+        if (r < 0) {
+            send_error(s, TFTP_ERR_ACCESS, "Read error");
+            return SESION_FIN;
+        }
+        memset(&msgs[n], 0, sizeof(msgs[n]));
+        msgs[n].msg_hdr.msg_iov = &iov[2 * n];
+        msgs[n].msg_hdr.msg_iovlen = 2;
+        if (s->grupo) {
+            // Multicast: los DATA van a la dirección del grupo, no al maestro
+            msgs[n].msg_hdr.msg_name = &s->grupo->direccion;
+            msgs[n].msg_hdr.msg_namelen = sizeof(s->grupo->direccion);
+        }
+
+        if (s->siguiente > s->maximo) {
+            s->maximo = s->siguiente;
+            cronometrar(s, s->siguiente);
+        } else if (s->midiendo && s->siguiente == s->marca) {
+            s->midiendo = 0; // Karn: el bloque cronometrado se reenvió
+        }
+        s->siguiente++;
+
+        if (++n == s->lote_slots) {
+            if (enviar_lote(s, msgs, iov, n) == TRUNCADO)
+                return archivo_truncado(s);
+            n = 0;
+        }
+    }
+    if (n > 0 && enviar_lote(s, msgs, iov, n) == TRUNCADO)
+        return archivo_truncado(s);
+    rearmar(s);
+    return SESION_SIGUE;
+}
+
+// Abre y mapea el archivo de la sesión cuando no está en la caché
+static int abrir_archivo(Sesion *s) {
+    s->fd = open(s->archivo, O_RDONLY);
+    if (s->fd < 0) {
+        send_error(s, TFTP_ERR_NOTFOUND, "File not found");
+        return SESION_FIN;
+    }
+
+    struct stat st;
+    if (fstat(s->fd, &st) < 0) {
+        send_error(s, TFTP_ERR_ACCESS, "Access violation");
+        return SESION_FIN;
+    }
+    s->tamano = st.st_size;
+
+    /*
+     * Se sirve desde un mapeo de solo lectura: los DATA apuntan a las páginas
+     * del page cache y no se copia nada en espacio de usuario. Si el archivo
+     * se trunca mientras se sirve, la sesión termina con un ERROR (ver
+     * al_sigbus()). Si no se puede mapear, se usa pread().
+     */
+    if (s->tamano > 0) {
+        s->mapa = mmap(NULL, s->tamano, PROT_READ, MAP_SHARED, s->fd, 0);
+        if (s->mapa == MAP_FAILED)
+            s->mapa = NULL;
+        else
+            madvise(s->mapa, s->tamano, MADV_SEQUENTIAL);
+    }
+    if (!s->mapa)
+        posix_fadvise(s->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return SESION_SIGUE;
+}
+
+/*
+ * netascii: el texto crece al traducirlo, así que el largo en el cable no se
+ * sabe hasta armar el último bloque (lo anota traducir_bloque()); contarlo
+ * antes obligaría a recorrer el archivo entero al recibir el pedido. Prepara
+ * el primer corte.
+ */
+static int preparar_netascii(Sesion *s) {
+    if (!s->mapa) {
+        // Sin mapeo, cada bloque se lee acá antes de traducirlo
+        s->crudo = malloc(s->blksize);
+        if (!s->crudo)
+            return -1;
+    }
+    s->cortes = calloc(s->ventana + 1, sizeof(Corte));
+    if (!s->cortes)
+        return -1;
+    s->cortes[1 % (s->ventana + 1)].bloque = 1;
+    s->total_bloques = UINT64_MAX;
+    return 0;
+}
+
+//Read Request
+static int tftp_rrq(Sesion *s) {
+    reg_info("Received RRQ for file: %s, mode: %s", s->archivo, s->modo);
+
+    // Un archivo caliente ya está mapeado: se comparte sin abrirlo de nuevo
+    s->cacheado = cache_tomar(s->archivo);
+    if (s->cacheado) {
+        s->mapa = s->cacheado->mapa;
+        s->tamano = s->cacheado->tamano;
+    } else if (abrir_archivo(s) == SESION_FIN) {
+        return SESION_FIN;
+    }
+    if (s->mapa)
+        pthread_once(&sigbus_instalado, instalar_sigbus);
+    // El largo fija cuál es el último bloque: el primero con menos de blksize bytes
+    s->largo = s->tamano;
+    s->total_bloques = s->largo / s->blksize + 1;
+    if (s->netascii && preparar_netascii(s) < 0) {
+        send_error(s, TFTP_ERR_ACCESS, "Read error");
+        return SESION_FIN;
+    }
+    /*
+     * En netascii el tamaño no se sabe de antemano, y un OACK lleno de otras
+     * opciones puede no tener lugar: RFC 2349 permite omitirlo. Si era lo
+     * único pedido, un OACK vacío no hace falta.
+     */
+    if (s->tsize == 0 && (s->netascii || sesion_oack_opcion(s, "tsize", "%lld", (long long)s->largo) < 0) &&
+        s->paquete_len == 2)
+        s->oack = 0;
+
+    /*
+     * Con ventana, los DATA de un sendmmsg necesitan cada uno su buffer. Con
+     * GSO el lote es un único datagrama de hasta 64 KB, así que el tope es
+     * otro; si no entran al menos dos bloques no tiene sentido.
+     */
+    int tope = LOTE;
+    size_t bytes = LOTE_BYTES;
+    if (usar_offload && MAX_GSO_BYTES / (4 + s->blksize) > 1) {
+        tope = MAX_SEGMENTOS;
+        bytes = MAX_GSO_BYTES;
+        s->gso = 1;
+    }
+    s->lote_slots = s->ventana < tope ? s->ventana : tope;
+    if ((size_t)s->lote_slots > bytes / (4 + s->blksize))
+        s->lote_slots = bytes / (4 + s->blksize);
+    if (s->lote_slots > 1 && (!s->mapa || s->netascii)) {
+        s->lote = malloc((size_t)s->lote_slots * (4 + s->blksize));
+        if (!s->lote) {
+            s->lote_slots = 1;
+            s->gso = 0;
+        }
+    }
+    if (s->lote_slots == 1)
+        s->gso = 0;
+
+    /*
+     * Sin rollover: los que se suman tarde ubican cada bloque por su número.
+     * En netascii un bloque solo se arma después del anterior, y el grupo
+     * salta a cualquiera: se sirve por unicast.
+     */
+    if (s->multicast && !s->netascii && s->total_bloques <= UINT16_MAX) {
+        int r = multicast_rrq(s);
+        if (r >= 0)
+            return r;
+    }
+
+    s->reintentos = 0;
+    if (s->oack) {
+        // Primero el OACK; el DATA 1 sale cuando el cliente lo confirme con ACK 0
+        cronometrar(s, 0);
+        transmitir(s);
+        return SESION_SIGUE;
+    }
+    s->bloque = s->siguiente = 1;
+    return enviar_ventana(s);
+}
+
+// Escribe una tanda en 'inicio' y la fuerza al disco según la política
+static int escribir_tanda(int fd, const unsigned char *buf, size_t len, off_t inicio) {
+    size_t hecho = 0;
+
+    while (hecho < len) {
+        ssize_t r = pwrite(fd, buf + hecho, len - hecho, inicio + hecho);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            reg_errno("pwrite");
+            return -1;
+        }
+        hecho += r;
+    }
+    if (len > 0 && politica_fsync == FSYNC_LOTE) {
+        if (fdatasync(fd) < 0) {
+            reg_errno("fdatasync");
+            return -1;
+        }
+    } else if (len > 0 && politica_fsync == FSYNC_FINAL) {
+        // Arranca la escritura al disco sin esperarla: el fsync final tendrá menos que hacer
+        sync_file_range(fd, inicio, len, SYNC_FILE_RANGE_WRITE);
+    }
+    return 0;
+}
+
+/*
+ * Baja al archivo lo acumulado en s->escritura. Salvo al final, solo la
+ * parte múltiplo de 4 KB: así cada tanda empieza alineada a página y el
+ * resto queda al principio del buffer para la próxima.
+ */
+static int volcar(Sesion *s, int todo) {
+    size_t len = todo ? s->pendiente : s->pendiente & ~(size_t)4095;
+    if (escribir_tanda(s->fd, s->escritura, len, s->offset - s->pendiente) < 0)
+        return -1;
+    s->pendiente -= len;
+    memmove(s->escritura, s->escritura + len, s->pendiente);
+    return 0;
+}
+
+static void sincronizar_directorio(const char *archivo) {
+    char dir[MAX_NOMBRE];
+    const char *barra = strrchr(archivo, '/');
+    if (barra)
+        snprintf(dir, sizeof(dir), "%.*s", (int)(barra - archivo) + 1, archivo);
+    else
+        strcpy(dir, ".");
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/*
+ * Con todo escrito: fuerza al disco según la política y pone el temporal en
+ * su lugar sin pisar un archivo que haya aparecido mientras tanto. Devuelve
+ * 0 o el código de ERROR para el cliente.
+ */
+static int cerrar_archivo(Sesion *s) {
+    if (politica_fsync != FSYNC_NUNCA && fsync(s->fd) < 0) {
+        reg_errno("fsync");
+        return TFTP_ERR_DISKFULL;
+    }
+    if (renameat2(AT_FDCWD, s->temporal, AT_FDCWD, s->archivo, RENAME_NOREPLACE) < 0) {
+        if (errno != EINVAL && errno != ENOSYS)
+            return errno == EEXIST ? TFTP_ERR_EXISTS : TFTP_ERR_ACCESS;
+        // Sin RENAME_NOREPLACE en este sistema de archivos: link() tampoco pisa
+        if (link(s->temporal, s->archivo) < 0)
+            return errno == EEXIST ? TFTP_ERR_EXISTS : TFTP_ERR_ACCESS;
+        unlink(s->temporal);
+    }
+    s->temporal[0] = '\0';
+    if (politica_fsync != FSYNC_NUNCA)
+        sincronizar_directorio(s->archivo);
+    return 0;
+}
+
+/*
+ * Hilo escritor del motor epoll. Cada WRQ tiene dos buffers: mientras el
+ * hilo baja uno (s->volcando) la sesión sigue llenando el otro y
+ * confirmando desde memoria, así un disco lento no frena el bucle que
+ * atiende a todas las sesiones. Hay una tanda por sesión a la vez; las
+ * terminadas se avisan por un eventfd y el motor las entrega a
+ * sesion_escrita() en su hilo.
+ */
+int escritura_diferida = 0;
+
+static pthread_mutex_t escritor_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t escritor_hay = PTHREAD_COND_INITIALIZER;     // tandas en la cola
+static pthread_cond_t escritor_listo = PTHREAD_COND_INITIALIZER;   // terminó una tanda
+static Sesion *escritor_cola, *escritor_ultima;                    // por orden de llegada
+static Sesion *escritor_hechas;
+static int escritor_evento = -1;
+
+static void *escritor(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&escritor_mutex);
+        while (!escritor_cola)
+            pthread_cond_wait(&escritor_hay, &escritor_mutex);
+        Sesion *s = escritor_cola;
+        escritor_cola = s->sig_escritor;
+        pthread_mutex_unlock(&escritor_mutex);
+
+        // Mientras la tanda está acá, la sesión no toca el buffer, el archivo ni el temporal
+        int error = escribir_tanda(s->fd, s->volcando, s->volcando_len, s->volcando_inicio) < 0 ?
+                    TFTP_ERR_DISKFULL : 0;
+        if (!error && s->volcando_final)
+            error = cerrar_archivo(s);
+
+        pthread_mutex_lock(&escritor_mutex);
+        s->volcando_error = error;
+        s->escrita = 1;
+        s->sig_escritor = escritor_hechas;
+        escritor_hechas = s;
+        pthread_cond_broadcast(&escritor_listo);
+        pthread_mutex_unlock(&escritor_mutex);
+        uint64_t uno = 1;
+        if (write(escritor_evento, &uno, sizeof(uno)) < 0)
+            reg_errno("write eventfd");
+    }
+    return NULL;
+}
+
+int sesion_escritor(void) {
+    escritor_evento = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (escritor_evento < 0) {
+        reg_errno("eventfd");
+        return -1;
+    }
+    pthread_t hilo;
+    if (pthread_create(&hilo, NULL, escritor, NULL) != 0) {
+        reg_aviso("No se pudo crear el hilo escritor: los WRQ escriben en el bucle");
+        close(escritor_evento);
+        escritor_evento = -1;
+        return -1;
+    }
+    pthread_detach(hilo);
+    escritura_diferida = 1;
+    return escritor_evento;
+}
+
+/*
+ * Pasa al hilo escritor lo acumulado: la parte alineada, o todo si es el
+ * final. El resto sigue en el otro buffer, que pasa a ser s->escritura.
+ */
+static void diferir(Sesion *s, int final) {
+    size_t len = final ? s->pendiente : s->pendiente & ~(size_t)4095;
+    unsigned char *lleno = s->escritura;
+    s->pendiente -= len;
+    memcpy(s->volcando, lleno + len, s->pendiente);
+    s->escritura = s->volcando;
+    s->volcando = lleno;
+    s->volcando_len = len;
+    s->volcando_inicio = s->offset - s->pendiente - len;
+    s->volcando_final = final;
+    s->en_escritor = 1;
+
+    pthread_mutex_lock(&escritor_mutex);
+    s->escrita = 0;
+    s->sig_escritor = NULL;
+    if (escritor_cola)
+        escritor_ultima->sig_escritor = s;
+    else
+        escritor_cola = s;
+    escritor_ultima = s;
+    pthread_cond_signal(&escritor_hay);
+    pthread_mutex_unlock(&escritor_mutex);
+}
+
+Sesion *sesion_escrita_siguiente(void) {
+    uint64_t cuenta;
+    if (read(escritor_evento, &cuenta, sizeof(cuenta)) < 0 && errno != EAGAIN)
+        reg_errno("read eventfd");
+    pthread_mutex_lock(&escritor_mutex);
+    Sesion *s = escritor_hechas;
+    if (s)
+        escritor_hechas = s->sig_escritor;
+    pthread_mutex_unlock(&escritor_mutex);
+    return s;
+}
+
+// Una sesión que se cierra con una tanda en el hilo escritor la espera
+static void esperar_escritor(Sesion *s) {
+    pthread_mutex_lock(&escritor_mutex);
+    while (!s->escrita)
+        pthread_cond_wait(&escritor_listo, &escritor_mutex);
+    for (Sesion **p = &escritor_hechas; *p; p = &(*p)->sig_escritor) {
+        if (*p == s) {
+            *p = s->sig_escritor;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&escritor_mutex);
+    s->en_escritor = 0;
+}
+
+// 'escritura' tiene lugar para blksize + 1 bytes más: un DATA netascii y el CR anterior
+static int guardar(Sesion *s, const unsigned char *datos, size_t len) {
+    if (s->netascii)
+        len = netascii_decodificar(datos, len, s->escritura + s->pendiente, &s->cr_pendiente);
+    else
+        memcpy(s->escritura + s->pendiente, datos, len);
+    s->pendiente += len;
+    s->offset += len;
+    if (s->pendiente < ESCRITURA_LOTE)
+        return 0;
+    if (!escritura_diferida)
+        return volcar(s, 0);
+    // Con el escritor ocupado la tanda espera: sesion_recibir() deja de confirmar
+    if (!s->en_escritor)
+        diferir(s, 0);
+    return 0;
+}
+
+/*
+ * Último bloque: termina de escribir y pone el archivo en su lugar.
+ * Devuelve 0 o el código de ERROR para el cliente.
+ */
+static int confirmar_archivo(Sesion *s) {
+    // netascii: un CR al final del archivo ya no va a tener pareja
+    if (s->cr_pendiente)
+        guardar(s, NULL, 0);
+    if (volcar(s, 1) < 0)
+        return TFTP_ERR_DISKFULL;
+    return cerrar_archivo(s);
+}
+
+/*
+ * Reserva los bytes anunciados con tsize. Si el sistema de archivos no
+ * soporta fallocate(), al menos se compara con el espacio libre.
+ */
+static int reservar(Sesion *s) {
+    if (fallocate(s->fd, FALLOC_FL_KEEP_SIZE, 0, s->tsize) == 0)
+        return 0;
+    if (errno == ENOSPC || errno == EFBIG)
+        return -1;
+    struct statvfs vfs;
+    if (fstatvfs(s->fd, &vfs) == 0 && (unsigned long long)vfs.f_bavail * vfs.f_frsize < (unsigned long long)s->tsize)
+        return -1;
+    return 0;
+}
+
+static int tftp_wrq(Sesion *s) {
+    reg_info("Received WRQ for file: %s, mode: %s", s->archivo, s->modo);
+
+    if (access(s->archivo, F_OK) == 0) {
+        send_error(s, TFTP_ERR_EXISTS, "File already exists");
+        return SESION_FIN;
+    }
+    // Junto al destino, para que el rename final quede en el mismo sistema de archivos
+    snprintf(s->temporal, sizeof(s->temporal), "%s.XXXXXX", s->archivo);
+    s->fd = mkostemp(s->temporal, O_CLOEXEC);
+    if (s->fd < 0) {
+        s->temporal[0] = '\0';
+        send_error(s, TFTP_ERR_ACCESS, "Access violation");
+        return SESION_FIN;
+    }
+    fchmod(s->fd, 0644);
+
+    // Con tsize se reserva el espacio de una vez: sin lugar, se avisa antes de recibir nada
+    if (s->tsize > 0 && reservar(s) < 0) {
+        send_error(s, TFTP_ERR_DISKFULL, "Disk full or allocation exceeded");
+        return SESION_FIN;
+    }
+    s->escritura = malloc(ESCRITURA_LOTE + s->blksize + 1);
+    // Con el hilo escritor, el segundo buffer se llena mientras se escribe el primero
+    if (escritura_diferida)
+        s->volcando = malloc(ESCRITURA_LOTE + s->blksize + 1);
+    if (!s->escritura || (escritura_diferida && !s->volcando)) {
+        send_error(s, TFTP_ERR_DISKFULL, "Disk full or allocation exceeded");
+        return SESION_FIN;
+    }
+
+    // ACK 0 (u OACK si hubo opciones) para que el cliente comience a mandar datos
+    s->bloque = 0;
+    s->offset = 0;
+    s->reintentos = 0;
+    cronometrar(s, 0);
+    if (s->oack)
+        transmitir(s);
+    else
+        send_ack(s, 0);
+    return SESION_SIGUE;
+}
+
+int sesion_oack_opcion(Sesion *s, const char *nombre, const char *formato, ...) {
+    char valor[32];
+    va_list args;
+    va_start(args, formato);
+    vsnprintf(valor, sizeof(valor), formato, args);
+    va_end(args);
+
+    if (s->paquete_len < 2)
+        s->paquete_len = 2;
+    size_t resta = MAX_BUFFER - s->paquete_len;
+    int n = snprintf((char *)s->paquete + s->paquete_len, resta, "%s%c%s", nombre, 0, valor);
+    if (n < 0 || (size_t)n >= resta)
+        return -1;
+    s->paquete_len += n + 1;
+    return 0;
+}
+
+/*
+ * Opciones de RFC 2347 a continuación del modo: pares nombre\0valor\0.
+ * Las que se aceptan quedan en un OACK armado en s->paquete; las
+ * desconocidas se ignoran, como pide la RFC, y también las que ya no
+ * entran en el OACK: la sesión sigue con el valor por defecto.
+ */
+static void negociar_opciones(Sesion *s, const char *p, const char *fin) {
+    s->paquete_len = 2;
+
+    while (p < fin) {
+        const char *nombre = p;
+        const char *nul = memchr(p, '\0', fin - p);
+        if (!nul || nul + 1 >= fin)
+            break;
+        const char *valor = nul + 1;
+        nul = memchr(valor, '\0', fin - valor);
+        if (!nul)
+            break;
+        p = nul + 1;
+
+        if (strcasecmp(nombre, "blksize") == 0) {
+            int pedido = atoi(valor);
+            if (pedido < 8)
+                continue; // valor inválido: se sigue con 512
+            pedido = pedido < blksize_max ? pedido : blksize_max;
+            if (sesion_oack_opcion(s, "blksize", "%d", pedido) == 0)
+                s->blksize = pedido;
+        } else if (strcasecmp(nombre, "windowsize") == 0) {
+            int pedido = atoi(valor);
+            if (pedido < 1)
+                continue;
+            pedido = pedido < MAX_VENTANA ? pedido : MAX_VENTANA;
+            if (sesion_oack_opcion(s, "windowsize", "%d", pedido) == 0)
+                s->ventana = pedido;
+        } else if (strcasecmp(nombre, "rollover") == 0) {
+            // No es una RFC, pero varios clientes y servidores lo entienden así
+            if (strcmp(valor, "0") != 0 && strcmp(valor, "1") != 0)
+                continue;
+            if (sesion_oack_opcion(s, "rollover", "%d", atoi(valor)) < 0)
+                continue;
+            s->rollover = atoi(valor);
+            s->rollover_acordado = 1;
+        } else if (strcasecmp(nombre, "timeout") == 0) {
+            // RFC 2349: de 1 a 255 segundos; reemplaza al RTO adaptativo
+            int pedido = atoi(valor);
+            if (pedido < 1 || pedido > 255 || sesion_oack_opcion(s, "timeout", "%d", pedido) < 0)
+                continue;
+            s->timeout = pedido;
+            s->rto_ns = (uint64_t)pedido * 1000000000;
+        } else if (strcasecmp(nombre, "tsize") == 0) {
+            // En un WRQ el cliente anuncia cuánto va a mandar (RFC 2349)
+            long long pedido = atoll(valor);
+            if (pedido < 0)
+                continue;
+            if (s->tipo == OPCODE_RRQ) {
+                s->tsize = 0; // el tamaño se agrega al OACK al abrir el archivo
+                continue;
+            }
+            if (sesion_oack_opcion(s, "tsize", "%lld", pedido) == 0)
+                s->tsize = pedido;
+        } else if (strcasecmp(nombre, "multicast") == 0) {
+            // Se responde al armar el grupo, con su dirección (RFC 2090)
+            s->multicast = multicast_red.s_addr != 0;
+        }
+    }
+
+    if (s->paquete_len > 2 || s->tsize == 0) {
+        uint16_t op_net = htons(OPCODE_OACK);
+        memcpy(s->paquete, &op_net, 2);
+        s->oack = 1;
+    }
+}
+
+int sesion_iniciar(Sesion *s, int sock, const char *pedido, int len, const struct sockaddr_in *cliente) {
+    memset(s, 0, sizeof(*s));
+    s->sock = sock;
+    s->fd = -1;
+    s->pos_timer = -1;
+    s->cliente = *cliente;
+    s->blksize = BLOCK_SIZE;
+    s->ventana = 1;
+    s->tsize = -1;
+    s->rollover = rollover_defecto;
+    s->rto_ns = (uint64_t)RTO_INICIAL_MS * 1000000;
+    metricas_empieza(s);
+    s->paquete = malloc(MAX_BUFFER);
+    if (!s->paquete) {
+        reg_errno("malloc");
+        return SESION_FIN;
+    }
+
+    // Con el socket conectado el kernel descarta lo que llegue de otro TID
+    if (connect(sock, (const struct sockaddr *)cliente, sizeof(*cliente)) < 0) {
+        reg_errno("connect");
+        return SESION_FIN;
+    }
+    // Un socket reutilizado puede traer datagramas de la sesión anterior
+    unsigned char descarte[MAX_BUFFER];
+    while (recv(sock, descarte, sizeof(descarte), MSG_DONTWAIT) >= 0 || errno == ECONNREFUSED)
+        ;
+
+    // Pedido: opcode, nombre, 0, modo, 0
+    const char *fin = pedido + len;
+    const char *filename = pedido + 2;
+    const char *nul = len > 2 ? memchr(filename, '\0', fin - filename) : NULL;
+    const char *mode = nul ? nul + 1 : NULL;
+    if (!nul || mode >= fin || !memchr(mode, '\0', fin - mode) ||
+        nul - filename >= MAX_NOMBRE || strlen(mode) >= sizeof(s->modo)) {
+        send_error(s, TFTP_ERR_ILLEGAL, "Illegal TFTP operation");
+        return SESION_FIN;
+    }
+    strcpy(s->archivo, filename);
+    strcpy(s->modo, mode);
+    for (char *c = s->modo; *c; c++)
+        *c = tolower((unsigned char)*c);
+    // Cualquier otro modo ("octet", o el viejo "mail") se trata como octet
+    s->netascii = strcmp(s->modo, "netascii") == 0;
+
+    s->tipo = ntohs(*(uint16_t *)pedido);
+    negociar_opciones(s, mode + strlen(mode) + 1, fin);
+    if (s->blksize > BLOCK_SIZE) {
+        // El OACK ya armado se conserva al agrandar el buffer
+        unsigned char *grande = realloc(s->paquete, 4 + s->blksize);
+        if (!grande) {
+            send_error(s, TFTP_ERR_OPTION, "Option negotiation failed");
+            return SESION_FIN;
+        }
+        s->paquete = grande;
+    }
+    if (s->tipo == OPCODE_WRQ && s->ventana > 1) {
+        // Lugar para dos ventanas de DATA: con bloques grandes el buffer por defecto no alcanza
+        int bytes = 2 * s->ventana * (4 + s->blksize), actual;
+        socklen_t largo = sizeof(actual);
+        if (getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &actual, &largo) == 0 && actual < bytes)
+            setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes));
+    }
+
+    if (usar_offload) {
+        // Solo un WRQ con ventana recibe ráfagas de DATA iguales. Se fija
+        // siempre porque en el modo pool el socket viene de otra sesión.
+        int gro = s->tipo == OPCODE_WRQ && s->ventana > 1;
+        if (setsockopt(sock, SOL_UDP, UDP_GRO, &gro, sizeof(gro)) == 0)
+            s->gro = gro;
+    }
+    if (s->tipo == OPCODE_RRQ)
+        return tftp_rrq(s);
+    if (s->tipo == OPCODE_WRQ)
+        return tftp_wrq(s);
+
+    reg_aviso("Opcode desconocido: %u", s->tipo);
+    send_error(s, TFTP_ERR_ILLEGAL, "Illegal TFTP operation");
+    return SESION_FIN;
+}
+
+// WRQ completo: la sesión sigue hasta que pase la espera sin que vuelva el DATA final
+static void esperar_final(Sesion *s) {
+    uint64_t espera_ms = s->timeout ? 2000ull * s->timeout : ESPERA_FINAL_MS;
+    s->vence_ns = monotonic_ns() + espera_ms * 1000000;
+}
+
+// Archivo en su lugar (error 0): último ACK y la espera por si se pierde; si no, el ERROR
+static int terminar_wrq(Sesion *s, int error) {
+    if (error) {
+        send_error(s, error, error == TFTP_ERR_EXISTS ? "File already exists" :
+                   error == TFTP_ERR_DISKFULL ? "Disk full or allocation exceeded" : "Access violation");
+        return SESION_FIN;
+    }
+    s->en_ventana = 0;
+    s->confirmando = 0;
+    cronometrar(s, s->bloque);
+    send_ack(s, en_cable(s, s->bloque));
+    reg_info("Archivo recibido exitosamente: %s (%lld bytes)", s->archivo, (long long)s->offset);
+    s->resultado = FIN_COMPLETA;
+    metricas_termina(s); // la espera que sigue no es parte de la transferencia
+    s->terminada = 1;
+    esperar_final(s);
+    return SESION_SIGUE;
+}
+
+int sesion_recibir(Sesion *s, const unsigned char *paquete, int len) {
+    if (len < 4)
+        return SESION_SIGUE;
+
+    uint16_t opcode = ntohs(*(uint16_t *)paquete);
+    uint16_t block = ntohs(*(uint16_t *)(paquete + 2));
+
+    // WRQ completo: si vuelve el DATA final, el último ACK se perdió
+    if (s->terminada) {
+        if (opcode == OPCODE_DATA && block == en_cable(s, s->bloque)) {
+            if (enviar_control(s, s->paquete, s->paquete_len) >= 0) {
+                s->enviados++;
+                s->envios++;
+            }
+            esperar_final(s);
+        }
+        return SESION_SIGUE;
+    }
+
+    if (opcode == OPCODE_ERROR) {
+        reg_aviso("El cliente abortó %s: error %u", s->archivo, block);
+        s->resultado = FIN_ABORTADA;
+        return SESION_FIN;
+    }
+
+    if (s->tipo == OPCODE_RRQ) {
+        if (opcode != OPCODE_ACK) {
+            send_error(s, TFTP_ERR_ILLEGAL, "Illegal TFTP operation");
+            return SESION_FIN;
+        }
+
+        if (s->oack) {
+            if (block != 0)
+                return SESION_SIGUE;
+            s->oack = 0; // ACK 0: el cliente aceptó las opciones
+            if (s->midiendo)
+                medir_rtt(s);
+            s->bloque = s->siguiente = 1;
+            s->reintentos = 0;
+            return enviar_ventana(s);
+        }
+
+        // El ACK es acumulativo: confirma algún bloque entre bloque-1 y siguiente-1
+        uint64_t avance = adelante(s, s->bloque - 1, block);
+        if (avance > s->siguiente - s->bloque)
+            return SESION_SIGUE; // viejo o de fuera de la ventana
+
+        if (avance == 0) {
+            s->duplicados++;
+            /*
+             * El cliente sigue esperando el primer bloque de la ventana: se
+             * perdió. Se reenvía una sola vez por hueco; en stop-and-wait no
+             * se reacciona a ACK duplicados (síndrome del aprendiz de brujo).
+             */
+            if (s->ventana == 1 || s->retrocedio)
+                return SESION_SIGUE;
+            s->retrocedio = 1;
+        } else {
+            uint64_t confirmado = s->bloque - 1 + avance;
+            reg_debug_cada(256, "%s: ACK %u, confirmado %llu de %llu", s->archivo, block,
+                           (unsigned long long)confirmado, (unsigned long long)s->total_bloques);
+            if (s->midiendo && confirmado >= s->marca)
+                medir_rtt(s);
+            if (confirmado == s->total_bloques) {
+                reg_info("Archivo enviado exitosamente.");
+                s->resultado = FIN_COMPLETA;
+                return SESION_FIN;
+            }
+            s->bloque = confirmado + 1;
+            s->retrocedio = 0;
+            s->reintentos = 0;
+        }
+        // Go-back-N: la próxima ventana empieza después del último bloque confirmado
+        s->siguiente = s->bloque;
+        return enviar_ventana(s);
+    }
+
+    if (opcode != OPCODE_DATA) {
+        reg_aviso("Esperado DATA (3), recibido opcode %d", opcode);
+        send_error(s, TFTP_ERR_ILLEGAL, "Illegal TFTP operation");
+        return SESION_FIN;
+    }
+
+    /*
+     * Esperando al hilo escritor no hay dónde guardar más: lo que llegue se
+     * descarta y el ACK que sale al terminar la tanda hace que el cliente
+     * lo repita.
+     */
+    if (s->detenida || s->confirmando)
+        return SESION_SIGUE;
+
+    // Sin la opción, quien manda los DATA elige el rollover: se ve en la primera vuelta
+    if (!s->rollover_acordado && s->bloque == UINT16_MAX && block == !s->rollover)
+        s->rollover = block;
+
+    if (block != en_cable(s, s->bloque + 1)) {
+        /*
+         * Hueco en la ventana o bloque repetido: confirmar el último recibido
+         * en orden para que el cliente retome desde ahí. Una vez por ráfaga:
+         * mientras los bloques sigan avanzando son de la misma ventana; si la
+         * distancia no crece, el cliente volvió a empezar y se confirma otra vez.
+         */
+        int lejos = distancia(s, block, s->bloque + 1);
+        s->duplicados++;
+        if (!s->retrocedio || lejos <= s->fuera) {
+            s->retrocedio = 1;
+            s->en_ventana = 0;
+            s->midiendo = 0; // el próximo DATA puede responder a cualquiera de los ACK
+            send_ack(s, en_cable(s, s->bloque));
+        }
+        s->fuera = lejos;
+        return SESION_SIGUE;
+    }
+
+    int data_size = len - 4;
+    if (data_size > s->blksize) {
+        send_error(s, TFTP_ERR_ILLEGAL, "Illegal TFTP operation");
+        return SESION_FIN;
+    }
+    s->oack = 0;
+    if (s->midiendo)
+        medir_rtt(s); // primer bloque después del ACK (u OACK) cronometrado
+    if (guardar(s, paquete + 4, data_size) < 0) {
+        send_error(s, TFTP_ERR_DISKFULL, "Disk full or allocation exceeded");
+        return SESION_FIN;
+    }
+    s->bloque++;
+    s->retrocedio = 0;
+    s->reintentos = 0;
+    reg_debug_cada(256, "%s: bloque %llu recibido (%d bytes)", s->archivo,
+                   (unsigned long long)s->bloque, data_size);
+
+    // El último ACK sale recién con el archivo en su lugar: confirma la subida entera
+    if (data_size < s->blksize) {
+        if (!escritura_diferida)
+            return terminar_wrq(s, confirmar_archivo(s));
+        // netascii: un CR al final del archivo ya no va a tener pareja
+        if (s->cr_pendiente)
+            guardar(s, NULL, 0);
+        s->confirmando = 1;
+        if (!s->en_escritor)
+            diferir(s, 1);
+        rearmar(s);
+        return SESION_SIGUE;
+    }
+
+    // Buffer lleno con la tanda anterior todavía en el escritor: se confirma al terminar
+    if (s->pendiente >= ESCRITURA_LOTE) {
+        s->detenida = 1;
+        rearmar(s);
+        return SESION_SIGUE;
+    }
+
+    // Se confirma al completar la ventana
+    if (++s->en_ventana >= s->ventana) {
+        s->en_ventana = 0;
+        cronometrar(s, s->bloque);
+        send_ack(s, block);
+    } else {
+        rearmar(s);
+    }
+    return SESION_SIGUE;
+}
+
+int sesion_escrita(Sesion *s) {
+    s->en_escritor = 0;
+    if (s->volcando_final || (s->volcando_error && s->confirmando))
+        return terminar_wrq(s, s->volcando_error);
+    if (s->volcando_error) {
+        send_error(s, TFTP_ERR_DISKFULL, "Disk full or allocation exceeded");
+        return SESION_FIN;
+    }
+    if (s->confirmando) {
+        diferir(s, 1);
+        return SESION_SIGUE;
+    }
+    if (s->detenida) {
+        // Lo que esperaba va al escritor y el cliente sigue después del último bloque guardado
+        s->detenida = 0;
+        diferir(s, 0);
+        s->en_ventana = 0;
+        s->midiendo = 0;
+        send_ack(s, en_cable(s, s->bloque));
+    }
+    return SESION_SIGUE;
+}
+
+/*
+ * Como sesion_drenar() pero con UDP_GRO: cada lectura puede traer varios
+ * DATA pegados, todos del tamaño que informa el cmsg salvo el último.
+ */
+static int drenar_gro(Sesion *s, unsigned char *area, size_t area_len) {
+    struct mmsghdr msgs[LOTE];
+    struct iovec iov[LOTE];
+    char control[LOTE][CMSG_SPACE(sizeof(int))];
+
+    int slots = area_len / MAX_GRO_BYTES < LOTE ? area_len / MAX_GRO_BYTES : LOTE;
+    for (int i = 0; i < slots; i++) {
+        iov[i].iov_base = area + (size_t)i * MAX_GRO_BYTES;
+        iov[i].iov_len = MAX_GRO_BYTES;
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (1) {
+        for (int i = 0; i < slots; i++) {
+            msgs[i].msg_hdr.msg_control = control[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+        }
+        int n = recvmmsg(s->sock, msgs, slots, MSG_DONTWAIT, NULL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR || errno == ECONNREFUSED)
+                return SESION_SIGUE;
+            reg_errno("recvmmsg");
+            return SESION_FIN;
+        }
+        s->recepciones++;
+
+        for (int i = 0; i < n; i++) {
+            const unsigned char *datos = iov[i].iov_base;
+            int len = msgs[i].msg_len;
+            int segmento = len;
+            struct cmsghdr *cm;
+            for (cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cm; cm = CMSG_NXTHDR(&msgs[i].msg_hdr, cm)) {
+                if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+                    memcpy(&segmento, CMSG_DATA(cm), sizeof(segmento));
+            }
+            if (segmento <= 0)
+                segmento = len;
+
+            for (int off = 0; off < len; off += segmento) {
+                s->recibidos++;
+                int parte = len - off < segmento ? len - off : segmento;
+                if (sesion_recibir(s, datos + off, parte) == SESION_FIN)
+                    return SESION_FIN;
+            }
+        }
+        if (n < slots)
+            return SESION_SIGUE;
+    }
+}
+
+int sesion_drenar(Sesion *s, unsigned char *area, size_t area_len) {
+    if (s->grupo)
+        return multicast_drenar(s, area, area_len);
+    if (s->gro)
+        return drenar_gro(s, area, area_len);
+
+    struct mmsghdr msgs[LOTE];
+    struct iovec iov[LOTE];
+
+    // Un byte más que el mayor paquete válido: así un DATA excedido se detecta
+    size_t slot = s->tipo == OPCODE_WRQ ? 4 + (size_t)s->blksize + 1 : MAX_BUFFER;
+    // En stop-and-wait llega un paquete por vez y recv() es más barato
+    if (s->ventana == 1) {
+        int r;
+        while ((r = recv(s->sock, area, slot, 0)) >= 0) {
+            s->recepciones++;
+            s->recibidos++;
+            if (sesion_recibir(s, area, r) == SESION_FIN)
+                return SESION_FIN;
+        }
+        if (errno == EAGAIN || errno == EINTR || errno == ECONNREFUSED)
+            return SESION_SIGUE;
+        reg_errno("recv");
+        return SESION_FIN;
+    }
+
+    int slots = area_len / slot < LOTE ? area_len / slot : LOTE;
+    for (int i = 0; i < slots; i++) {
+        iov[i].iov_base = area + i * slot;
+        iov[i].iov_len = slot;
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (1) {
+        int n = recvmmsg(s->sock, msgs, slots, MSG_DONTWAIT, NULL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR || errno == ECONNREFUSED)
+                return SESION_SIGUE;
+            reg_errno("recvmmsg");
+            return SESION_FIN;
+        }
+        s->recepciones++;
+        s->recibidos += n;
+        for (int i = 0; i < n; i++) {
+            if (sesion_recibir(s, iov[i].iov_base, msgs[i].msg_len) == SESION_FIN)
+                return SESION_FIN;
+        }
+        if (n < slots)
+            return SESION_SIGUE; // lote incompleto: el socket quedó vacío
+    }
+}
+
+int sesion_vencida(Sesion *s) {
+    if (s->terminada)
+        return SESION_FIN; // pasó la espera del WRQ sin que se repitiera el DATA final
+    if (s->detenida || s->confirmando) {
+        rearmar(s); // el cliente no tiene la culpa de que el disco tarde
+        return SESION_SIGUE;
+    }
+    if (++s->reintentos > MAX_REINTENTOS) {
+        s->resultado = FIN_ABANDONADA; // en un grupo, salvo que otro maestro termine
+        if (s->grupo)
+            return multicast_sin_maestro(s);
+        reg_aviso("Sin respuesta del cliente para %s, se abandona", s->archivo);
+        return SESION_FIN;
+    }
+    s->vencimientos++;
+    // Backoff exponencial; lo que se retransmite ya no sirve para medir (Karn)
+    if (!s->timeout)
+        s->rto_ns = s->rto_ns * 2 < (uint64_t)RTO_MAX_MS * 1000000 ? s->rto_ns * 2 : (uint64_t)RTO_MAX_MS * 1000000;
+    s->midiendo = 0;
+    reg_debug("%s: venció el RTO, reintento %d (RTO %llu ms)", s->archivo, s->reintentos,
+              (unsigned long long)(s->rto_ns / 1000000));
+    if (s->oack) {
+        transmitir(s);
+    } else if (s->tipo == OPCODE_RRQ) {
+        // Se repite la ventana entera desde el primer bloque sin confirmar
+        s->siguiente = s->bloque;
+        return enviar_ventana(s);
+    } else {
+        // Confirmar lo recibido en orden hasta ahora
+        s->en_ventana = 0;
+        send_ack(s, en_cable(s, s->bloque));
+    }
+    return SESION_SIGUE;
+}
+
+void sesion_atender(Sesion *s) {
+    unsigned char area[LOTE_BYTES];
+    struct pollfd pfd = { .fd = s->sock, .events = POLLIN };
+
+    while (1) {
+        uint64_t ahora = monotonic_ns();
+        int espera = s->vence_ns > ahora ? (int)((s->vence_ns - ahora + 999999) / 1000000) : 0;
+        int r = poll(&pfd, 1, espera);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            reg_errno("poll");
+            return;
+        }
+        if (r == 0) {
+            if (sesion_vencida(s) == SESION_FIN)
+                return;
+            continue;
+        }
+
+        if (sesion_drenar(s, area, sizeof(area)) == SESION_FIN)
+            return;
+    }
+}
+
+void sesion_cerrar(Sesion *s) {
+    if (s->envios > 0 && s->recepciones > 0)
+        reg_info("%s: %llu paquetes en %llu envíos (%.1f/llamada), %llu en %llu recepciones (%.1f/llamada)",
+                 s->archivo,
+                 (unsigned long long)s->enviados, (unsigned long long)s->envios,
+                 (double)s->enviados / s->envios,
+                 (unsigned long long)s->recibidos, (unsigned long long)s->recepciones,
+                 (double)s->recibidos / s->recepciones);
+    metricas_termina(s);
+    if (s->en_escritor)
+        esperar_escritor(s);
+    if (s->grupo)
+        multicast_cerrar(s->grupo);
+    if (s->fd >= 0)
+        close(s->fd);
+    if (s->temporal[0])
+        unlink(s->temporal); // WRQ que no terminó: no deja un archivo a medias
+    if (s->sock >= 0)
+        close(s->sock);
+    if (s->cacheado)
+        cache_soltar(s->cacheado);
+    else if (s->mapa)
+        munmap(s->mapa, s->tamano);
+    free(s->paquete);
+    free(s->lote);
+    free(s->escritura);
+    free(s->volcando);
+    free(s->cortes);
+    free(s->crudo);
+    s->fd = -1;
+    s->sock = -1;
+    s->paquete = NULL;
+    s->lote = NULL;
+    s->escritura = NULL;
+    s->volcando = NULL;
+    s->cortes = NULL;
+    s->crudo = NULL;
+    s->temporal[0] = '\0';
+    s->mapa = NULL;
+    s->cacheado = NULL;
+    s->grupo = NULL;
+}
+
+void sesion_ofrecer(Sesion *s) {
+    s->oack = 1;
+    s->reintentos = 0;
+    s->midiendo = 0;
+    cronometrar(s, 0);
+    transmitir(s);
+}
+
+int sesion_reanudar(Sesion *s, uint64_t confirmado) {
+    if (s->midiendo && (s->oack || confirmado >= s->marca))
+        medir_rtt(s);
+    s->oack = 0;
+    s->bloque = s->siguiente = confirmado + 1;
+    s->retrocedio = 0;
+    s->reintentos = 0;
+    return enviar_ventana(s);
+}
@@ -0,0 +1,269 @@
+/*
+ * Sesión TFTP como máquina de estados.
+ *
+ * Una sesión es una transferencia RRQ o WRQ con un cliente. No bloquea
+ * nunca: cada función procesa un evento (el pedido inicial, un paquete
+ * recibido o el vencimiento del temporizador), envía lo que corresponda y
+ * devuelve si la transferencia sigue. Así la misma lógica la usan el modo
+ * fork (un proceso que espera en su socket con sesion_atender()) y el
+ * motor epoll (un proceso que multiplexa miles de sesiones).
+ */
+#ifndef TFTP_SESION_H
+#define TFTP_SESION_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#define MAX_BUFFER  516        // pedidos RRQ/WRQ y paquetes sin opciones
+#define BLOCK_SIZE  512        // blksize si el cliente no negocia otro
+#define MAX_BLKSIZE 65464      // máximo de RFC 2348
+#define MAX_PAQUETE (4 + MAX_BLKSIZE)
+#define MAX_NOMBRE  256
+#define MAX_VENTANA 1024       // mayor windowsize aceptado (RFC 7440 permite 65535)
+
+/*
+ * E/S por lotes: los DATA de una ventana salen en un sendmmsg() y lo que se
+ * acumuló en el socket se lee con un recvmmsg(), hasta LOTE paquetes por
+ * llamada y sin pasar de LOTE_BYTES de buffers.
+ */
+#define LOTE        32
+#define LOTE_BYTES  (256 * 1024)
+
+/*
+ * Offload de UDP (-g). Con GSO (UDP_SEGMENT) un lote de DATA sale en un solo
+ * sendmsg() y el kernel lo corta en datagramas de 4 + blksize bytes; con GRO
+ * (UDP_GRO) los DATA de un WRQ con ventana llegan de a varios por lectura.
+ */
+#define MAX_SEGMENTOS   64         // segmentos por envío GSO (UDP_MAX_SEGMENTS)
+#define MAX_GSO_BYTES   65507      // mayor carga útil UDP sobre IPv4
+#define MAX_GRO_BYTES   65536      // mayor lectura que arma GRO
+
+#define OPCODE_RRQ   1
+#define OPCODE_WRQ   2
+#define OPCODE_DATA  3
+#define OPCODE_ACK   4
+#define OPCODE_ERROR 5
+#define OPCODE_OACK  6
+
+#define TFTP_ERR_UNDEFINED 0
+#define TFTP_ERR_NOTFOUND 1
+#define TFTP_ERR_ACCESS   2
+#define TFTP_ERR_DISKFULL 3
+#define TFTP_ERR_ILLEGAL  4
+#define TFTP_ERR_EXISTS   6
+#define TFTP_ERR_OPTION   8
+
+/*
+ * Retransmisión con RTO adaptativo (RFC 6298). Hasta tener la primera muestra
+ * de RTT se espera RTO_INICIAL_MS; cada vencimiento duplica el RTO (backoff)
+ * hasta RTO_MAX_MS, y una muestra nueva lo vuelve a calcular.
+ */
+#define RTO_INICIAL_MS  1000
+#define RTO_MIN_MS      20
+#define RTO_MAX_MS      4000
+#define MAX_REINTENTOS  8      // vencimientos seguidos sin respuesta antes de abandonar
+
+/*
+ * El último ACK de un WRQ puede perderse: el cliente repite entonces el DATA
+ * final. La sesión sigue abierta ESPERA_FINAL_MS (o dos veces la opción
+ * timeout) después de mandarlo y lo repite si vuelve ese DATA.
+ */
+#define ESPERA_FINAL_MS 2000
+
+/*
+ * Escritura diferida de los WRQ: cada DATA se confirma apenas se copia a
+ * memoria y lo acumulado baja al archivo en tandas de ESCRITURA_LOTE bytes
+ * alineadas a página. Se escribe en un temporal junto al destino que se
+ * renombra al recibir el último bloque; si la subida falla, se borra.
+ *
+ * En el motor epoll las tandas, el fsync y el rename final los hace un hilo
+ * escritor (sesion_escritor()) y el bucle nunca espera al disco. En los modos
+ * fork y pool cada sesión tiene su proceso o hilo y escribe ella misma.
+ */
+#define ESCRITURA_LOTE  (512 * 1024)
+
+#define FSYNC_NUNCA  0         // el kernel baja los datos cuando quiere
+#define FSYNC_FINAL  1         // fsync del archivo y del directorio antes del último ACK
+#define FSYNC_LOTE   2         // además, fdatasync después de cada tanda
+
+// Resultado de procesar un evento
+#define SESION_SIGUE  0
+#define SESION_FIN    1        // terminó (bien o con ERROR enviado); hay que cerrarla
+
+struct Cacheado;               // tftp-cache.h
+struct Grupo;                  // tftp-multicast.h
+struct Corte;                  // tftp-netascii.h
+
+typedef struct Sesion {
+    int sock;                       // socket propio: su puerto es el TID del servidor
+    int fd;                         // archivo servido o recibido
+    int tipo;                       // OPCODE_RRQ u OPCODE_WRQ
+    struct sockaddr_in cliente;
+    char archivo[MAX_NOMBRE];
+    char modo[16];
+    int netascii;                   // modo netascii: LF y CR se traducen al enviar y al recibir
+
+    int blksize;                    // negociado con OACK (RFC 2348), o BLOCK_SIZE
+    int ventana;                    // windowsize negociado (RFC 7440); 1 = stop-and-wait
+    int oack;                       // el paquete en vuelo es el OACK (bloque 0)
+    int rollover;                   // número de bloque después del 65535: 0 o 1
+    int rollover_acordado;          // vino en la opción "rollover"; si no, en un WRQ lo fija el cliente
+    int multicast;                  // el RRQ pidió la opción multicast (RFC 2090)
+    int timeout;                    // segundos pedidos con la opción timeout (RFC 2349); 0 = RTO adaptativo
+    struct Grupo *grupo;            // RRQ multicast: grupo al que van los DATA (o NULL)
+
+    /*
+     * Los bloques se numeran desde 1 sin límite; en el cable viaja el número
+     * truncado a 16 bits. Los ACK se ubican dentro de la ventana en vuelo.
+     */
+    uint64_t bloque;                // RRQ: primer bloque sin confirmar; WRQ: último recibido en orden
+    uint64_t siguiente;             // RRQ: próximo bloque a enviar de la ventana
+    uint64_t total_bloques;         // RRQ: bloques del archivo, incluido el final corto (netascii: UINT64_MAX hasta armarlo)
+    off_t tamano;                   // RRQ: tamaño del archivo
+    off_t largo;                    // RRQ: bytes que viajan (en netascii, se sabe al armar el último bloque)
+    unsigned char *mapa;            // RRQ: archivo mapeado de solo lectura (o NULL)
+    struct Cacheado *cacheado;      // RRQ: entrada de la caché dueña del mapa (o NULL)
+    struct Corte *cortes;           // RRQ netascii: dónde empieza en el archivo cada bloque en vuelo
+    unsigned char *crudo;           // RRQ netascii sin mapa: texto leído para traducir un bloque
+    off_t offset;                   // WRQ: posición en el archivo del próximo bloque
+    off_t tsize;                    // WRQ: tamaño anunciado (RFC 2349); RRQ: 0 si lo pidió (no se responde en netascii); si no, -1
+    char temporal[MAX_NOMBRE + 8];  // WRQ: archivo que se renombra al terminar ("" = ya no hay)
+    unsigned char *escritura;       // WRQ: datos confirmados que todavía no se escribieron
+    size_t pendiente;               // WRQ: bytes en 'escritura'; terminan en 'offset'
+    int en_ventana;                 // WRQ: bloques recibidos desde el último ACK
+    int cr_pendiente;               // WRQ netascii: el último bloque terminó en CR
+    int fuera;                      // WRQ: distancia del último bloque fuera de orden al esperado
+    int retrocedio;                 // ya se reaccionó al hueco actual; esperar progreso
+    int terminada;                  // WRQ: ya salió el último ACK; se espera por si se perdió
+
+    // WRQ con el hilo escritor: la tanda que baja mientras se llena 'escritura'
+    unsigned char *volcando;        // el otro buffer; es del escritor mientras en_escritor
+    size_t volcando_len;
+    off_t volcando_inicio;
+    int volcando_final;             // la tanda cierra el archivo: fsync y rename
+    int volcando_error;             // código de ERROR que dejó el escritor (0 = bien)
+    int en_escritor;                // hay una tanda que sesion_escrita() todavía no procesó
+    int escrita;                    // el escritor terminó la tanda (con su mutex)
+    int detenida;                   // buffer lleno con el escritor ocupado: no se confirma
+    int confirmando;                // llegó el último bloque; su ACK sale con el archivo en su lugar
+    struct Sesion *sig_escritor;    // colas del escritor
+
+    unsigned char *paquete;         // último DATA/ACK/OACK enviado, para retransmitir
+    size_t paquete_len;
+    unsigned char *lote;            // RRQ con ventana sin mapa o netascii: DATA armados para un sendmmsg (o NULL)
+    int lote_slots;                 // DATA por sendmmsg (o por envío GSO)
+    int gso;                        // el lote sale con UDP_SEGMENT
+    int gro;                        // el socket tiene UDP_GRO activo
+
+    // Paquetes y llamadas al sistema, para ver cuánto rinde cada lote
+    uint64_t enviados, envios;
+    uint64_t recibidos, recepciones;
+
+    uint64_t vence_ns;              // cuándo retransmitir (reloj monotónico)
+    int reintentos;
+
+    /*
+     * Estimación de RTT: se cronometra un paquete por vez (un bloque en RRQ,
+     * el OACK o un ACK en WRQ) y por la regla de Karn la medición se descarta
+     * si ese paquete se retransmite antes de la respuesta.
+     */
+    uint64_t srtt_ns;               // 0 = todavía sin muestras
+    uint64_t rttvar_ns;
+    uint64_t rto_ns;
+    int midiendo;
+    uint64_t marca;                 // bloque cronometrado
+    uint64_t marca_ns;              // cuándo se envió
+    uint64_t maximo;                // RRQ: mayor bloque enviado alguna vez
+    int pos_timer;                  // posición en el heap de temporizadores del motor
+    uint64_t huella;                // hash del pedido, para la tabla de pedidos repetidos del motor
+
+    // Para las métricas (tftp-metricas.h): se suman al cerrar la sesión
+    uint64_t inicio_ns;             // cuándo llegó el pedido (0 = ya sumada)
+    uint64_t vencimientos;          // RTO vencidos, sin volver a cero como 'reintentos'
+    uint64_t duplicados;            // RRQ: ACK repetidos; WRQ: DATA fuera de orden
+    int resultado;                  // FIN_*: cómo terminó
+    uint16_t codigo_error;          // código del ERROR enviado
+} Sesion;
+
+/*
+ * Mayor blksize que acepta el servidor. Por defecto MAX_BLKSIZE; con una MTU
+ * configurada se limita para que cada DATA entre en un solo datagrama IP.
+ */
+extern int blksize_max;
+
+// Usar GSO/GRO (-g). Se apaga solo si el kernel o la interfaz no lo soportan.
+extern int usar_offload;
+
+// Cuándo forzar los WRQ al disco (-S): FSYNC_NUNCA, FSYNC_FINAL o FSYNC_LOTE
+extern int politica_fsync;
+
+// Los WRQ escriben con el hilo escritor (lo activa sesion_escritor())
+extern int escritura_diferida;
+
+/*
+ * Rollover (-R) de los RRQ sin la opción "rollover": a qué número vuelve el
+ * bloque después del 65535. 0 es lo que espera la mayoría de los clientes;
+ * algunos cargadores de arranque esperan 1. En un WRQ sin la opción se sigue
+ * al cliente: su primer bloque después del 65535 dice cuál usa.
+ */
+extern int rollover_defecto;
+
+uint64_t monotonic_ns(void);
+
+// Socket UDP no bloqueante para una sesión, ligado a 'puerto' (0 = efímero)
+int crear_socket_sesion(uint16_t puerto);
+
+/*
+ * Arranca la sesión a partir del pedido RRQ/WRQ recibido en el puerto
+ * principal. 'sock' pasa a ser de la sesión: se conecta al cliente y se
+ * cierra en sesion_cerrar(). Envía el primer DATA, el ACK 0 o el ERROR.
+ */
+int sesion_iniciar(Sesion *s, int sock, const char *pedido, int len, const struct sockaddr_in *cliente);
+
+// Procesa un paquete recibido en el socket de la sesión
+int sesion_recibir(Sesion *s, const unsigned char *paquete, int len);
+
+/*
+ * Lee con recvmmsg() todo lo que haya en el socket de la sesión y lo procesa
+ * con sesion_recibir(). 'area' son los buffers del lote (al menos
+ * MAX_PAQUETE + 1 bytes); la provee quien llama para no tenerla por sesión.
+ */
+int sesion_drenar(Sesion *s, unsigned char *area, size_t area_len);
+
+// Venció el temporizador: retransmite o abandona
+int sesion_vencida(Sesion *s);
+
+/*
+ * Hilo escritor para el motor epoll: lo arranca y devuelve un eventfd que se
+ * vuelve legible cuando hay tandas terminadas (-1 si no se pudo; los WRQ
+ * escriben entonces en el bucle). sesion_escrita_siguiente() saca una
+ * sesión con su tanda terminada (o NULL) y sesion_escrita() la continúa:
+ * confirma lo que estaba esperando o termina el WRQ.
+ */
+int sesion_escritor(void);
+Sesion *sesion_escrita_siguiente(void);
+int sesion_escrita(Sesion *s);
+
+// Atiende la sesión hasta el final bloqueando en su socket (modo fork)
+void sesion_atender(Sesion *s);
+
+void sesion_cerrar(Sesion *s);
+
+/*
+ * Agrega la opción nombre=valor al OACK que se arma en s->paquete. El OACK
+ * no pasa de MAX_BUFFER, lo que cualquier cliente lee antes de acordar el
+ * blksize: si la opción no entra devuelve -1 y el paquete queda como estaba.
+ */
+int sesion_oack_opcion(Sesion *s, const char *nombre, const char *formato, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/*
+ * Para los grupos multicast: sesion_ofrecer() manda el OACK armado en
+ * s->paquete a s->cliente y espera su ACK; sesion_reanudar() sigue la
+ * transmisión después del bloque 'confirmado', esté donde esté.
+ */
+void sesion_ofrecer(Sesion *s);
+int sesion_reanudar(Sesion *s, uint64_t confirmado);
+
+#endif